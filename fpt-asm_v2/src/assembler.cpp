@@ -191,9 +191,10 @@ void assemble_step3(Program& program, LabelMap& label_map) {
  *   The order is with respect to the address and to each address corresponds
  *   a file and a line within that file.
  *   Binary search through lower_bound or similar function will work fine.
+ * The labels follow them, so that profiles can be grouped by routine.
  */
 
-void assemble_step4(const Program& program, const LabelMap& label_map, const std::string& out_filename, const std::string& dbg_filename) {
+void assemble_step4(const Program& program, const LabelMap& label_map, const std::string& in_filename, const std::string& out_filename, const std::string& dbg_filename) {
     std::ofstream out_file, dbg_file;
     out_file.open(out_filename, std::ios::binary | std::ios::out);
     dbg_file.open(dbg_filename, std::ios::binary | std::ios::out);
@@ -211,11 +212,12 @@ void assemble_step4(const Program& program, const LabelMap& label_map, const std
                 auto& opcode = opcode_v[v_idx];
                 uint16_t big_endian_word = opcode >> 8 | opcode << 8;
                 out_file.write(reinterpret_cast<const char*>(&big_endian_word), 2);
-                dbg_l.emplace_back(addr, dbg_filename, inst.getLineNumber());
+                dbg_l.emplace_back(addr, in_filename, inst.getLineNumber());
             }
         }
     }
     out_file.close();
+    for(const auto& [label, address] : label_map) dbg_l.add_label(label, address);
     dbg_l.serialize(dbg_file);
     dbg_file.close();
 }
@@ -231,6 +233,6 @@ void assemble(const std::string& in_filename, const std::string& out_filename, c
 
         assemble_step3(program, label_map);
 
-        assemble_step4(program, label_map, out_filename, dbg_filename);
+        assemble_step4(program, label_map, in_filename, out_filename, dbg_filename);
     }
 }
\ No newline at end of file
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+#include "BatchJob.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr uint64_t TYPING_SLICE = 1000000;
+
+std::string resolve(const std::string& path, const std::string& base_dir) {
+    if (base_dir.empty() || fs::path(path).is_absolute()) return path;
+    return (fs::path(base_dir) / path).string();
+}
+
+} // namespace
+
+std::vector<BatchJob> parse_manifest(std::istream& is, const std::string& base_dir) {
+    std::vector<BatchJob> jobs;
+    std::set<std::string> names;
+    std::string line;
+    for (int line_no = 1; std::getline(is, line); line_no++) {
+        std::istringstream tokens(line);
+        std::string images;
+        if (!(tokens >> images) || images[0] == '#') continue;
+
+        BatchJob job;
+        std::istringstream image_list(images);
+        for (std::string image; std::getline(image_list, image, ',');)
+            if (!image.empty()) job.images.push_back(resolve(image, base_dir));
+        if (job.images.empty())
+            throw std::logic_error("ERROR: manifest line " + std::to_string(line_no) + ": no image");
+
+        for (std::string option; tokens >> option;) {
+            const auto eq = option.find('=');
+            const std::string key = option.substr(0, eq);
+            const std::string value = (eq == std::string::npos) ? "" : option.substr(eq + 1);
+            if (value.empty()) {
+                throw std::logic_error("ERROR: manifest line " + std::to_string(line_no) + ": invalid option " + option);
+            } else if (key == "input") {
+                job.input = resolve(value, base_dir);
+            } else if (key == "name") {
+                /* The name is a file name in the output directory */
+                if (value.find_first_of("/\\") != std::string::npos)
+                    throw std::logic_error("ERROR: manifest line " + std::to_string(line_no) + ": invalid name " + value);
+                job.name = value;
+            } else if (key == "budget") {
+                try {
+                    job.budget = std::stoull(value);
+                } catch (const std::exception&) {
+                    throw std::logic_error("ERROR: manifest line " + std::to_string(line_no) + ": invalid budget " + value);
+                }
+            } else {
+                throw std::logic_error("ERROR: manifest line " + std::to_string(line_no) + ": unknown option " + key);
+            }
+        }
+
+        if (job.name.empty()) job.name = fs::path(job.images.back()).stem().string();
+        const std::string base_name = job.name;
+        for (int i = 2; !names.insert(job.name).second; i++) job.name = base_name + "." + std::to_string(i);
+        jobs.push_back(std::move(job));
+    }
+    return jobs;
+}
+
+BatchResult run_job(const BatchJob& job, uint64_t default_budget, LC3Machine::Engine engine) {
+    BatchResult result;
+    result.name = job.name;
+
+    auto machine = std::make_unique<LC3Machine>();
+    LC3Machine& m = *machine;
+    m.console.to_memory();
+    install_host_traps(m);
+    m.engine = engine;
+
+    for (const auto& image : job.images) {
+        if (!m.read_image(image.c_str())) {
+            result.error = "failed to load image: " + image;
+            return result;
+        }
+    }
+    std::string script;
+    if (!job.input.empty()) {
+        std::ifstream input(job.input, std::ios::binary);
+        if (!input.is_open()) {
+            result.error = "failed to open input: " + job.input;
+            return result;
+        }
+        script.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    }
+    m.reset();
+
+    /* The keyboard holds a few KB: the script is typed in between slices,
+     * as the program reads it through GETC/IN or by polling KBSR */
+    size_t typed = 0;
+    auto type = [&]() {
+        while (typed < script.size() && m.input.push(script[typed])) typed++;
+        if (typed == script.size()) m.input.close();
+    };
+    const uint64_t budget = job.budget ? job.budget : default_budget;
+    const auto start = std::chrono::steady_clock::now();
+    LC3Machine::StopReason reason;
+    do {
+        type();
+        reason = m.run_for(std::min(budget - m.instructions, TYPING_SLICE));
+    } while ((reason == LC3Machine::StopReason::Budget && m.instructions < budget) ||
+             (reason == LC3Machine::StopReason::WaitingInput && !m.input.closed()));
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    result.instructions = m.instructions;
+    switch (reason) {
+        case LC3Machine::StopReason::Halted:       result.state = ExitState::Halted; break;
+        case LC3Machine::StopReason::WaitingInput: result.state = ExitState::Input;  break;
+        default:                                   result.state = ExitState::Budget; break;
+    }
+    result.output = m.console.take();
+    return result;
+}
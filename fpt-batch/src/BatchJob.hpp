@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "LC3Machine.hpp"
+
+/* One line of the manifest:
+ *
+ *   image[,image...] [input=<file>] [budget=<instructions>] [name=<name>]
+ *
+ * Images are loaded in order, the last one sets the starting PC. The bytes
+ * of the input file are typed on the keyboard, which is closed afterwards:
+ * a program asking for more input stops. Relative paths are relative to the
+ * manifest. Empty lines and lines starting with # are skipped.
+ */
+struct BatchJob {
+    std::string name; /* defaults to the name of the last image, no path separators */
+    std::vector<std::string> images;
+    std::string input;
+    uint64_t budget = 0; /* 0: the runner default */
+};
+
+enum class ExitState {
+    Halted, /* TRAP HALT */
+    Budget, /* still running when the budget ran out */
+    Input,  /* waiting for input after the whole input file was read */
+    Error,  /* could not be started */
+};
+constexpr const char* ExitStateNameMap[] = { "halted", "budget", "input", "error" };
+
+struct BatchResult {
+    std::string name;
+    ExitState state = ExitState::Error;
+    uint64_t instructions = 0;
+    double seconds = 0;
+    std::string output; /* everything written to the console */
+    std::string error;
+};
+
+/* Throws std::logic_error on malformed lines. Names are made unique. */
+std::vector<BatchJob> parse_manifest(std::istream& is, const std::string& base_dir = "");
+
+/* Run job on a fresh machine. Safe to call from many threads at once. */
+BatchResult run_job(const BatchJob& job, uint64_t default_budget,
+                    LC3Machine::Engine engine = LC3Machine::Engine::Jit);
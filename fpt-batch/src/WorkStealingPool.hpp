@@ -0,0 +1,118 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Fixed-size thread pool where every worker owns a task queue.
+ *
+ * submit() deals the tasks round-robin. A worker takes work from the back
+ * of its own queue and, once that is empty, steals from the front of the
+ * others, so that a few long runs do not leave the other cores idle.
+ * Tasks are whole VM runs, coarse enough for a mutex per queue.
+ */
+class WorkStealingPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkStealingPool(unsigned threads = std::thread::hardware_concurrency()) {
+        if (threads == 0) threads = 1;
+        for (unsigned i = 0; i < threads; i++) mQueues.push_back(std::make_unique<Queue>());
+        for (unsigned i = 0; i < threads; i++) mThreads.emplace_back([this, i]() { worker(i); });
+    }
+    ~WorkStealingPool() {
+        wait();
+        {
+            std::unique_lock<std::mutex> lck(mIdleMtx);
+            mStop = true;
+        }
+        mIdleCond.notify_all();
+        for (auto& t : mThreads) t.join();
+    }
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    unsigned size() const { return mThreads.size(); }
+
+    void submit(Task task) {
+        Queue& q = *mQueues[mNext++ % mQueues.size()];
+        {
+            std::unique_lock<std::mutex> lck(q.mtx);
+            q.tasks.push_back(std::move(task));
+        }
+        {
+            std::unique_lock<std::mutex> lck(mIdleMtx);
+            mQueued++;
+            mPending++;
+        }
+        mIdleCond.notify_one();
+    }
+
+    /* Block until every submitted task has run */
+    void wait() {
+        std::unique_lock<std::mutex> lck(mIdleMtx);
+        mDoneCond.wait(lck, [this]() { return mPending == 0; });
+    }
+
+    /* Tasks taken from another worker's queue */
+    uint64_t steals() const { return mSteals; }
+
+private:
+    struct Queue {
+        std::mutex mtx;
+        std::deque<Task> tasks;
+    };
+    std::vector<std::unique_ptr<Queue>> mQueues;
+    std::vector<std::thread> mThreads;
+    std::atomic<unsigned> mNext{0};
+    std::atomic<uint64_t> mSteals{0};
+
+    /* Protected by mIdleMtx */
+    std::mutex mIdleMtx;
+    std::condition_variable mIdleCond, mDoneCond;
+    size_t mQueued = 0;  /* submitted, not reserved by a worker yet */
+    size_t mPending = 0; /* submitted, not finished yet */
+    bool mStop = false;
+
+    /* Own queue first, then steal. The caller has reserved a task by
+     * decrementing mQueued, so one is always found. */
+    void take(unsigned self, Task& task) {
+        for (size_t k = 0; ; k++) {
+            const size_t i = (self + k) % mQueues.size();
+            Queue& q = *mQueues[i];
+            std::unique_lock<std::mutex> lck(q.mtx);
+            if (q.tasks.empty()) continue;
+            if (i == self) {
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            } else {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+                mSteals++;
+            }
+            return;
+        }
+    }
+
+    void worker(unsigned self) {
+        Task task;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lck(mIdleMtx);
+                mIdleCond.wait(lck, [this]() { return mStop || mQueued > 0; });
+                if (mQueued == 0) return;
+                mQueued--;
+            }
+            take(self, task);
+            task();
+            task = nullptr;
+            std::unique_lock<std::mutex> lck(mIdleMtx);
+            if (--mPending == 0) mDoneCond.notify_all();
+        }
+    }
+};
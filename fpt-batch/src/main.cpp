@@ -0,0 +1,118 @@
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "BatchJob.hpp"
+#include "WorkStealingPool.hpp"
+
+const std::map<std::string, LC3Machine::Engine> EngineMap = {
+    {"reference", LC3Machine::Engine::Reference},
+    {"decoded",   LC3Machine::Engine::Decoded},
+    {"threaded",  LC3Machine::Engine::Threaded},
+    {"jit",       LC3Machine::Engine::Jit},
+};
+
+/* A whole decimal number, throws std::logic_error otherwise */
+static uint64_t parse_number(const std::string& s) {
+    size_t end = 0;
+    if (s.empty() || !isdigit((unsigned char) s[0])) throw std::invalid_argument(s);
+    const uint64_t value = std::stoull(s, &end);
+    if (end != s.size()) throw std::invalid_argument(s);
+    return value;
+}
+
+int main(int argc, const char* argv[])
+{
+    unsigned threads = std::thread::hardware_concurrency();
+    uint64_t budget = 100000000;
+    LC3Machine::Engine engine = LC3Machine::Engine::Jit;
+    std::string out_dir;
+    std::string manifest_path;
+
+    for (int j = 1; j < argc; ++j)
+    {
+        const std::string arg = argv[j];
+        if ((arg == "-j" || arg == "-b") && j + 1 < argc) {
+            try {
+                const uint64_t value = parse_number(argv[++j]);
+                if (arg == "-b") budget = value;
+                else if (value <= UINT16_MAX) threads = value;
+                else throw std::out_of_range(argv[j]);
+            } catch (const std::logic_error&) {
+                manifest_path.clear();
+                break;
+            }
+        } else if (arg == "-e" && j + 1 < argc && EngineMap.count(argv[j + 1])) {
+            engine = EngineMap.at(argv[++j]);
+        } else if (arg == "-o" && j + 1 < argc) {
+            out_dir = argv[++j];
+        } else if (manifest_path.empty() && arg[0] != '-') {
+            manifest_path = arg;
+        } else {
+            manifest_path.clear();
+            break;
+        }
+    }
+    if (manifest_path.empty())
+    {
+        /* show usage string */
+        std::cout << "fpt-batch [-j threads] [-b budget] [-e reference|decoded|threaded|jit] [-o out-dir] manifest" << std::endl;
+        exit(2);
+    }
+
+    std::ifstream manifest(manifest_path);
+    if (!manifest.is_open()) {
+        std::cerr << "failed to open manifest: " << manifest_path << std::endl;
+        exit(1);
+    }
+    std::vector<BatchJob> jobs;
+    try {
+        jobs = parse_manifest(manifest, std::filesystem::path(manifest_path).parent_path().string());
+    } catch (const std::logic_error& e) {
+        std::cerr << e.what() << std::endl;
+        exit(1);
+    }
+    if (!out_dir.empty()) std::filesystem::create_directories(out_dir);
+
+    /* Every task owns its slot, results are printed in manifest order */
+    std::vector<BatchResult> results(jobs.size());
+    const auto start = std::chrono::steady_clock::now();
+    uint64_t steals;
+    {
+        WorkStealingPool pool(threads);
+        for (size_t i = 0; i < jobs.size(); i++) {
+            pool.submit([&, i]() {
+                results[i] = run_job(jobs[i], budget, engine);
+                if (!out_dir.empty()) {
+                    std::ofstream out(std::filesystem::path(out_dir) / (results[i].name + ".out"), std::ios::binary);
+                    out << results[i].output;
+                }
+            });
+        }
+        pool.wait();
+        steals = pool.steals();
+        threads = pool.size();
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int failed = 0;
+    uint64_t instructions = 0;
+    std::cout << "name\tstate\tinstructions\tseconds" << std::endl;
+    for (const auto& r : results) {
+        std::cout << r.name << "\t" << ExitStateNameMap[(int)r.state] << "\t" << r.instructions << "\t" << r.seconds << std::endl;
+        if (r.state == ExitState::Error) {
+            std::cerr << r.name << ": " << r.error << std::endl;
+            failed++;
+        }
+        instructions += r.instructions;
+    }
+    std::cerr << jobs.size() << " runs, " << instructions << " instructions in " << seconds << " s on "
+              << threads << " threads (" << instructions / seconds / 1e6 << " MIPS, " << steals << " steals)" << std::endl;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,173 @@
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include "gtest/gtest.h"
+#include "BatchJob.hpp"
+#include "WorkStealingPool.hpp"
+
+class TestManifest : public ::testing::Test {};
+
+TEST_F(TestManifest, Parse) {
+    std::istringstream manifest(
+        "# image input budget\n"
+        "\n"
+        "a.obj\n"
+        "os.obj,game.obj input=game.in budget=1000\n"
+        "   a.obj name=again\n"
+        "sub/a.obj\n");
+    auto jobs = parse_manifest(manifest, "base");
+    ASSERT_EQ(4u, jobs.size());
+
+    EXPECT_EQ("a", jobs[0].name);
+    EXPECT_EQ(std::vector<std::string>{"base/a.obj"}, jobs[0].images);
+    EXPECT_EQ("", jobs[0].input);
+    EXPECT_EQ(0u, jobs[0].budget);
+
+    EXPECT_EQ("game", jobs[1].name);
+    EXPECT_EQ((std::vector<std::string>{"base/os.obj", "base/game.obj"}), jobs[1].images);
+    EXPECT_EQ("base/game.in", jobs[1].input);
+    EXPECT_EQ(1000u, jobs[1].budget);
+
+    EXPECT_EQ("again", jobs[2].name);
+    EXPECT_EQ("a.2", jobs[3].name);
+}
+
+TEST_F(TestManifest, Errors) {
+    for (auto line : {"a.obj budget=lots", "a.obj speed=2", "a.obj input", ", budget=1",
+                      "a.obj name=../x", "a.obj name=out/x", "a.obj name=..\\x"}) {
+        std::istringstream manifest(line);
+        EXPECT_THROW(parse_manifest(manifest), std::logic_error) << line;
+    }
+}
+
+class TestPool : public ::testing::Test {};
+
+TEST_F(TestPool, RunsEveryTask) {
+    std::atomic<int> done{0};
+    {
+        WorkStealingPool pool(4);
+        for (int i = 0; i < 1000; i++) pool.submit([&]() { done++; });
+        pool.wait();
+        EXPECT_EQ(1000, done);
+        for (int i = 0; i < 10; i++) pool.submit([&]() { done++; });
+    }
+    EXPECT_EQ(1010, done);
+}
+
+/* The first task keeps one worker busy until all the others are done,
+ * so the tasks dealt to its queue can only run if they are stolen. */
+TEST_F(TestPool, Steals) {
+    const int tasks = 32;
+    std::atomic<int> done{0};
+    std::atomic<bool> started{false};
+    WorkStealingPool pool(2);
+    pool.submit([&]() {
+        started = true;
+        while (done < tasks) std::this_thread::yield();
+    });
+    while (!started) std::this_thread::yield();
+    for (int i = 0; i < tasks; i++) pool.submit([&]() { done++; });
+    pool.wait();
+    EXPECT_EQ(tasks, done);
+    EXPECT_LT(0u, pool.steals());
+}
+
+class TestRunJob : public ::testing::Test {
+public:
+    enum { PC_START = 0x3000 };
+
+    std::string write_file(const std::string& name, const std::string& content) {
+        const std::string path = ::testing::TempDir() + name;
+        std::ofstream(path, std::ios::binary) << content;
+        return path;
+    }
+    /* Big-endian image with the origin first, like fpt-asm writes them */
+    std::string write_image(const std::string& name, const std::vector<uint16_t>& program) {
+        std::string content;
+        content += (char)(PC_START >> 8);
+        content += (char)(PC_START & 0xFF);
+        for (auto word : program) {
+            content += (char)(word >> 8);
+            content += (char)(word & 0xFF);
+        }
+        return write_file(name, content);
+    }
+};
+
+TEST_F(TestRunJob, Halted) {
+    BatchJob job;
+    job.name = "halt";
+    job.images = { write_image("halt.obj", { 0xE002, 0xF022, 0xF025, 0x006F, 0x006B, 0x0000 }) }; //LEA R0 #2, PUTS, HALT, "ok"
+    for (auto engine : {LC3Machine::Engine::Reference, LC3Machine::Engine::Decoded,
+                        LC3Machine::Engine::Threaded, LC3Machine::Engine::Jit}) {
+        BatchResult r = run_job(job, 1000, engine);
+        EXPECT_EQ(ExitState::Halted, r.state);
+        EXPECT_EQ(3u, r.instructions);
+        EXPECT_EQ("okHALT", r.output);
+        EXPECT_EQ("halt", r.name);
+    }
+}
+
+TEST_F(TestRunJob, Budget) {
+    BatchJob job;
+    job.images = { write_image("loop.obj", { 0x0FFF }) }; //BR #-1
+    BatchResult r = run_job(job, 1000);
+    EXPECT_EQ(ExitState::Budget, r.state);
+    EXPECT_EQ(1000u, r.instructions);
+    job.budget = 10;
+    EXPECT_EQ(10u, run_job(job, 1000).instructions);
+}
+
+TEST_F(TestRunJob, Input) {
+    BatchJob job;
+    job.images = { write_image("echo.obj", { 0xF020, 0xF021, 0x0FFD }) }; //GETC, OUT, BR #-3
+    job.input = write_file("echo.in", "hello");
+    BatchResult r = run_job(job, 1000);
+    EXPECT_EQ(ExitState::Input, r.state);
+    EXPECT_EQ("hello", r.output);
+    EXPECT_EQ(15u, r.instructions);
+}
+
+/* Longer than the keyboard buffer */
+TEST_F(TestRunJob, LongInput) {
+    BatchJob job;
+    job.images = { write_image("echo.obj", { 0xF020, 0xF021, 0x0FFD }) };
+    std::string script;
+    for (int i = 0; i < 20000; i++) script += (char)('a' + i % 26);
+    job.input = write_file("long.in", script);
+    BatchResult r = run_job(job, UINT64_MAX);
+    EXPECT_EQ(ExitState::Input, r.state);
+    EXPECT_EQ(script, r.output);
+}
+
+TEST_F(TestRunJob, Error) {
+    BatchJob job;
+    job.images = { ::testing::TempDir() + "missing.obj" };
+    BatchResult r = run_job(job, 1000);
+    EXPECT_EQ(ExitState::Error, r.state);
+    EXPECT_NE("", r.error);
+}
+
+/* Jobs share nothing, running them on the pool gives the same results */
+TEST_F(TestRunJob, Parallel) {
+    BatchJob job;
+    job.images = { write_image("echo.obj", { 0xF020, 0xF021, 0x0FFD }) };
+    std::vector<BatchResult> results(64);
+    {
+        WorkStealingPool pool(4);
+        for (size_t i = 0; i < results.size(); i++) {
+            pool.submit([&, i]() {
+                BatchJob mine = job;
+                mine.input = write_file("echo" + std::to_string(i) + ".in", std::to_string(i));
+                results[i] = run_job(mine, 1000);
+            });
+        }
+    }
+    for (size_t i = 0; i < results.size(); i++) EXPECT_EQ(std::to_string(i), results[i].output);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,27 @@
+#include <cstdio>
+
+#include "TracePrinter.hpp"
+#include "lc3-debug.hpp"
+
+namespace {
+/* Column of the register changes */
+constexpr int TEXT_WIDTH = 22;
+}
+
+void TracePrinter::print(const TraceRecord& record) {
+    char line[128];
+    int length = snprintf(line, sizeof(line), "x%04X  ", record.pc);
+    const int text = length;
+    length += disassemble(record.instr, line + length);
+    while (length < text + TEXT_WIDTH) line[length++] = ' ';
+    for (int r = 0; r < 8; r++) {
+        if (record.changed >> r & 1) length += snprintf(line + length, sizeof(line) - length, "R%d=x%04X ", r, record.regs[r]);
+    }
+    /* No trailing blanks */
+    while (length && line[length - 1] == ' ') length--;
+    mOut.write(line, length);
+    if (const DebugSymbol* dbg_s = mSymbols ? mSymbols->find(record.pc) : nullptr) {
+        mOut << "  ; " << dbg_s->file.filename().string() << ':' << dbg_s->line;
+    }
+    mOut << '\n';
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <ostream>
+
+#include "DebugSymbols.hpp"
+#include "TraceFile.hpp"
+
+/* One line per record: address, instruction, the registers it changed
+ * and, with debug symbols, the source line, e.g.
+ *
+ *   x3001  ADD R1 R1 #1          R1=x0002  ; game.asm:12
+ */
+class TracePrinter {
+    std::ostream& mOut;
+    const DebugSymbols* mSymbols;
+public:
+    /* symbols may be nullptr */
+    TracePrinter(std::ostream& out, const DebugSymbols* symbols = nullptr) : mOut(out), mSymbols(symbols) {}
+    void print(const TraceRecord& record);
+};
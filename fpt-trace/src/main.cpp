@@ -0,0 +1,39 @@
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "TracePrinter.hpp"
+
+/* Decodes a trace written by fpt -G */
+int main(int argc, const char* argv[])
+{
+    const char* symbols_path = nullptr;
+    const char* trace_path = nullptr;
+    for (int j = 1; j < argc; ++j) {
+        if (std::string("-d").compare(argv[j]) == 0 && j + 1 < argc) {
+            symbols_path = argv[++j];
+            continue;
+        }
+        trace_path = argv[j];
+    }
+    if (!trace_path) {
+        /* show usage string */
+        std::cout << "fpt-trace [-d symbols.dbg] trace-file" << std::endl;
+        return 2;
+    }
+
+    try {
+        std::unique_ptr<DebugSymbols> symbols;
+        if (symbols_path) symbols = std::make_unique<DebugSymbols>(symbols_path);
+        TraceReader reader(trace_path);
+        TracePrinter printer(std::cout, symbols.get());
+        TraceRecord record;
+        while (reader.next(record)) printer.print(record);
+    } catch (const std::runtime_error& e) {
+        std::cout.flush();
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include "gtest/gtest.h"
+#include "TracePrinter.hpp"
+
+class TestPrinter : public ::testing::Test {};
+
+TEST_F(TestPrinter, Lines) {
+    std::ostringstream out;
+    TracePrinter printer(out);
+    printer.print({0x3000, 0x1021, 0x01, {1}});
+    printer.print({0x3001, 0x0FFE, 0x00, {}});
+    printer.print({0x3002, 0x4FFD, 0x82, {0, 5, 0, 0, 0, 0, 0, 0x3003}});
+    EXPECT_EQ("x3000  ADD R0 R0 #1          R0=x0001\n"
+              "x3001  BRnzp #1FE\n"
+              "x3002  JSR #7FD              R1=x0005 R7=x3003\n", out.str());
+}
+
+TEST_F(TestPrinter, SourceLines) {
+    const std::string path = testing::TempDir() + "fpt_trace.dbg";
+    {
+        DebugSymbols symbols;
+        symbols.emplace_back(0x3000, "dir/game.asm", 7u);
+        symbols.emplace_back(0x3001, "dir/game.asm", 8u);
+        std::ofstream file(path);
+        symbols.serialize(file);
+    }
+    const DebugSymbols symbols(path);
+    std::remove(path.c_str());
+    ASSERT_EQ(2u, symbols.size());
+    EXPECT_EQ(nullptr, symbols.find(0x3002));
+
+    std::ostringstream out;
+    TracePrinter printer(out, &symbols);
+    printer.print({0x3001, 0xF025, 0x00, {}});
+    printer.print({0x4000, 0xF025, 0x00, {}});
+    EXPECT_EQ("x3001  HALT  ; game.asm:8\n"
+              "x4000  HALT\n", out.str());
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,118 @@
+/* Trace benchmark: cost per instruction of the -g trace line.
+ *
+ * Compares the stringstream disassembler -g used before, written with
+ * std::endl, with disassemble() written through the console buffer.
+ * Both go to /dev/null, over every 16-bit instruction in turn.
+ *
+ * usage: fpt-bench-disassemble [seconds per run]
+ */
+#include <chrono>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+#include "LC3Machine.hpp"
+#include "lc3-debug.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+/* The disassembler before the formatter table, kept as the baseline */
+static std::string legacy_offset(size_t nbit, uint16_t instr) {
+    std::stringstream ss;
+    ss << std::uppercase << std::setfill('0') << std::setw((nbit + 3) / 4) << std::hex << (instr & ((1 << nbit) - 1));
+    return ss.str();
+}
+
+static std::string legacy_disassemble(uint16_t instr) {
+    static const char* names[16] = { "BR", "ADD ", "LD ", "ST ", "JSR ", "AND ", "LDR ", "STR ",
+                                     "RTI", "XOR ", "LDI ", "STI ", "JMP ", "", "LEA ", "" };
+    std::stringstream ss;
+    const uint16_t op = instr >> 12;
+    const int dr = (instr >> 9) & 0x7, sr1 = (instr >> 6) & 0x7;
+    ss << names[op];
+    switch (op) {
+    case OP_BR:
+        if (instr >> 11 & 0x1) ss << "n";
+        if (instr >> 10 & 0x1) ss << "z";
+        if (instr >> 9 & 0x1) ss << "p";
+        ss << " #" << legacy_offset(9, instr);
+        break;
+    case OP_ADD: case OP_AND: case OP_XOR:
+        ss << "R" << dr << " R" << sr1 << " ";
+        if ((instr >> 5) & 0x1) {
+            int8_t imm5 = instr & 0x1F;
+            if (imm5 & 0x10) imm5 |= 0xE0;
+            ss << "#" << (int)imm5;
+        } else {
+            ss << "R" << (int)(instr & 0x7);
+        }
+        break;
+    case OP_SHF:
+        ss << ((instr & 0x10) ? "R" : "L") << "SHF";
+        if (instr & 0x10) ss << ((instr & 0x20) ? "A" : "L");
+        ss << " R" << dr << " R" << sr1 << " #" << (int)(instr & 0xF);
+        break;
+    case OP_LD: case OP_LDI: case OP_LEA: case OP_ST: case OP_STI:
+        ss << "R" << dr << " #" << legacy_offset(9, instr);
+        break;
+    case OP_JSR:
+        if ((instr >> 11) & 0x1) ss << "#" << legacy_offset(11, instr);
+        else ss << "R" << sr1;
+        break;
+    case OP_LDR: case OP_STR:
+        ss << "R" << dr << " R" << sr1 << " #" << legacy_offset(6, instr);
+        break;
+    case OP_JMP:
+        ss << "R" << sr1;
+        break;
+    case OP_TRAP:
+        if ((instr & 0xFF) == TRAP_HALT) ss << "HALT";
+        break;
+    }
+    return ss.str();
+}
+
+/* Runs trace(instr) for about seconds, returns nanoseconds per instruction */
+template <typename Trace> double trace_time(double seconds, Trace trace) {
+    uint64_t count = 0;
+    uint16_t instr = 0;
+    const auto start = Clock::now();
+    const auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    while (Clock::now() < end) {
+        for (int i = 0; i < 1024; i++) trace(instr++);
+        count += 1024;
+    }
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / count;
+}
+
+int main(int argc, const char* argv[])
+{
+    const double seconds = argc > 1 ? std::stod(argv[1]) : 1.0;
+    std::cout << std::fixed << std::setprecision(1);
+
+    std::ofstream null_stream("/dev/null");
+    const double legacy = trace_time(seconds, [&](uint16_t instr) {
+        null_stream << legacy_disassemble(instr) << std::endl;
+    });
+    std::cout << "stringstream + endl: " << std::setw(8) << legacy << " ns/instruction" << std::endl;
+
+    auto machine = std::make_unique<LC3Machine>();
+    LC3Machine& m = *machine;
+    const int null_fd = open("/dev/null", O_WRONLY);
+    m.console.to_fd(null_fd);
+    const double table = trace_time(seconds, [&](uint16_t instr) {
+        char line[DISASM_MAX + 1];
+        size_t length = disassemble(instr, line);
+        line[length++] = '\n';
+        m.console.put(m, line, length);
+    });
+    m.console.flush();
+    close(null_fd);
+    std::cout << "formatter table:     " << std::setw(8) << table << " ns/instruction, "
+              << std::setprecision(1) << legacy / table << "x" << std::endl;
+}
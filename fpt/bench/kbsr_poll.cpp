@@ -0,0 +1,122 @@
+/* KBSR polling benchmark: how fast can a program spin on the keyboard
+ * status register while a host thread types now and then.
+ *
+ * Compares the lock-free InputBuffer with the mutex/std::queue buffer it
+ * replaced, first with the bare mem_read(MR_KBSR) logic, then with a whole
+ * LC-3 polling loop on LC3Machine.
+ *
+ * usage: fpt-bench-kbsr_poll [seconds per run]
+ */
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+
+#include "LC3Machine.hpp"
+
+/* The InputBuffer before the lock-free ring, kept as the baseline */
+class MutexInputBuffer {
+    std::queue<char> mBuffer;
+    std::mutex mMtx;
+    std::condition_variable mCond;
+public:
+    void push(char c) {
+        std::unique_lock<std::mutex> lck(mMtx);
+        if(mBuffer.empty()) mCond.notify_one();
+        mBuffer.push(c);
+    };
+    char pop() {
+        std::unique_lock<std::mutex> lck(mMtx);
+        if(mBuffer.empty()) return '\0';
+        char c = mBuffer.front();
+        mBuffer.pop();
+        return c;
+    }
+};
+
+using Clock = std::chrono::steady_clock;
+
+/* Pushes a key every millisecond until stopped */
+template <typename Buffer> class Typist {
+    std::atomic<bool> mStop{false};
+    std::thread mThread;
+public:
+    uint64_t typed = 0;
+    explicit Typist(Buffer& buffer) : mThread([this, &buffer]() {
+        while (!mStop) {
+            buffer.push('k');
+            typed++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }) {}
+    ~Typist() { stop(); }
+    void stop() { mStop = true; if (mThread.joinable()) mThread.join(); }
+};
+
+/* mem_read(MR_KBSR) alone, returns polls per second */
+template <typename Buffer> double poll_rate(double seconds, uint64_t& keys) {
+    Buffer buffer;
+    uint16_t kbsr = 0, kbdr = 0;
+    uint64_t polls = 0;
+    keys = 0;
+    Typist<Buffer> typist(buffer);
+    const auto start = Clock::now();
+    const auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    while (Clock::now() < end) {
+        for (int i = 0; i < 4096; i++) {
+            char c = buffer.pop();
+            if (c) {
+                kbsr = 1 << 15;
+                kbdr = (uint16_t) c;
+                keys++;
+            } else {
+                kbsr = 0;
+            }
+            asm volatile("" : : "r"(kbsr), "r"(kbdr));
+        }
+        polls += 4096;
+    }
+    return polls / std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/* LOOP LDI R0 KBSR_PTR; BRzp LOOP; LDI R0 KBDR_PTR; BR LOOP
+ * on a machine, returns instructions per second */
+double machine_rate(double seconds, LC3Machine::Engine engine, uint64_t& keys) {
+    auto machine = std::make_unique<LC3Machine>();
+    LC3Machine& m = *machine;
+    const uint16_t program[] = { 0xA003, 0x07FE, 0xA002, 0x0FFC, MR_KBSR, MR_KBDR };
+    for (int i = 0; i < 6; i++) m.mem_write(0x3000 + i, program[i]);
+    m.reset();
+    m.engine = engine;
+    Typist<InputBuffer> typist(m.input);
+    const auto start = Clock::now();
+    m.run_until(start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds)));
+    typist.stop();
+    keys = typist.typed;
+    return m.instructions / std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+int main(int argc, const char* argv[])
+{
+    const double seconds = argc > 1 ? std::stod(argv[1]) : 1.0;
+    uint64_t keys;
+    std::cout << std::fixed << std::setprecision(1);
+
+    const double mutex_rate = poll_rate<MutexInputBuffer>(seconds, keys);
+    std::cout << "KBSR poll, mutex queue:    " << std::setw(8) << mutex_rate / 1e6 << " M polls/s (" << keys << " keys)" << std::endl;
+    const double ring_rate = poll_rate<InputBuffer>(seconds, keys);
+    std::cout << "KBSR poll, lock-free ring: " << std::setw(8) << ring_rate / 1e6 << " M polls/s (" << keys << " keys)" << std::endl;
+    std::cout << "speedup: " << std::setprecision(2) << ring_rate / mutex_rate << "x" << std::setprecision(1) << std::endl;
+
+    for (auto [name, engine] : { std::pair{"reference", LC3Machine::Engine::Reference},
+                                 std::pair{"threaded ", LC3Machine::Engine::Threaded},
+                                 std::pair{"jit      ", LC3Machine::Engine::Jit} }) {
+        const double rate = machine_rate(seconds, engine, keys);
+        std::cout << "LC-3 polling loop, " << name << ": " << std::setw(8) << rate / 1e6 << " MIPS (" << keys << " keys)" << std::endl;
+    }
+}
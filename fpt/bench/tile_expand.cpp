@@ -0,0 +1,81 @@
+/* Tile expander benchmark: time to convert a whole frame of video memory
+ * into colour bytes.
+ *
+ * Compares the per-pixel loop mem_to_screen used before the expanders
+ * with LC3Screen::mem_to_screen on a fully dirty screen, with each
+ * expander this CPU runs.
+ *
+ * usage: fpt-bench-tile_expand [seconds per run]
+ */
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "lc3-video.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+/* The full frame conversion before the expanders, kept as the baseline */
+static void legacy_mem_to_screen(const LC3Machine& m, std::array<uint8_t, WIDTH*HEIGTH>& screen) {
+    for (int ty = 0; ty < (THEIGTH); ty++) {
+        const uint16_t row = LC3Screen::BASE_VIDEO_MEMORY + ty * LC3Screen::ROW_WORDS;
+        for (int tx = 0; tx < (TWIDTH); tx++) {
+            const uint16_t color = m.memory[row + tx];
+            const uint8_t colors[2] = { BG(color), FG(color) };
+            uint8_t* out = &screen[ty * TILE_SIDE * WIDTH + tx * TILE_SIDE];
+            for (int ln = 0; ln < TILE_SIDE; ln++, out += WIDTH) {
+                const uint16_t pixel16 = m.memory[row + (TWIDTH) + ln * (WIDTH / 16) + tx / 2];
+                const uint8_t bits = (tx & 1) ? pixel16 : pixel16 >> 8;
+                for (int p = 0; p < TILE_SIDE; p++) out[p] = colors[(bits >> (7 - p)) & 0x1];
+            }
+        }
+    }
+}
+
+/* Runs frame() for about seconds, returns microseconds per frame */
+template <typename Frame> double frame_time(double seconds, Frame frame) {
+    uint64_t frames = 0;
+    const auto start = Clock::now();
+    const auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    while (Clock::now() < end) {
+        for (int i = 0; i < 64; i++) frame();
+        frames += 64;
+    }
+    return std::chrono::duration<double, std::micro>(Clock::now() - start).count() / frames;
+}
+
+int main(int argc, const char* argv[])
+{
+    const double seconds = argc > 1 ? std::stod(argv[1]) : 1.0;
+    auto machine = std::make_unique<LC3Machine>();
+    LC3Machine& m = *machine;
+    for (uint16_t a = LC3Screen::BASE_VIDEO_MEMORY; a < LC3Screen::END_VIDEO_MEMORY; a++) m.mem_write(a, a * 0x9E37 + 1);
+    std::cout << std::fixed << std::setprecision(2);
+
+    auto baseline = std::make_unique<std::array<uint8_t, WIDTH*HEIGTH>>();
+    const double legacy = frame_time(seconds, [&]() {
+        legacy_mem_to_screen(m, *baseline);
+        asm volatile("" : : "r"(baseline->data()) : "memory");
+    });
+    std::cout << "per-pixel loop: " << std::setw(8) << legacy << " us/frame" << std::endl;
+
+    std::vector<std::pair<std::string, ExpandPair>> expanders = { {"scalar", expand_pair_scalar} };
+#if FPT_HAS_SIMD_EXPAND
+    expanders.push_back({"sse2  ", expand_pair_sse2});
+    if (cpu_has_avx2()) expanders.push_back({"avx2  ", expand_pair_avx2});
+#endif
+    for (auto& [name, expand] : expanders) {
+        auto screen = std::make_unique<LC3Screen>();
+        screen->expander = expand;
+        const double t = frame_time(seconds, [&]() {
+            screen->mem_to_screen(m);
+            asm volatile("" : : "r"(screen->screen.data()) : "memory");
+        });
+        std::cout << "expander " << name << ": " << std::setw(8) << t << " us/frame, "
+                  << std::setprecision(2) << legacy / t << "x" << (screen->screen == *baseline ? "" : " MISMATCH") << std::endl;
+    }
+}
@@ -0,0 +1,175 @@
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+
+#include "FrameWriter.hpp"
+
+namespace {
+constexpr size_t FRAME_PIXELS = WIDTH * HEIGTH;
+/* Widest %0Nd accepted in a snapshot pattern */
+constexpr size_t MAX_NAME_WIDTH = 20;
+}
+
+FrameWriter::FrameWriter(Format format, const std::string& path, int fps)
+    : mFormat(format), mPath(path), mFps(fps), mPending(FRAME_PIXELS), mFrame(FRAME_PIXELS) {
+    /* PPM snapshots open a file per frame */
+    const bool snapshots = mFormat == Format::Ppm && mPath.find('%') != std::string::npos;
+    if (mPath == "-") {
+        mFile = stdout;
+    } else if (snapshots) {
+        parse_pattern();
+    } else {
+        mFile = fopen(mPath.c_str(), "wb");
+        if (!mFile) throw std::runtime_error("failed to open video output: " + mPath);
+    }
+    if (mFormat == Format::Y4m) {
+        fprintf(mFile, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", WIDTH, HEIGTH, mFps);
+    }
+    mThread = std::thread([this]() { loop(); });
+}
+
+FrameWriter::~FrameWriter() {
+    stop();
+}
+
+/* The path is never used as a printf format: it is split around its
+ * only conversion, the rest is copied with %% unescaped */
+void FrameWriter::parse_pattern() {
+    const std::string error = "video output pattern needs a single %d: " + mPath;
+    bool conversion = false;
+    std::string* part = &mNamePrefix;
+    for (size_t i = 0; i < mPath.size(); i++) {
+        if (mPath[i] != '%') {
+            *part += mPath[i];
+        } else if (i + 1 < mPath.size() && mPath[i + 1] == '%') {
+            *part += '%';
+            i++;
+        } else {
+            if (conversion) throw std::runtime_error(error);
+            size_t j = i + 1;
+            if (j < mPath.size() && mPath[j] == '0') {
+                mNameZeros = true;
+                j++;
+            }
+            for (; j < mPath.size() && isdigit((unsigned char) mPath[j]); j++) {
+                mNameWidth = mNameWidth * 10 + (mPath[j] - '0');
+                if (mNameWidth > MAX_NAME_WIDTH) throw std::runtime_error(error);
+            }
+            if (j == mPath.size() || mPath[j] != 'd') throw std::runtime_error(error);
+            conversion = true;
+            part = &mNameSuffix;
+            i = j;
+        }
+    }
+    if (!conversion) throw std::runtime_error(error);
+}
+
+void FrameWriter::submit(const uint8_t* frame, const LC3Screen::Palette& palette, bool changed) {
+    std::unique_lock<std::mutex> lck(mMtx);
+    if (mStop) return;
+    if (changed) {
+        /* The second buffer still holds a frame the writer has not taken */
+        mCond.wait(lck, [this]() { return mPendingCount == 0; });
+        memcpy(mPending.data(), frame, FRAME_PIXELS);
+        mPendingPalette = palette;
+        mPendingNew = true;
+    }
+    mPendingCount++;
+    mCond.notify_all();
+}
+
+void FrameWriter::stop() {
+    {
+        std::unique_lock<std::mutex> lck(mMtx);
+        mStop = true;
+    }
+    mCond.notify_all();
+    if (mThread.joinable()) mThread.join();
+    if (mFile) {
+        fflush(mFile);
+        if (mFile != stdout) fclose(mFile);
+        mFile = nullptr;
+    }
+}
+
+uint64_t FrameWriter::frames() const {
+    std::unique_lock<std::mutex> lck(mMtx);
+    return mFrames;
+}
+
+bool FrameWriter::failed() const {
+    std::unique_lock<std::mutex> lck(mMtx);
+    return mFailed;
+}
+
+void FrameWriter::loop() {
+    std::unique_lock<std::mutex> lck(mMtx);
+    while (true) {
+        mCond.wait(lck, [this]() { return mStop || mPendingCount; });
+        /* stop() writes what is queued first */
+        if (!mPendingCount) break;
+        const uint64_t count = mPendingCount;
+        const bool fresh = mPendingNew;
+        if (fresh) {
+            mFrame.swap(mPending);
+            mPalette = mPendingPalette;
+        }
+        mPendingCount = 0;
+        mPendingNew = false;
+        bool failed = mFailed;
+        uint64_t frames = mFrames;
+        lck.unlock();
+        mCond.notify_all();
+
+        if (fresh) encode();
+        for (uint64_t i = 0; i < count && !failed; i++) {
+            failed = !write_frame(frames);
+            if (!failed) frames++;
+        }
+
+        lck.lock();
+        mFailed = failed;
+        mFrames = frames;
+    }
+}
+
+void FrameWriter::encode() {
+    for (int c = 0; c < 256; c++) {
+        const int r = (mPalette[c] >> 16) & 0xFF, g = (mPalette[c] >> 8) & 0xFF, b = mPalette[c] & 0xFF;
+        if (mFormat == Format::Y4m) {
+            /* BT.601, studio range */
+            mColors[c] = { (uint8_t)(16 + ((66 * r + 129 * g + 25 * b + 128) >> 8)),
+                           (uint8_t)(128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8)),
+                           (uint8_t)(128 + ((112 * r - 94 * g - 18 * b + 128) >> 8)) };
+        } else {
+            mColors[c] = { (uint8_t)r, (uint8_t)g, (uint8_t)b };
+        }
+    }
+    static const char* headers[] = { "", "P6\n" , "FRAME\n" };
+    std::string header = headers[(int)mFormat];
+    if (mFormat == Format::Ppm) header += std::to_string(WIDTH) + " " + std::to_string(HEIGTH) + "\n255\n";
+    mEncoded.resize(header.size() + 3 * FRAME_PIXELS);
+    memcpy(mEncoded.data(), header.data(), header.size());
+    uint8_t* out = mEncoded.data() + header.size();
+    if (mFormat == Format::Y4m) {
+        /* Planar: all Y, then all U, then all V */
+        for (int plane = 0; plane < 3; plane++) {
+            for (size_t p = 0; p < FRAME_PIXELS; p++) *out++ = mColors[mFrame[p]][plane];
+        }
+    } else {
+        for (size_t p = 0; p < FRAME_PIXELS; p++, out += 3) memcpy(out, mColors[mFrame[p]].data(), 3);
+    }
+}
+
+bool FrameWriter::write_frame(uint64_t index) {
+    FILE* file = mFile;
+    if (!file) {
+        std::string number = std::to_string(index);
+        if (number.size() < mNameWidth) number.insert(0, mNameWidth - number.size(), mNameZeros ? '0' : ' ');
+        file = fopen((mNamePrefix + number + mNameSuffix).c_str(), "wb");
+        if (!file) return false;
+    }
+    const bool ok = fwrite(mEncoded.data(), 1, mEncoded.size(), file) == mEncoded.size();
+    if (file != mFile) return fclose(file) == 0 && ok;
+    return ok;
+}
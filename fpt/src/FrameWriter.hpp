@@ -0,0 +1,107 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lc3-video.hpp"
+
+/* Writes LC3Screen frames to a file or a pipe, for headless runs.
+ *
+ * Formats:
+ *   Raw  RGB24 frames back to back, e.g. ffmpeg -f rawvideo -pix_fmt rgb24 -s 320x200
+ *   Ppm  a P6 image per frame: one file each if the path has a %, else a stream.
+ *        The path then holds a single %d, %05d and the like, and %% for a %.
+ *   Y4m  YUV4MPEG2, 4:4:4 at the given frame rate
+ *
+ * Frames are converted and written by a thread. submit() copies the frame
+ * into a second buffer and returns: the machine only waits when the
+ * writer has not taken the previous frame yet, i.e. when the disk or the
+ * reader of the pipe is the bottleneck. An unchanged frame is not copied,
+ * the writer repeats the last one.
+ */
+class FrameWriter {
+public:
+    enum class Format { Raw, Ppm, Y4m };
+
+    /* path "-" is stdout. Throws std::runtime_error if it cannot be opened
+     * or is not a valid PPM snapshot pattern. */
+    FrameWriter(Format format, const std::string& path, int fps);
+    ~FrameWriter();
+    FrameWriter(const FrameWriter&) = delete;
+    FrameWriter& operator=(const FrameWriter&) = delete;
+
+    /* Queue a WIDTH*HEIGTH frame of colour bytes, changed false if it and
+     * the palette are the same as last time */
+    void submit(const uint8_t* frame, const LC3Screen::Palette& palette, bool changed = true);
+    /* Write what is queued and join the thread, it may be called more than once */
+    void stop();
+    /* Frames written so far */
+    uint64_t frames() const;
+    /* A write failed, e.g. the pipe was closed: the next frames are dropped */
+    bool failed() const;
+
+private:
+    Format mFormat;
+    std::string mPath;
+    int mFps;
+    FILE* mFile = nullptr;
+    /* PPM snapshot names: the path around its %d, padded to mNameWidth */
+    std::string mNamePrefix;
+    std::string mNameSuffix;
+    size_t mNameWidth = 0;
+    bool mNameZeros = false;
+    /* Per colour byte: R G B, or Y U V for Y4m */
+    std::array<std::array<uint8_t, 3>, 256> mColors;
+    /* Filled by submit(), taken by the thread */
+    std::vector<uint8_t> mPending;
+    LC3Screen::Palette mPendingPalette;
+    LC3Screen::Palette mPalette;
+    bool mPendingNew = false;
+    uint64_t mPendingCount = 0;
+    /* Owned by the thread */
+    std::vector<uint8_t> mFrame;
+    std::vector<uint8_t> mEncoded;
+    uint64_t mFrames = 0;
+    bool mFailed = false;
+    bool mStop = false;
+    mutable std::mutex mMtx;
+    std::condition_variable mCond;
+    std::thread mThread;
+
+    void parse_pattern();
+    void loop();
+    void encode();
+    /* index names PPM snapshots */
+    bool write_frame(uint64_t index);
+};
+
+/* Hands the screen to a FrameWriter every period instructions: at
+ * LC3Machine::idleClockHz instructions per second, idleClockHz / fps.
+ * The screen must be attached to the same machine. */
+class FrameCapture : public Device {
+    LC3Screen& mScreen;
+    FrameWriter& mWriter;
+    uint64_t mPeriod;
+    uint64_t mDeadline = UINT64_MAX;
+public:
+    FrameCapture(LC3Screen& screen, FrameWriter& writer, uint64_t period)
+        : mScreen(screen), mWriter(writer), mPeriod(period) {}
+    /* Send the current screen now */
+    void capture(LC3Machine& m) {
+        const bool changed = !mScreen.mem_to_screen(m).empty();
+        mWriter.submit(mScreen.screen.data(), mScreen.palette, changed);
+    }
+    uint64_t deadline() const override { return mDeadline; }
+    void tick(LC3Machine& m) override {
+        capture(m);
+        mDeadline = std::max(mDeadline + mPeriod, m.instructions + 1);
+    }
+    void reset(LC3Machine& m) override { mDeadline = m.instructions + mPeriod; }
+};
@@ -0,0 +1,114 @@
+#include <cerrno>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <conio.h>
+#include <io.h>
+#else
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include "KeyboardDevice.hpp"
+
+KeyboardDevice::KeyboardDevice(InputBuffer& input, int fd) : mInput(input), mFd(fd), mOwnFd(false) {}
+
+KeyboardDevice::KeyboardDevice(InputBuffer& input, const char* path) : mInput(input), mOwnFd(true) {
+#ifdef _WIN32
+    mFd = _open(path, _O_RDONLY | _O_BINARY);
+#else
+    mFd = open(path, O_RDONLY);
+#endif
+    if (mFd < 0) throw std::runtime_error(std::string("failed to open input: ") + path);
+}
+
+KeyboardDevice::~KeyboardDevice() {
+    stop();
+#ifdef _WIN32
+    if (mOwnFd) _close(mFd);
+#else
+    if (mOwnFd) close(mFd);
+#endif
+}
+
+bool KeyboardDevice::type(const char* buffer, long count) {
+    for (long i = 0; i < count; i++) {
+        /* The program is not reading fast enough, wait for room */
+        while (!mInput.push(buffer[i])) {
+            if (mStop) return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    return true;
+}
+
+#ifdef _WIN32
+
+void KeyboardDevice::start() {
+    mThread = std::thread([this]() { loop(); });
+}
+
+void KeyboardDevice::stop() {
+    mStop = true;
+    if (mThread.joinable()) mThread.join();
+}
+
+/* No poll() on console handles: the console is checked every few ms */
+void KeyboardDevice::loop() {
+    char buffer[256];
+    while (true) {
+        if (mStop) return;
+        if (mFd == 0 && _isatty(0)) {
+            if (!_kbhit()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                continue;
+            }
+            buffer[0] = (char)_getch();
+            if (!type(buffer, 1)) return;
+            continue;
+        }
+        const int count = _read(mFd, buffer, sizeof(buffer));
+        if (count <= 0) break;
+        if (!type(buffer, count)) return;
+    }
+    mInput.close();
+}
+
+#else
+
+void KeyboardDevice::start() {
+    if (pipe(mWakePipe) != 0) throw std::runtime_error("failed to create the keyboard wake-up pipe");
+    mThread = std::thread([this]() { loop(); });
+}
+
+void KeyboardDevice::stop() {
+    mStop = true;
+    if (mThread.joinable()) {
+        const char wake = 0;
+        if (write(mWakePipe[1], &wake, 1) < 0) { /* the thread is leaving anyway */ }
+        mThread.join();
+    }
+    for (auto& fd : mWakePipe) {
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+}
+
+void KeyboardDevice::loop() {
+    char buffer[256];
+    pollfd fds[2] = { { mFd, POLLIN, 0 }, { mWakePipe[0], POLLIN, 0 } };
+    while (true) {
+        if (poll(fds, 2, -1) < 0) continue; //EINTR
+        if (fds[1].revents) return; //stop(), the keyboard stays open
+        if (!fds[0].revents) continue;
+        const ssize_t count = read(mFd, buffer, sizeof(buffer));
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) break; //end of file, or the fd is gone
+        if (!type(buffer, count)) return;
+    }
+    mInput.close();
+}
+
+#endif
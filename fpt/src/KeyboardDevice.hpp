@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+
+#include "InputBuffer.hpp"
+
+/* Types what can be read from a file descriptor (the terminal, a pipe or
+ * a file) into a machine keyboard.
+ *
+ * The thread sleeps in poll() until fd is readable or stop() is called,
+ * so an idle keyboard costs no CPU. At end of file the keyboard is closed:
+ * GETC/IN then stop the machine once everything has been read.
+ */
+class KeyboardDevice {
+    InputBuffer& mInput;
+    int mFd;
+    bool mOwnFd;
+    int mWakePipe[2] = { -1, -1 };
+    std::atomic<bool> mStop{false};
+    std::thread mThread;
+
+    void loop();
+    /* false if stopped while waiting for room in the keyboard */
+    bool type(const char* buffer, long count);
+
+public:
+    /* Read from an already open fd, which is left open */
+    KeyboardDevice(InputBuffer& input, int fd);
+    /* Read from a file or named pipe, throws std::runtime_error if it cannot be opened */
+    KeyboardDevice(InputBuffer& input, const char* path);
+    ~KeyboardDevice();
+    KeyboardDevice(const KeyboardDevice&) = delete;
+    KeyboardDevice& operator=(const KeyboardDevice&) = delete;
+
+    void start();
+    /* Wake the thread up and join it, it may be called more than once */
+    void stop();
+};
@@ -0,0 +1,293 @@
+#include <algorithm>
+#include <iostream>
+#include "LC3Machine.hpp"
+
+LC3Machine::LC3Machine() : mDecoded(std::make_unique<DecodedInstr[]>(UINT16_MAX + 1)) {
+    input.set_push_flag(&mDeviceEvent);
+    /* The device register area is MMIO, mapped or not */
+    for (uint32_t page = MR_KBSR >> PAGE_BITS; page <= UINT16_MAX >> PAGE_BITS; page++) mPageFlags[page] |= PAGE_DEVICE;
+    map_device(mKeyboard, MR_KBSR, MR_KBDR + 1);
+    map_device(console, MR_DSR, MR_DDR + 1);
+    map_device(mTimer, MR_TMR, MR_TMI + 1);
+    map_device(mDma, MR_DMAS, MR_DMALEN + 1);
+    map_device(mMachineControl, MR_MCR, MR_MCR + 1);
+    install_standard_traps(*this);
+}
+
+LC3Machine::~LC3Machine() = default;
+
+void LC3Machine::read_image_file(FILE* file)
+{
+    /* the origin tells us where in memory to place the image */
+    uint16_t origin;
+    fread(&origin, sizeof(origin), 1, file);
+    origin = swap16(origin);
+    pcStart = origin;
+
+    /* we know the maximum file size so we only need one fread */
+    uint16_t max_read = UINT16_MAX - origin;
+    uint16_t* p = memory + origin;
+    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+
+    /* swap to little endian */
+    while (read-- > 0)
+    {
+        *p = swap16(*p);
+        ++p;
+    }
+    invalidate_code_all();
+}
+
+int LC3Machine::read_image(const char* image_path)
+{
+    FILE* file = fopen(image_path, "rb");
+    if (!file) { return 0; };
+    read_image_file(file);
+    fclose(file);
+    return 1;
+}
+
+void LC3Machine::reset() {
+    for (auto& r : reg) r = 0;
+    reg[R_PC] = pcStart;
+    running = true;
+    waitingInput = false;
+    instructions = 0;
+    randomState = RANDOM_SEED;
+    stats.clear();
+    for (auto d : mDevices) d->reset(*this);
+    reschedule();
+    mIdlePoll = false;
+    mIdlePollPc = NO_POLL_PC;
+    mIdleInstructions = 0;
+    /* Keys typed before the reset may be waiting */
+    raise_device_event();
+}
+
+void LC3Machine::step() {
+    poll_devices();
+    instructions += run_reference(*this, 1);
+    tick_devices();
+}
+
+uint64_t LC3Machine::run_engine(uint64_t n) {
+    if (stats.countOps) return run_counted(*this, n);
+    switch (engine) {
+        case Engine::Reference: return run_reference(*this, n);
+        case Engine::Decoded:   return run_decoded(*this, n);
+        case Engine::Threaded:  return run_threaded(*this, n);
+        case Engine::Jit:       return run_jit(*this, n);
+    }
+    return 0;
+}
+
+/* Step by step, looking for breakpoints before every instruction but the
+ * first one of a run */
+uint64_t LC3Machine::run_checked(uint64_t n, StopReason& reason, bool resumed) {
+    uint64_t executed = 0;
+    while (executed < n && running && !device_event()) {
+        if ((executed || resumed) && mBreakpoints[reg[R_PC]]) {
+            reason = StopReason::Breakpoint;
+            break;
+        }
+        executed += run_reference(*this, 1);
+    }
+    return executed;
+}
+
+LC3Machine::StopReason LC3Machine::run_for(uint64_t n) {
+    if (!running) {
+        if (!waitingInput) return StopReason::Halted;
+        running = true;
+    }
+    StopReason reason = StopReason::Budget;
+    uint64_t executed = 0;
+    /* Engines return early on device events, and slices end at the next
+     * device deadline, so that timers cost nothing per instruction */
+    while (executed < n && running && reason == StopReason::Budget) {
+        if (mIdlePoll) {
+            const uint64_t skipped = skip_idle(n - executed);
+            executed += skipped;
+            tick_devices();
+            /* Polling a closed keyboard, no trap to retract */
+            if (!running) return StopReason::WaitingInput;
+            if (executed == n) break;
+        }
+        poll_devices();
+        const uint64_t slice = std::min(n - executed, mNextDeadline - instructions);
+        const uint64_t done = mBreakpoints.any() ? run_checked(slice, reason, executed != 0) : run_engine(slice);
+        executed += done;
+        instructions += done;
+        tick_devices();
+    }
+    if (!running) {
+        reason = waitingInput ? StopReason::WaitingInput : StopReason::Halted;
+        /* The GETC/IN trap did not retire, it runs again on resume */
+        if (waitingInput) {
+            instructions--;
+            stats.traps[memory[reg[R_PC]] & 0xFF]--;
+            if (stats.countOps) stats.ops[OP_TRAP]--;
+        }
+    }
+    return reason;
+}
+
+LC3Machine::StopReason LC3Machine::run_until(uint64_t cycle) {
+    return run_for(cycle > instructions ? cycle - instructions : 0);
+}
+
+LC3Machine::StopReason LC3Machine::run_until(std::chrono::steady_clock::time_point deadline) {
+    while (std::chrono::steady_clock::now() < deadline) {
+        const StopReason reason = run_for(DEADLINE_SLICE);
+        if (reason != StopReason::Budget) return reason;
+    }
+    return StopReason::Budget;
+}
+
+LC3Machine::StopReason LC3Machine::run() {
+    StopReason reason;
+    while ((reason = run_for(UINT64_MAX)) == StopReason::WaitingInput) {
+        if (!wait_input()) break;
+    }
+    return reason;
+}
+
+bool LC3Machine::wait_input() {
+    const auto start = MachineStats::Clock::now();
+    const bool key = input.wait();
+    stats.keyboardBlocked += MachineStats::Clock::now() - start;
+    return key;
+}
+
+void LC3Machine::attach(Device& device, uint16_t first, uint16_t last, uint8_t flag) {
+    for (uint32_t a = first; a <= last; a++) {
+        auto& map = mDeviceMap[a >> PAGE_BITS];
+        if (!map) map = std::make_unique<Device*[]>(PAGE_MASK + 1);
+        map[a & PAGE_MASK] = &device;
+        mPageFlags[a >> PAGE_BITS] |= flag;
+    }
+    add_device(device);
+    /* Translations and fused pairs assumed plain RAM */
+    invalidate_code_all();
+}
+
+void LC3Machine::map_device(Device& device, uint16_t first, uint16_t last) {
+    attach(device, first, last, PAGE_DEVICE);
+}
+
+void LC3Machine::observe(Device& device, uint16_t first, uint16_t last) {
+    attach(device, first, last, PAGE_OBSERVED);
+}
+
+void LC3Machine::add_device(Device& device) {
+    if (std::find(mDevices.begin(), mDevices.end(), &device) == mDevices.end()) mDevices.push_back(&device);
+    reschedule();
+}
+
+/* Addresses without a device in a device page behave as RAM */
+uint16_t LC3Machine::io_read(uint16_t address) {
+    stats.mmioReads++;
+    Device* device = device_at(address);
+    return device ? device->read(*this, address) : memory[address];
+}
+
+void LC3Machine::io_write(uint16_t address, uint16_t val) {
+    Device* device = device_at(address);
+    if (page_flags(address) & PAGE_DEVICE) stats.mmioWrites++;
+    if (device && (page_flags(address) & PAGE_DEVICE)) return device->write(*this, address, val);
+    memory[address] = val;
+    invalidate_code(address);
+    if (device) device->written(*this, address);
+}
+
+void LC3Machine::reschedule() {
+    mNextDeadline = UINT64_MAX;
+    for (auto d : mDevices) mNextDeadline = std::min(mNextDeadline, d->deadline());
+}
+
+void LC3Machine::tick_due() {
+    for (auto d : mDevices) if (instructions >= d->deadline()) d->tick(*this);
+    reschedule();
+}
+
+void LC3Machine::service_devices() {
+    mDeviceEvent.store(false, std::memory_order_relaxed);
+    /* Every device is serviced, the highest request above PSR[10:8] is taken */
+    Device::Interrupt taken{0, (uint16_t)((reg[R_PSR] >> 8) & 0x7)};
+    bool any = false;
+    for (auto d : mDevices) {
+        const Device::Interrupt request = d->service(*this);
+        if (request.priority > taken.priority) {
+            taken = request;
+            any = true;
+        }
+    }
+    if (any) interrupt(taken.vector, taken.priority);
+}
+
+/* IDLE LOOPS
+ *
+ * A program reading an idle device register (KBSR or TMR not ready) twice
+ * in a row from the same PC makes the engine return, when skipping is
+ * possible at all: idleClockHz is set or the keyboard is closed. If it
+ * comes back with the same registers, without a store or a trap in
+ * between, it is spinning: every iteration is the same until a key comes
+ * or the timer ticks. Those iterations are skipped, the host sleeping for
+ * the time they would have taken at idleClockHz. A loop on a closed
+ * keyboard with no device deadline would spin forever, the run stops
+ * with WaitingInput instead.
+ */
+uint64_t LC3Machine::skip_idle(uint64_t left) {
+    using Clock = std::chrono::steady_clock;
+    mIdlePoll = false;
+    mIdlePollPc = NO_POLL_PC;
+    const bool same = std::equal(std::begin(reg), std::end(reg), mIdleRegs.begin()) &&
+                      sideEffects == mIdleSideEffects && instructions > mIdleInstructions;
+    const uint64_t period = instructions - mIdleInstructions;
+    std::copy(std::begin(reg), std::end(reg), mIdleRegs.begin());
+    mIdleInstructions = instructions;
+    mIdleSideEffects = sideEffects;
+    if (!same || !input.empty()) return 0;
+
+    /* Nothing will ever change what the loop reads: stop as GETC does */
+    if (input.closed() && mNextDeadline == UINT64_MAX) {
+        running = false;
+        waitingInput = true;
+        return 0;
+    }
+    /* Up to the next device deadline or the end of the slice, the
+     * instruction count never reaches UINT64_MAX */
+    uint64_t span = std::min({left, mNextDeadline - instructions, UINT64_MAX - 1 - instructions});
+    if (!input.closed()) {
+        if (!idleClockHz) return 0;
+        const auto start = Clock::now();
+        const std::chrono::duration<double> sleep(span / (double) idleClockHz);
+        if (sleep > std::chrono::hours(24)) input.wait();
+        else input.wait_for(sleep);
+        stats.idleSlept += Clock::now() - start;
+        const double slept = std::chrono::duration<double>(Clock::now() - start).count();
+        span = std::min(span, (uint64_t) std::min(slept * idleClockHz, (double) UINT64_MAX / 2));
+    }
+    const uint64_t skipped = span / period * period;
+    instructions += skipped;
+    stats.idleSkipped += skipped;
+    mIdleInstructions = instructions;
+    return skipped;
+}
+
+void LC3Machine::interrupt(uint8_t vector, uint16_t priority) {
+    const uint16_t psr = read_psr();
+    if (psr & 0x8000) { //user mode, switch to the supervisor stack
+        savedUsp = reg[R_R6];
+        reg[R_R6] = savedSsp;
+    }
+    mem_write(--reg[R_R6], psr);
+    mem_write(--reg[R_R6], reg[R_PC]);
+    reg[R_PSR] = priority << 8; //supervisor mode
+    reg[R_PC] = memory[interruptVectorTable + vector];
+}
+
+void LC3Machine::invalidate_code_all() {
+    for (uint32_t a = 0; a <= UINT16_MAX; a++) mDecoded[a].handler = nullptr;
+    if (jit) jit_flush(*this);
+}
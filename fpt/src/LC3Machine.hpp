@@ -0,0 +1,237 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include "InputBuffer.hpp"
+#include "lc3-decode.hpp"
+#include "lc3-devices.hpp"
+#include "lc3-hw.hpp"
+#include "lc3-jit.hpp"
+#include "lc3-stats.hpp"
+#include "lc3-traps.hpp"
+#include "memory.hpp"
+
+/* A whole LC-3 computer: registers, memory, devices and run state.
+ *
+ * Machines share nothing, so a process can host as many of them as it
+ * likes, e.g. one per core. A machine must be run by one thread at a time,
+ * its keyboard can be fed from any thread.
+ */
+class LC3Machine {
+public:
+    enum class Engine {
+        Reference, /* op_table, one mem_read and one call per instruction */
+        Decoded,   /* pre-decoded side table with superinstructions */
+        Threaded,  /* direct-threaded dispatch */
+        Jit,       /* basic-block JIT, Threaded where it is not available */
+    };
+    /* Why run_for/run_until returned */
+    enum class StopReason {
+        Budget,       /* instruction budget or deadline exhausted */
+        Halted,       /* TRAP HALT, running is false */
+        WaitingInput, /* GETC/IN with an empty keyboard, see stop_for_input,
+                       * or an idle loop on a closed keyboard, see skip_idle */
+        Breakpoint,   /* PC reached a breakpoint, its instruction is not executed yet */
+    };
+    /* Instructions run_until(deadline) executes between two clock checks */
+    static constexpr uint64_t DEADLINE_SLICE = 10000;
+    static constexpr uint32_t RANDOM_SEED = 0x2545F491;
+
+    uint16_t reg[R_COUNT] = {};
+    /* 65536 locations */
+    uint16_t memory[UINT16_MAX + 1] = {};
+    /* Keyboard, read back through MR_KBSR/MR_KBDR and the GETC/IN traps */
+    InputBuffer input;
+    /* Saved_SSP and Saved_USP, R6 is swapped with them when an interrupt
+     * or RTI changes the privilege mode */
+    uint16_t savedSsp = 0x3000;
+    uint16_t savedUsp = 0;
+    /* Console, written by the OUT/PUTS/PUTSP/IN/HALT traps and DDR */
+    Console console;
+    bool running = true;
+    /* Stopped in GETC/IN with an empty keyboard, cleared when they get a character */
+    bool waitingInput = false;
+    /* Where the first program instruction is loaded, 0x3000 is the default */
+    uint16_t pcStart = 0x3000;
+    /* Instructions retired by step() and the run functions */
+    uint64_t instructions = 0;
+    /* Stores and traps so far, see IDLE LOOPS */
+    uint64_t sideEffects = 0;
+    /* Instructions credited to an idle loop per second of host sleep.
+     * 0 never sleeps: idle loops are only skipped when the keyboard is
+     * closed, as nothing but the timer can wake them up then. */
+    uint64_t idleClockHz = 0;
+    /* Counters, see STATS */
+    MachineStats stats;
+    /* TRAP_RANDOM state, reseeded by reset() */
+    uint32_t randomState = RANDOM_SEED;
+    Engine engine = Engine::Reference;
+    /* JIT translations, created by the first run_jit */
+    std::unique_ptr<JitState> jit;
+
+    LC3Machine();
+    ~LC3Machine();
+    LC3Machine(const LC3Machine&) = delete;
+    LC3Machine& operator=(const LC3Machine&) = delete;
+
+    void read_image_file(FILE* file);
+    int read_image(const char* image_path);
+    /* Clear the registers, the devices and the instruction count and get
+     * ready to run from pcStart. Memory is left as it is. */
+    void reset();
+
+    /* Stop before the current GETC/IN trap, which runs again on resume */
+    void stop_for_input() { reg[R_PC]--; running = false; waitingInput = true; stats.keyboardWaits++; console.flush(); }
+    /* Block until there is a key or InputBuffer::wake, false if the
+     * keyboard got closed. The time is counted in stats. */
+    bool wait_input();
+
+    /* Execute one instruction with the reference engine */
+    void step();
+    /* Execute up to n instructions with engine and say why it stopped.
+     * A machine waiting for input tries again, a halted one stays halted.
+     * A run never stops on the breakpoint it starts from. */
+    StopReason run_for(uint64_t n);
+    /* Run until instructions reaches cycle */
+    StopReason run_until(uint64_t cycle);
+    StopReason run_until(std::chrono::steady_clock::time_point deadline);
+    /* Run until HALT, blocking while the keyboard is empty.
+     * Returns early if the keyboard gets closed or on a breakpoint. */
+    StopReason run();
+
+    /* Engines test this once per instruction (once per block for the JIT)
+     * and return early when it is set: an interrupt may be pending or a
+     * device register was written. */
+    bool device_event() const { return mDeviceEvent.load(std::memory_order_relaxed); }
+    void raise_device_event() { mDeviceEvent.store(true, std::memory_order_release); }
+    /* Take the highest pending interrupt, if any. step() and run_for do it
+     * before each instruction/slice. */
+    void poll_devices() { if (device_event()) service_devices(); }
+    /* Called by a device read finding nothing to do, see IDLE LOOPS */
+    void idle_poll() {
+        /* Nothing could be skipped, the engine goes on */
+        if (!idleClockHz && !input.closed()) return;
+        if (reg[R_PC] != mIdlePollPc) {
+            mIdlePollPc = reg[R_PC];
+            return;
+        }
+        mIdlePoll = true;
+        raise_device_event();
+    }
+    /* Some Device::deadline() changed */
+    void reschedule();
+
+    /* Route loads and stores to [first, last] through device, which must
+     * outlive the machine. The keyboard, the console, the timer, the DMA and
+     * MCR are mapped already. */
+    void map_device(Device& device, uint16_t first, uint16_t last);
+    /* Tell device about stores to [first, last], which stay plain RAM */
+    void observe(Device& device, uint16_t first, uint16_t last);
+    /* A device without addresses, e.g. only timed */
+    void add_device(Device& device);
+    uint8_t page_flags(uint16_t address) const { return mPageFlags[address >> PAGE_BITS]; }
+    /* The flags of every page, for the JIT */
+    const uint8_t* page_table() const { return mPageFlags; }
+
+    /* Run handler for TRAP vector instead of the routine in the trap
+     * vector table, nullptr goes back to the table. See TRAPS. */
+    void set_trap(uint8_t vector, TrapHandler handler) { mTraps[vector] = handler; }
+    TrapHandler trap_handler(uint8_t vector) const { return mTraps[vector]; }
+
+    /* Breakpoints make run_for step with the reference engine */
+    void set_breakpoint(uint16_t address) { mBreakpoints.set(address); }
+    void clear_breakpoint(uint16_t address) { mBreakpoints.reset(address); }
+
+    /* Plain RAM is an array access, device and observed pages take io_read/io_write */
+    uint16_t mem_read(uint16_t address) {
+        if (page_flags(address) & PAGE_DEVICE) return io_read(address);
+        return memory[address];
+    }
+    void mem_write(uint16_t address, uint16_t val) {
+        sideEffects++;
+        if (page_flags(address)) return io_write(address, val);
+        memory[address] = val;
+        invalidate_code(address);
+    }
+    void mem_write88(uint16_t address, uint16_t val_h, uint16_t val_l) { mem_write(address, val_h << 8 | (val_l & 0xFF)); }
+
+    /* N/Z/P are worked out by cond_flags() only when needed */
+    void update_flags(uint16_t r) { reg[R_COND] = reg[r]; }
+    /* N/Z/P of the last result, 3*n + z + 1 gives FL_NEG, FL_ZRO or FL_POS */
+    uint16_t cond_flags() const { const uint16_t v = reg[R_COND]; return 3 * (v >> 15) + (v == 0) + 1; }
+    /* Store a value whose flags are nzp */
+    void set_cond_flags(uint16_t nzp) { reg[R_COND] = (nzp & FL_NEG) ? 0x8000 : (nzp & FL_POS) ? 1 : 0; }
+    /* PSR with the current condition codes in bits [2:0] */
+    uint16_t read_psr() const { return (reg[R_PSR] & ~0x7) | cond_flags(); }
+
+    /* Decoded form of the instruction at address, decoding it if needed */
+    const DecodedInstr& fetch_decoded(uint16_t address) {
+        const DecodedInstr& d = mDecoded[address];
+        return d.handler ? d : decode_at(address);
+    }
+    /* Decode the instruction at address and store it in the side table */
+    const DecodedInstr& decode_at(uint16_t address);
+    bool is_decoded(uint16_t address) const { return mDecoded[address].handler; }
+
+    /* Drop the cached decoded/translated forms of address.
+     * The previous entry may be fused with this one, drop it too. */
+    void invalidate_code(uint16_t address) {
+        mDecoded[address].handler = nullptr;
+        mDecoded[(uint16_t)(address - 1)].handler = nullptr;
+        if (jit && jit->codeMap[address]) jit_invalidate(*this, address);
+    }
+    void invalidate_code_all();
+
+private:
+    /* Side table parallel to memory, see DecodedInstr */
+    std::unique_ptr<DecodedInstr[]> mDecoded;
+    /* Device registers change without a mem_write, they are decoded here */
+    DecodedInstr mDeviceScratch{};
+    std::bitset<UINT16_MAX + 1> mBreakpoints;
+    std::atomic<bool> mDeviceEvent{false};
+    /* Device registry: PAGE_* flags per page, and the device of each
+     * address of the pages that have one */
+    uint8_t mPageFlags[(UINT16_MAX + 1) >> PAGE_BITS] = {};
+    std::unique_ptr<Device*[]> mDeviceMap[(UINT16_MAX + 1) >> PAGE_BITS];
+    std::vector<Device*> mDevices;
+    Keyboard mKeyboard;
+    Timer mTimer;
+    Dma mDma;
+    MachineControl mMachineControl;
+    /* Native trap handlers, nullptr where the trap vector table is used */
+    std::array<TrapHandler, 256> mTraps{};
+    /* Earliest Device::deadline() */
+    uint64_t mNextDeadline = UINT64_MAX;
+    /* Machine state at the last idle device read, see skip_idle */
+    bool mIdlePoll = false;
+    /* PC of the last idle device read, NO_POLL_PC after skip_idle */
+    static constexpr uint32_t NO_POLL_PC = UINT32_MAX;
+    uint32_t mIdlePollPc = NO_POLL_PC;
+    std::array<uint16_t, R_COUNT> mIdleRegs{};
+    uint64_t mIdleInstructions = 0;
+    uint64_t mIdleSideEffects = 0;
+
+    uint64_t run_engine(uint64_t n);
+    uint64_t run_checked(uint64_t n, StopReason& reason, bool resumed);
+    Device* device_at(uint16_t address) const {
+        const auto& map = mDeviceMap[address >> PAGE_BITS];
+        return map ? map[address & PAGE_MASK] : nullptr;
+    }
+    void attach(Device& device, uint16_t first, uint16_t last, uint8_t flag);
+    uint16_t io_read(uint16_t address);
+    void io_write(uint16_t address, uint16_t val);
+    /* Deadlines are checked when the instruction count moves */
+    void tick_devices() { if (instructions >= mNextDeadline) tick_due(); }
+    void tick_due();
+    void service_devices();
+    uint64_t skip_idle(uint64_t left);
+    void interrupt(uint8_t vector, uint16_t priority);
+};
@@ -0,0 +1,119 @@
+#include <cstring>
+#include <stdexcept>
+
+#include "TraceFile.hpp"
+
+namespace {
+constexpr char MAGIC[] = "FPTTRC1\n";
+constexpr size_t MAGIC_SIZE = sizeof(MAGIC) - 1;
+/* tag, 3 bytes of PC delta, instruction, mask and 8 registers */
+constexpr size_t MAX_RECORD = 1 + 3 + 2 + 1 + 16;
+}
+
+TraceWriter::TraceWriter(const std::string& path)
+    : mBuffer(std::make_unique<uint8_t[]>(BUFFER_SIZE)), mSeen(UINT16_MAX + 1), mKnown(UINT16_MAX + 1) {
+    mFile = fopen(path.c_str(), "wb");
+    if (!mFile) throw std::runtime_error("failed to open trace output: " + path);
+    memcpy(mBuffer.get(), MAGIC, MAGIC_SIZE);
+    mSize = MAGIC_SIZE;
+}
+
+TraceWriter::~TraceWriter() {
+    flush();
+    fclose(mFile);
+}
+
+void TraceWriter::record(uint16_t pc, uint16_t instr, const uint16_t before[8], const uint16_t after[8]) {
+    if (mSize + MAX_RECORD > BUFFER_SIZE) flush();
+    uint8_t* tag = &mBuffer[mSize];
+    uint8_t* out = tag + 1;
+    *tag = 0;
+    if (pc != mNextPc) {
+        *tag |= TRACE_JUMP;
+        const int16_t delta = (int16_t)(pc - mNextPc);
+        uint32_t zigzag = (uint16_t)((delta << 1) ^ (delta >> 15));
+        for (; zigzag >= 0x80; zigzag >>= 7) *out++ = 0x80 | (zigzag & 0x7F);
+        *out++ = zigzag;
+    }
+    if (!mKnown[pc] || mSeen[pc] != instr) {
+        *tag |= TRACE_INSTR;
+        mKnown[pc] = true;
+        mSeen[pc] = instr;
+        *out++ = instr & 0xFF;
+        *out++ = instr >> 8;
+    }
+    uint8_t changed = 0;
+    for (int r = 0; r < 8; r++) changed |= (before[r] != after[r]) << r;
+    if (changed) {
+        *tag |= TRACE_REGS;
+        *out++ = changed;
+        for (int r = 0; r < 8; r++) {
+            if (!(changed >> r & 1)) continue;
+            *out++ = after[r] & 0xFF;
+            *out++ = after[r] >> 8;
+        }
+    }
+    mSize = out - mBuffer.get();
+    mNextPc = pc + 1;
+    mRecords++;
+}
+
+void TraceWriter::flush() {
+    if (mSize && !mFailed) mFailed = fwrite(mBuffer.get(), 1, mSize, mFile) != mSize;
+    mSize = 0;
+    if (!mFailed) mFailed = fflush(mFile) != 0;
+}
+
+TraceReader::TraceReader(const std::string& path) : mSeen(UINT16_MAX + 1), mKnown(UINT16_MAX + 1) {
+    mFile = fopen(path.c_str(), "rb");
+    if (!mFile) throw std::runtime_error("failed to open trace: " + path);
+    char magic[MAGIC_SIZE];
+    if (fread(magic, 1, MAGIC_SIZE, mFile) != MAGIC_SIZE || memcmp(magic, MAGIC, MAGIC_SIZE)) {
+        fclose(mFile);
+        throw std::runtime_error("not a trace: " + path);
+    }
+}
+
+TraceReader::~TraceReader() {
+    fclose(mFile);
+}
+
+/* The next byte of a record, which must be there */
+int TraceReader::byte() {
+    const int c = getc(mFile);
+    if (c == EOF) throw std::runtime_error("truncated trace");
+    return c;
+}
+
+bool TraceReader::next(TraceRecord& record) {
+    const int tag = getc(mFile);
+    if (tag == EOF) return false;
+    if (tag & ~(TRACE_JUMP | TRACE_INSTR | TRACE_REGS)) throw std::runtime_error("corrupt trace");
+    uint16_t pc = mNextPc;
+    if (tag & TRACE_JUMP) {
+        uint32_t zigzag = 0;
+        for (int shift = 0, c = 0x80; c & 0x80; shift += 7) {
+            if (shift > 14) throw std::runtime_error("corrupt trace");
+            c = byte();
+            zigzag |= (uint32_t)(c & 0x7F) << shift;
+        }
+        pc += (uint16_t)((zigzag >> 1) ^ -(zigzag & 1));
+    }
+    if (tag & TRACE_INSTR) {
+        const int low = byte();
+        mSeen[pc] = low | byte() << 8;
+        mKnown[pc] = true;
+    } else if (!mKnown[pc]) {
+        throw std::runtime_error("corrupt trace");
+    }
+    record.pc = pc;
+    record.instr = mSeen[pc];
+    record.changed = (tag & TRACE_REGS) ? byte() : 0;
+    for (int r = 0; r < 8; r++) {
+        if (!(record.changed >> r & 1)) continue;
+        const int low = byte();
+        record.regs[r] = low | byte() << 8;
+    }
+    mNextPc = pc + 1;
+    return true;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Binary execution trace, written by fpt -G and decoded by fpt-trace.
+ *
+ * The file is "FPTTRC1\n" then a record per executed instruction:
+ *
+ *   tag            1 byte, TRACE_* flags
+ *   PC delta       zigzag varint of PC - (previous PC + 1), if TRACE_JUMP
+ *   instruction    2 bytes, little endian, if TRACE_INSTR
+ *   changed        1 byte, a bit per register R0..R7, if TRACE_REGS
+ *   values         2 bytes each, for the changed registers in order
+ *
+ * The instruction is only stored the first time its address is traced or
+ * when the word there changed since, so a loop costs a byte per
+ * instruction plus the registers it writes. The reader keeps the same
+ * per-address words to fill it back in.
+ */
+enum {
+    TRACE_JUMP = 1 << 0,
+    TRACE_INSTR = 1 << 1,
+    TRACE_REGS = 1 << 2,
+};
+
+struct TraceRecord {
+    uint16_t pc = 0;
+    uint16_t instr = 0;
+    /* Registers the instruction wrote a new value to, R0 in bit 0 */
+    uint8_t changed = 0;
+    /* Values after the instruction, only the changed ones are meaningful */
+    std::array<uint16_t, 8> regs{};
+};
+
+/* Buffers records and writes them in blocks, so the emulation thread
+ * only encodes a few bytes per instruction. */
+class TraceWriter {
+public:
+    static constexpr size_t BUFFER_SIZE = 1 << 16;
+
+    /* Throws std::runtime_error if path cannot be opened */
+    explicit TraceWriter(const std::string& path);
+    ~TraceWriter();
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    /* instr ran at pc, before and after are R0..R7 around it */
+    void record(uint16_t pc, uint16_t instr, const uint16_t before[8], const uint16_t after[8]);
+    void flush();
+    uint64_t records() const { return mRecords; }
+    /* A write failed, the rest of the trace is lost */
+    bool failed() const { return mFailed; }
+
+private:
+    FILE* mFile;
+    std::unique_ptr<uint8_t[]> mBuffer;
+    size_t mSize = 0;
+    uint16_t mNextPc = 0;
+    uint64_t mRecords = 0;
+    bool mFailed = false;
+    /* The word last traced at each address, and whether it was */
+    std::vector<uint16_t> mSeen;
+    std::vector<bool> mKnown;
+};
+
+class TraceReader {
+public:
+    /* Throws std::runtime_error if path cannot be opened or is not a trace */
+    explicit TraceReader(const std::string& path);
+    ~TraceReader();
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+
+    /* The next record, false at the end. Throws std::runtime_error on a
+     * truncated or corrupt record. */
+    bool next(TraceRecord& record);
+
+private:
+    FILE* mFile;
+    uint16_t mNextPc = 0;
+    std::vector<uint16_t> mSeen;
+    std::vector<bool> mKnown;
+
+    int byte();
+};
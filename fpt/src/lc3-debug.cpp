@@ -0,0 +1,139 @@
+#include "lc3-debug.hpp"
+#include "lc3-hw.hpp"
+
+namespace {
+
+using Formatter = char* (*)(uint16_t instr, char* out);
+
+char* put(char* out, const char* s) {
+    while (*s) *out++ = *s++;
+    return out;
+}
+
+char* put_reg(char* out, unsigned r) {
+    *out++ = 'R';
+    *out++ = '0' + (r & 0x7);
+    return out;
+}
+
+/* The low nbit bits in hex, (nbit + 3) / 4 digits */
+char* put_offset(char* out, unsigned nbit, uint16_t instr) {
+    static const char digits[] = "0123456789ABCDEF";
+    const uint16_t value = instr & ((1 << nbit) - 1);
+    *out++ = '#';
+    for (int shift = ((nbit + 3) / 4 - 1) * 4; shift >= 0; shift -= 4) *out++ = digits[(value >> shift) & 0xF];
+    return out;
+}
+
+char* put_dec(char* out, int value) {
+    *out++ = '#';
+    if (value < 0) { *out++ = '-'; value = -value; }
+    if (value >= 10) *out++ = '0' + value / 10;
+    *out++ = '0' + value % 10;
+    return out;
+}
+
+char* format_br(uint16_t instr, char* out) {
+    out = put(out, "BR");
+    if (instr & 0x0800) *out++ = 'n';
+    if (instr & 0x0400) *out++ = 'z';
+    if (instr & 0x0200) *out++ = 'p';
+    *out++ = ' ';
+    return put_offset(out, 9, instr);
+}
+
+/* ADD/AND/XOR, register or imm5 */
+template <const unsigned op> char* format_alu(uint16_t instr, char* out) {
+    out = put(out, op == OP_ADD ? "ADD " : op == OP_AND ? "AND " : "XOR ");
+    out = put_reg(out, instr >> 9);
+    *out++ = ' ';
+    out = put_reg(out, instr >> 6);
+    *out++ = ' ';
+    if (instr & 0x20) return put_dec(out, (int16_t)(instr << 11) >> 11);
+    return put_reg(out, instr);
+}
+
+char* format_shf(uint16_t instr, char* out) {
+    const bool right = instr & 0x10;
+    out = put(out, !right ? "LSHF " : (instr & 0x20) ? "RSHFA " : "RSHFL ");
+    out = put_reg(out, instr >> 9);
+    *out++ = ' ';
+    out = put_reg(out, instr >> 6);
+    *out++ = ' ';
+    return put_dec(out, instr & 0xF);
+}
+
+/* LD/LDI/LEA/ST/STI, PC-relative */
+template <const unsigned op> char* format_pc_relative(uint16_t instr, char* out) {
+    out = put(out, op == OP_LD ? "LD " : op == OP_LDI ? "LDI " : op == OP_LEA ? "LEA " : op == OP_ST ? "ST " : "STI ");
+    out = put_reg(out, instr >> 9);
+    *out++ = ' ';
+    return put_offset(out, 9, instr);
+}
+
+/* LDR/STR, base + offset */
+template <const unsigned op> char* format_base(uint16_t instr, char* out) {
+    out = put(out, op == OP_LDR ? "LDR " : "STR ");
+    out = put_reg(out, instr >> 9);
+    *out++ = ' ';
+    out = put_reg(out, instr >> 6);
+    *out++ = ' ';
+    return put_offset(out, 6, instr);
+}
+
+char* format_jsr(uint16_t instr, char* out) {
+    out = put(out, "JSR ");
+    if (instr & 0x0800) return put_offset(out, 11, instr);
+    return put_reg(out, instr >> 6);
+}
+
+char* format_rti(uint16_t, char* out) {
+    return put(out, "RTI");
+}
+
+char* format_jmp(uint16_t instr, char* out) {
+    return put_reg(put(out, "JMP "), instr >> 6);
+}
+
+char* format_trap(uint16_t instr, char* out) {
+    switch (instr & 0xFF) {
+        case TRAP_GETC:  return put(out, "GETC");
+        case TRAP_OUT:   return put(out, "OUT");
+        case TRAP_PUTS:  return put(out, "PUTS");
+        case TRAP_IN:    return put(out, "IN");
+        case TRAP_PUTSP: return put(out, "PUTSP");
+        case TRAP_HALT:  return put(out, "HALT");
+    }
+    static const char digits[] = "0123456789ABCDEF";
+    out = put(out, "TRAP x");
+    *out++ = digits[(instr >> 4) & 0xF];
+    *out++ = digits[instr & 0xF];
+    return out;
+}
+
+constexpr Formatter formatters[16] = {
+    format_br,                       /* OP_BR */
+    format_alu<OP_ADD>,              /* OP_ADD */
+    format_pc_relative<OP_LD>,       /* OP_LD */
+    format_pc_relative<OP_ST>,       /* OP_ST */
+    format_jsr,                      /* OP_JSR */
+    format_alu<OP_AND>,              /* OP_AND */
+    format_base<OP_LDR>,             /* OP_LDR */
+    format_base<OP_STR>,             /* OP_STR */
+    format_rti,                      /* OP_RTI */
+    format_alu<OP_XOR>,              /* OP_XOR */
+    format_pc_relative<OP_LDI>,      /* OP_LDI */
+    format_pc_relative<OP_STI>,      /* OP_STI */
+    format_jmp,                      /* OP_JMP */
+    format_shf,                      /* OP_SHF */
+    format_pc_relative<OP_LEA>,      /* OP_LEA */
+    format_trap,                     /* OP_TRAP */
+};
+
+} // namespace
+
+size_t disassemble(uint16_t instr, char out[DISASM_MAX]) {
+    char* end = formatters[instr >> 12](instr, out);
+    *end = '\0';
+    return end - out;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+
+class LC3Machine;
+
+/* PRE-DECODED INSTRUCTIONS
+ *
+ * Every instruction word can be turned once into a DecodedInstr, which
+ * holds its handler and its already extracted fields, so that tight loops
+ * do not pay for shifting and sign-extending on every execution.
+ *
+ * Decoded instructions live in a side table parallel to memory, owned by
+ * the machine: the entry at index i is the decoded form of memory[i]. An
+ * entry with a NULL handler has not been decoded yet (or has been
+ * invalidated by a store).
+ * The handler of a fused entry (see fusable) also runs the entry after it,
+ * length tells how many instructions a handler may retire. It returns how
+ * many it did: a fused pair stops after a first half raising a device event.
+ */
+struct DecodedInstr {
+    uint8_t (*handler)(LC3Machine&, const DecodedInstr&);
+    uint16_t op2;    /* imm5/imm4/trapvect8, or SR2 index when !flags for ADD/AND/XOR */
+    uint16_t offset; /* sign-extended PCoffset9/offset6/PCoffset11 */
+    uint8_t r0;      /* DR/SR, nzp for BR */
+    uint8_t r1;      /* SR1/BaseR */
+    uint8_t flags;   /* imm flag for ADD/AND/XOR, D|A flags for SHF, JSR flag */
+    uint8_t length;  /* 1, or 2 for fused entries */
+};
@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "lc3-devices.hpp"
+#include "LC3Machine.hpp"
+
+uint16_t Device::read(LC3Machine& m, uint16_t address) { return m.memory[address]; }
+void Device::write(LC3Machine& m, uint16_t address, uint16_t val) { m.memory[address] = val; }
+
+/* Both the ready and the interrupt enable bits of status are set */
+static bool requested(const LC3Machine& m, uint16_t status) {
+    return (m.memory[status] & (DS_READY | DS_IE)) == (DS_READY | DS_IE);
+}
+
+void Keyboard::latch(LC3Machine& m) {
+    const char c = m.input.pop();
+    if (c) {
+        m.memory[MR_KBSR] |= DS_READY;
+        m.memory[MR_KBDR] = (uint16_t) c;
+    }
+}
+
+uint16_t Keyboard::read(LC3Machine& m, uint16_t address) {
+    switch (address) {
+        case MR_KBSR:
+            if (!(m.memory[MR_KBSR] & DS_READY)) latch(m);
+            if (!(m.memory[MR_KBSR] & DS_READY)) m.idle_poll();
+            break;
+        case MR_KBDR:
+            m.memory[MR_KBSR] &= ~DS_READY;
+            /* The next key may raise another interrupt */
+            if (m.memory[MR_KBSR] & DS_IE) m.raise_device_event();
+            break;
+    }
+    return m.memory[address];
+}
+
+void Keyboard::write(LC3Machine& m, uint16_t address, uint16_t val) {
+    if (address != MR_KBSR) return;
+    m.memory[MR_KBSR] = (m.memory[MR_KBSR] & DS_READY) | (val & DS_IE);
+    m.raise_device_event();
+}
+
+Device::Interrupt Keyboard::service(LC3Machine& m) {
+    if ((m.memory[MR_KBSR] & DS_IE) && !(m.memory[MR_KBSR] & DS_READY)) latch(m);
+    if (requested(m, MR_KBSR)) return {INT_KEYBOARD, PL_KEYBOARD};
+    return {};
+}
+
+void Keyboard::reset(LC3Machine& m) {
+    m.memory[MR_KBSR] = 0;
+    m.memory[MR_KBDR] = 0;
+}
+
+uint16_t Timer::read(LC3Machine& m, uint16_t address) {
+    if (address != MR_TMR) return m.memory[address];
+    /* Reading the status acknowledges the tick */
+    const uint16_t status = m.memory[MR_TMR];
+    m.memory[MR_TMR] &= ~DS_READY;
+    if (!(status & DS_READY)) m.idle_poll();
+    return status;
+}
+
+void Timer::write(LC3Machine& m, uint16_t address, uint16_t val) {
+    switch (address) {
+        case MR_TMR:
+            m.memory[MR_TMR] = (m.memory[MR_TMR] & DS_READY) | (val & DS_IE);
+            break;
+        case MR_TMI:
+            /* Restarted by service(), when the instruction count is exact */
+            m.memory[MR_TMI] = val;
+            mReload = true;
+            break;
+        default:
+            return;
+    }
+    m.raise_device_event();
+}
+
+Device::Interrupt Timer::service(LC3Machine& m) {
+    if (mReload) {
+        mReload = false;
+        mPeriod = m.memory[MR_TMI] * TIMER_UNIT;
+        mDeadline = mPeriod ? m.instructions + mPeriod : UINT64_MAX;
+        m.reschedule();
+    }
+    if (requested(m, MR_TMR)) return {INT_TIMER, PL_TIMER};
+    return {};
+}
+
+void Timer::tick(LC3Machine& m) {
+    m.memory[MR_TMR] |= DS_READY;
+    mDeadline = std::max(mDeadline + mPeriod, m.instructions + 1);
+    m.raise_device_event();
+}
+
+void Timer::reset(LC3Machine& m) {
+    m.memory[MR_TMR] = 0;
+    m.memory[MR_TMI] = 0;
+    mPeriod = 0;
+    mDeadline = UINT64_MAX;
+    mReload = false;
+}
+
+/* No page of [address, address + len) has flags, and it does not wrap */
+static bool plain_ram(const LC3Machine& m, uint16_t address, uint32_t len) {
+    if (address + len > UINT16_MAX + 1) return false;
+    for (uint32_t page = address >> PAGE_BITS; page <= (address + len - 1) >> PAGE_BITS; page++) {
+        if (m.page_flags(page << PAGE_BITS)) return false;
+    }
+    return true;
+}
+
+void block_transfer(LC3Machine& m, uint16_t dst, uint16_t src, uint16_t count, bool fill) {
+    const uint32_t len = count;
+    if (!len) return;
+    if (plain_ram(m, dst, len) && (fill || plain_ram(m, src, len))) {
+        if (fill) std::fill_n(&m.memory[dst], len, src);
+        else std::memmove(&m.memory[dst], &m.memory[src], len * sizeof(uint16_t));
+        for (uint32_t i = 0; i < len; i++) m.invalidate_code(dst + i);
+        m.sideEffects++;
+        return;
+    }
+    /* A copy to a higher overlapping address goes backwards, like memmove */
+    const bool backwards = !fill && (uint16_t)(dst - src) < len;
+    for (uint32_t n = 0; n < len; n++) {
+        const uint16_t i = backwards ? len - 1 - n : n;
+        m.mem_write(dst + i, fill ? src : m.mem_read(src + i));
+    }
+}
+
+uint16_t Dma::read(LC3Machine& m, uint16_t address) {
+    if (address != MR_DMAS) return m.memory[address];
+    /* Reading the status acknowledges the completion */
+    const uint16_t status = m.memory[MR_DMAS];
+    m.memory[MR_DMAS] &= ~DS_READY;
+    return status;
+}
+
+void Dma::write(LC3Machine& m, uint16_t address, uint16_t val) {
+    if (address != MR_DMAS) {
+        m.memory[address] = val;
+        return;
+    }
+    m.memory[MR_DMAS] = (m.memory[MR_DMAS] & DS_READY) | (val & DS_IE);
+    /* A transfer landing on DMAS does not start another one */
+    if ((val & (DMA_COPY | DMA_FILL)) && !mBusy) {
+        mBusy = true;
+        block_transfer(m, m.memory[MR_DMADST], m.memory[MR_DMASRC], m.memory[MR_DMALEN], val & DMA_FILL);
+        mBusy = false;
+        m.memory[MR_DMAS] |= DS_READY;
+    }
+    m.raise_device_event();
+}
+
+Device::Interrupt Dma::service(LC3Machine& m) {
+    if (requested(m, MR_DMAS)) return {INT_DMA, PL_DMA};
+    return {};
+}
+
+void Dma::reset(LC3Machine& m) {
+    m.memory[MR_DMAS] = 0;
+    m.memory[MR_DMASRC] = 0;
+    m.memory[MR_DMADST] = 0;
+    m.memory[MR_DMALEN] = 0;
+    mBusy = false;
+}
+
+uint16_t MachineControl::read(LC3Machine& m, uint16_t address) {
+    return m.running ? m.memory[address] | MCR_CLOCK : m.memory[address] & ~MCR_CLOCK;
+}
+
+void MachineControl::write(LC3Machine& m, uint16_t address, uint16_t val) {
+    m.memory[address] = val;
+    if (val & MCR_CLOCK) return;
+    /* Stopped like TRAP HALT: the engines leave on the event */
+    m.console.flush();
+    m.running = false;
+    m.raise_device_event();
+}
+
+void MachineControl::reset(LC3Machine& m) {
+    m.memory[MR_MCR] = MCR_CLOCK;
+}
+
+void Console::to_stream(std::ostream& os) {
+    flush();
+    mSink = Sink::Stream;
+    mStream = &os;
+}
+
+void Console::to_fd(int fd) {
+    flush();
+    mSink = Sink::Fd;
+    mFd = fd;
+}
+
+void Console::to_memory() {
+    flush();
+    mSink = Sink::Memory;
+}
+
+std::string Console::take() {
+    flush();
+    std::string taken;
+    taken.swap(mMemory);
+    return taken;
+}
+
+void Console::put(LC3Machine& m, const char* s, size_t n) {
+    if (!mSize && n) schedule(m);
+    while (n) {
+        const size_t count = std::min(n, BUFFER_SIZE - mSize);
+        memcpy(mBuffer.get() + mSize, s, count);
+        mSize += count;
+        s += count;
+        n -= count;
+        if (mSize == BUFFER_SIZE) flush();
+    }
+}
+
+void Console::flush() {
+    mDeadline = UINT64_MAX;
+    if (!mSize) return;
+    switch (mSink) {
+        case Sink::Stream:
+            mStream->write(mBuffer.get(), mSize);
+            mStream->flush();
+            break;
+        case Sink::Fd:
+            for (size_t done = 0; done < mSize; ) {
+#ifdef _WIN32
+                const int count = _write(mFd, mBuffer.get() + done, (unsigned)(mSize - done));
+#else
+                const ssize_t count = ::write(mFd, mBuffer.get() + done, mSize - done);
+                if (count < 0 && errno == EINTR) continue;
+#endif
+                if (count <= 0) break; //the output is gone, drop the rest
+                done += count;
+            }
+            break;
+        case Sink::Memory:
+            mMemory.append(mBuffer.get(), mSize);
+            break;
+    }
+    mSize = 0;
+}
+
+/* The flush deadline needs the engines to end their slice */
+void Console::schedule(LC3Machine& m) {
+    mDeadline = m.instructions + FLUSH_INSTRUCTIONS;
+    m.reschedule();
+    m.raise_device_event();
+}
+
+uint16_t Console::read(LC3Machine& m, uint16_t address) {
+    if (address == MR_DSR) return DS_READY;
+    return m.memory[address];
+}
+
+void Console::write(LC3Machine& m, uint16_t address, uint16_t val) {
+    if (address != MR_DDR) return;
+    m.memory[MR_DDR] = val;
+    put(m, (char)val);
+}
+
+void Console::reset(LC3Machine& m) {
+    flush();
+    m.memory[MR_DSR] = DS_READY;
+    m.memory[MR_DDR] = 0;
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+
+class LC3Machine;
+
+/* DEVICES
+ *
+ * A peripheral owns some addresses in PAGE_DEVICE pages (see
+ * LC3Machine::map_device): every load and store to them goes through it
+ * instead of memory. It can also observe plain RAM (LC3Machine::observe),
+ * getting a call after each store there.
+ *
+ * Devices raise LC3Machine::raise_device_event when something happens
+ * (a register write, a key, ...), the machine then calls service() on
+ * each of them between two instructions and takes the highest interrupt.
+ * Timed devices return their next deadline, in executed instructions.
+ */
+class Device {
+public:
+    struct Interrupt {
+        uint8_t vector = 0;
+        uint16_t priority = 0; /* 0: none */
+    };
+
+    virtual ~Device() = default;
+    /* Load from one of its addresses, memory[] by default */
+    virtual uint16_t read(LC3Machine& m, uint16_t address);
+    /* Store to one of its addresses, memory[] by default */
+    virtual void write(LC3Machine& m, uint16_t address, uint16_t val);
+    /* Store to observed RAM, memory[address] already holds the new value */
+    virtual void written(LC3Machine&, uint16_t) {}
+    /* Update the state after a device event and say which interrupt is requested */
+    virtual Interrupt service(LC3Machine&) { return {}; }
+    /* Instruction count at which tick() is due, LC3Machine::reschedule
+     * must be called when it changes */
+    virtual uint64_t deadline() const { return UINT64_MAX; }
+    virtual void tick(LC3Machine&) {}
+    /* Back to the power-on state, called by LC3Machine::reset */
+    virtual void reset(LC3Machine&) {}
+};
+
+/* KBSR/KBDR. A key is latched in KBDR and KBSR is ready until KBDR is
+ * read, the next key waits in LC3Machine::input. */
+class Keyboard : public Device {
+    void latch(LC3Machine& m);
+public:
+    uint16_t read(LC3Machine& m, uint16_t address) override;
+    void write(LC3Machine& m, uint16_t address, uint16_t val) override;
+    Interrupt service(LC3Machine& m) override;
+    void reset(LC3Machine& m) override;
+};
+
+/* TMR/TMI. Writing TMI restarts the timer, which gets ready every
+ * TMI * TIMER_UNIT instructions, 0 stops it. Reading TMR acknowledges. */
+class Timer : public Device {
+    uint64_t mPeriod = 0;
+    uint64_t mDeadline = UINT64_MAX;
+    bool mReload = false;
+public:
+    uint16_t read(LC3Machine& m, uint16_t address) override;
+    void write(LC3Machine& m, uint16_t address, uint16_t val) override;
+    Interrupt service(LC3Machine& m) override;
+    uint64_t deadline() const override { return mDeadline; }
+    void tick(LC3Machine& m) override;
+    void reset(LC3Machine& m) override;
+};
+
+/* Copy count words from src to dst, as memmove, or set them to src if
+ * fill. Used by the DMA and the TRAP_MEMCPY/TRAP_MEMSET host traps. */
+void block_transfer(LC3Machine& m, uint16_t dst, uint16_t src, uint16_t count, bool fill);
+
+/* DMAS/DMASRC/DMADST/DMALEN. Writing DMA_COPY or DMA_FILL to DMAS runs
+ * the transfer at once, natively, then DMAS is ready until it is read.
+ * Plain RAM is moved with memmove/fill, device and observed pages word
+ * by word, so that the screen and other devices see the stores. */
+class Dma : public Device {
+    bool mBusy = false;
+public:
+    uint16_t read(LC3Machine& m, uint16_t address) override;
+    void write(LC3Machine& m, uint16_t address, uint16_t val) override;
+    Interrupt service(LC3Machine& m) override;
+    void reset(LC3Machine& m) override;
+};
+
+/* MCR. Bit 15 reads set while the machine runs, a store clearing it
+ * halts the machine, as the HALT routine of an OS image does. */
+class MachineControl : public Device {
+public:
+    uint16_t read(LC3Machine& m, uint16_t address) override;
+    void write(LC3Machine& m, uint16_t address, uint16_t val) override;
+    void reset(LC3Machine& m) override;
+};
+
+/* Console output: the OUT/PUTS/PUTSP/IN/HALT traps and DSR/DDR (always
+ * ready, a store to DDR prints its low byte).
+ *
+ * Characters are gathered in a buffer and written in blocks to a stream
+ * (std::cout by default), a file descriptor or memory. The buffer is
+ * flushed on HALT, when GETC/IN wait for a key, when it is full and
+ * FLUSH_INSTRUCTIONS after its first character, so that a program
+ * printing progress is seen while it runs. Whoever stops a machine
+ * before HALT flushes it, while the sink is still there.
+ */
+class Console : public Device {
+public:
+    static constexpr size_t BUFFER_SIZE = 1 << 16;
+    static constexpr uint64_t FLUSH_INSTRUCTIONS = 1000000;
+
+    Console() : mBuffer(std::make_unique<char[]>(BUFFER_SIZE)) {}
+    Console(const Console&) = delete;
+    Console& operator=(const Console&) = delete;
+
+    /* Sinks, what is buffered goes to the previous one first */
+    void to_stream(std::ostream& os);
+    /* fd is left open */
+    void to_fd(int fd);
+    void to_memory();
+    /* What the memory sink got so far, which is cleared */
+    std::string take();
+
+    void put(LC3Machine& m, char c) {
+        if (!mSize) schedule(m);
+        mBuffer[mSize++] = c;
+        if (mSize == BUFFER_SIZE) flush();
+    }
+    void put(LC3Machine& m, const char* s) { while (*s) put(m, *s++); }
+    /* n characters at once, e.g. a trace line */
+    void put(LC3Machine& m, const char* s, size_t n);
+    void flush();
+
+    uint16_t read(LC3Machine& m, uint16_t address) override;
+    void write(LC3Machine& m, uint16_t address, uint16_t val) override;
+    uint64_t deadline() const override { return mDeadline; }
+    void tick(LC3Machine&) override { flush(); }
+    void reset(LC3Machine& m) override;
+
+private:
+    enum class Sink { Stream, Fd, Memory } mSink = Sink::Stream;
+    std::ostream* mStream = &std::cout;
+    int mFd = -1;
+    std::string mMemory;
+    std::unique_ptr<char[]> mBuffer;
+    size_t mSize = 0;
+    uint64_t mDeadline = UINT64_MAX;
+
+    void schedule(LC3Machine& m);
+};
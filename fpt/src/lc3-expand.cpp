@@ -0,0 +1,76 @@
+#include "lc3-expand.hpp"
+
+#if FPT_HAS_SIMD_EXPAND
+#include <immintrin.h>
+#endif
+
+/* BG is the high byte of a colour word, FG the low one */
+void expand_pair_scalar(const uint16_t pixels[8], uint16_t color_a, uint16_t color_b, uint8_t* out, size_t stride) {
+    const uint8_t left[2] = { (uint8_t)(color_a >> 8), (uint8_t)color_a };
+    const uint8_t right[2] = { (uint8_t)(color_b >> 8), (uint8_t)color_b };
+    for (int ln = 0; ln < 8; ln++, out += stride) {
+        const uint8_t high = pixels[ln] >> 8, low = pixels[ln] & 0xFF;
+        for (int p = 0; p < 8; p++) out[p] = left[(high >> (7 - p)) & 0x1];
+        for (int p = 0; p < 8; p++) out[8 + p] = right[(low >> (7 - p)) & 0x1];
+    }
+}
+
+#if FPT_HAS_SIMD_EXPAND
+
+namespace {
+
+constexpr uint64_t BROADCAST = 0x0101010101010101;
+/* Bit of each pixel within its byte, leftmost first */
+constexpr uint64_t BIT_MASKS = 0x0102040810204080;
+
+/* The 16 bytes of a line: the high pixel byte 8 times, then the low one */
+inline __m128i spread_sse2(uint16_t pixels) {
+    return _mm_set_epi64x((pixels & 0xFF) * BROADCAST, (pixels >> 8) * BROADCAST);
+}
+
+} // namespace
+
+void expand_pair_sse2(const uint16_t pixels[8], uint16_t color_a, uint16_t color_b, uint8_t* out, size_t stride) {
+    const __m128i bits = _mm_set1_epi64x(BIT_MASKS);
+    const __m128i fg = _mm_set_epi64x((color_b & 0xFF) * BROADCAST, (color_a & 0xFF) * BROADCAST);
+    const __m128i bg = _mm_set_epi64x((color_b >> 8) * BROADCAST, (color_a >> 8) * BROADCAST);
+    for (int ln = 0; ln < 8; ln++, out += stride) {
+        const __m128i set = _mm_cmpeq_epi8(_mm_and_si128(spread_sse2(pixels[ln]), bits), bits);
+        const __m128i line = _mm_or_si128(_mm_and_si128(set, fg), _mm_andnot_si128(set, bg));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), line);
+    }
+}
+
+__attribute__((target("avx2")))
+void expand_pair_avx2(const uint16_t pixels[8], uint16_t color_a, uint16_t color_b, uint8_t* out, size_t stride) {
+    const __m256i bits = _mm256_set1_epi64x(BIT_MASKS);
+    const int64_t fg_a = (color_a & 0xFF) * BROADCAST, fg_b = (color_b & 0xFF) * BROADCAST;
+    const int64_t bg_a = (color_a >> 8) * BROADCAST, bg_b = (color_b >> 8) * BROADCAST;
+    const __m256i fg = _mm256_set_epi64x(fg_b, fg_a, fg_b, fg_a);
+    const __m256i bg = _mm256_set_epi64x(bg_b, bg_a, bg_b, bg_a);
+    /* Two lines per vector, one per 128-bit lane */
+    for (int ln = 0; ln < 8; ln += 2, out += 2 * stride) {
+        const uint16_t p0 = pixels[ln], p1 = pixels[ln + 1];
+        const __m256i spread = _mm256_set_epi64x((p1 & 0xFF) * BROADCAST, (p1 >> 8) * BROADCAST,
+                                                 (p0 & 0xFF) * BROADCAST, (p0 >> 8) * BROADCAST);
+        const __m256i set = _mm256_cmpeq_epi8(_mm256_and_si256(spread, bits), bits);
+        const __m256i lines = _mm256_blendv_epi8(bg, fg, set);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm256_castsi256_si128(lines));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + stride), _mm256_extracti128_si256(lines, 1));
+    }
+}
+
+bool cpu_has_avx2() {
+    return __builtin_cpu_supports("avx2");
+}
+
+ExpandPair best_expander() {
+    static const ExpandPair best = cpu_has_avx2() ? expand_pair_avx2 : expand_pair_sse2;
+    return best;
+}
+
+#else
+
+ExpandPair best_expander() { return expand_pair_scalar; }
+
+#endif
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/* TILE EXPANDER
+ *
+ * Turns the 8 lines of a pair of adjacent tiles, one 16-pixel word per
+ * line with bit 15 leftmost, into colour bytes: set bits take FG and clear
+ * ones BG, from color_a for the left tile and color_b for the right one.
+ * out is the top left pixel, stride the distance between two lines.
+ *
+ * The SIMD versions select colours with byte masks instead of a branch
+ * or a lookup per pixel: SSE2 does a line per instruction, AVX2 two.
+ */
+using ExpandPair = void (*)(const uint16_t pixels[8], uint16_t color_a, uint16_t color_b, uint8_t* out, size_t stride);
+
+#if defined(__GNUC__) && defined(__x86_64__)
+    #define FPT_HAS_SIMD_EXPAND 1
+#else
+    #define FPT_HAS_SIMD_EXPAND 0
+#endif
+
+void expand_pair_scalar(const uint16_t pixels[8], uint16_t color_a, uint16_t color_b, uint8_t* out, size_t stride);
+#if FPT_HAS_SIMD_EXPAND
+void expand_pair_sse2(const uint16_t pixels[8], uint16_t color_a, uint16_t color_b, uint8_t* out, size_t stride);
+/* Only where cpu_has_avx2() */
+void expand_pair_avx2(const uint16_t pixels[8], uint16_t color_a, uint16_t color_b, uint8_t* out, size_t stride);
+bool cpu_has_avx2();
+#endif
+
+/* The fastest expander this CPU runs, checked once */
+ExpandPair best_expander();
@@ -1,48 +1,8 @@
 #include "lc3-hw.hpp"
+#include "LC3Machine.hpp"
+#include <array>
 #include <iostream>
-
-uint16_t reg[R_COUNT];
-uint16_t PC_START = 0x3000;
-
-void update_flags(uint16_t r) {
-    if(reg[r] == 0) {
-        reg[R_COND] = FL_ZRO;
-    } else if (reg[r] >> 15) {
-        reg[R_COND] = FL_NEG;
-    } else {
-        reg[R_COND] = FL_POS;
-    }
-}
-
-void read_image_file(FILE* file)
-{
-    /* the origin tells us where in memory to place the image */
-    uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
-    origin = swap16(origin);
-    PC_START = origin;
-
-    /* we know the maximum file size so we only need one fread */
-    uint16_t max_read = UINT16_MAX - origin;
-    uint16_t* p = memory + origin;
-    size_t read = fread(p, sizeof(uint16_t), max_read, file);
-
-    /* swap to little endian */
-    while (read-- > 0)
-    {
-        *p = swap16(*p);
-        ++p;
-    }
-}
-
-int read_image(const char* image_path)
-{
-    FILE* file = fopen(image_path, "rb");
-    if (!file) { return 0; };
-    read_image_file(file);
-    fclose(file);
-    return 1;
-}
+#include <utility>
 
 #ifdef _WIN32
 
@@ -102,38 +62,43 @@ void handle_interrupt([[maybe_unused]] int signal)
     exit(-2);
 }
 
-int running = 1;
-
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wsequence-point"
-template <const unsigned op> void exec(uint16_t instr) {
+template <const unsigned op, const bool flags = true> __attribute__((always_inline)) inline void execute(LC3Machine& m, const DecodedInstr& d) {
+    uint16_t* const reg = m.reg;
     const uint16_t opbit = 1 << op;
-    uint16_t r0, r1, op2, offset;
+    const uint16_t r0 = d.r0, r1 = d.r1;
+    uint16_t op2, offset;
     if(0x0100 & opbit) { //RTI
         if((reg[R_PSR] >> 15) == 0) {
-            reg[R_PC] = mem_read(reg[R_R6]); //R6 is the SSP
+            reg[R_PC] = m.mem_read(reg[R_R6]); //R6 is the SSP
             reg[R_R6]++;
-            uint16_t temp = mem_read(reg[R_R6]);
+            uint16_t temp = m.mem_read(reg[R_R6]);
             reg[R_R6]++;
             reg[R_PSR] = temp;
+            m.set_cond_flags(temp & 0x7);
+            if(temp & 0x8000) { //back to user mode, switch to the user stack
+                m.savedSsp = reg[R_R6];
+                reg[R_R6] = m.savedUsp;
+            }
+            /* The priority may have dropped below a pending interrupt */
+            m.raise_device_event();
         } else {
             //TODO Privilege mode exception
             abort();
         }
     }
-    if(0x6EEF & opbit) r0 = (instr >> 9) & 0x7; //also work as COND for BR
-    if(0x32F2 & opbit) r1 = (instr >> 6) & 0x7;
     if(0x1000 & opbit) reg[R_PC] = reg[r1]; //JMP
     if(0x0222 & opbit) { //ADD, AND, XOR
-                        op2 = ((instr >> 5) & 1) ? //imm_flag
-                            sign_extend(instr & 0x1F, 5): //op2 = imm5
-                            op2 = reg[(instr & 0x7)]; //op2 = reg[r2]
+                        op2 = d.flags ? //imm_flag
+                            d.op2: //op2 = imm5
+                            reg[d.op2]; //op2 = reg[r2]
     }
     if(0x2000 & opbit) { //SHF/RES
-                        op2 = instr & 0xF; //op2 = imm4
-                        if((instr >> 4) & 1) { //D flag
+                        op2 = d.op2; //op2 = imm4
+                        if(d.flags & 0x1) { //D flag
                             //RSHF
-                            if((instr >> 5) & 1) { //A flag
+                            if(d.flags & 0x2) { //A flag
                                 //RSHFA
 #ifndef _ANDROID
                                 asm("movw %%bx, %%ax;"
@@ -164,81 +129,205 @@ template <const unsigned op> void exec(uint16_t instr) {
     if(0x0002 & opbit) reg[r0] = reg[r1] + op2; //ADD
     if(0x0020 & opbit) reg[r0] = reg[r1] & op2; //AND
     if(0x0200 & opbit) reg[r0] = reg[r1] ^ op2; //NOT
-    if(0x4C0D & opbit) offset = reg[R_PC] + sign_extend(instr & 0x1FF, 9); //offset = PC+PCoffset9
-    if(0x00C0 & opbit) offset = reg[r1] + sign_extend(instr & 0x3F, 6); //offset = R1+Offset6
-    if(0x0001 & opbit) if (r0 & reg[R_COND]) reg[R_PC] = offset; //BR
-    if(0x0044 & opbit) reg[r0] = mem_read(offset); //LD & LDR
-    if(0x0088 & opbit) mem_write(offset, reg[r0]); //ST & STR
+    if(0x4C0D & opbit) offset = reg[R_PC] + d.offset; //offset = PC+PCoffset9
+    if(0x00C0 & opbit) offset = reg[r1] + d.offset; //offset = R1+Offset6
+    if(0x0001 & opbit) if (r0 & m.cond_flags()) reg[R_PC] = offset; //BR
+    if(0x0044 & opbit) reg[r0] = m.mem_read(offset); //LD & LDR
+    if(0x0088 & opbit) m.mem_write(offset, reg[r0]); //ST & STR
     if(0x0010 & opbit) { //JSR(R)
                                         reg[R_R7] = reg[R_PC]; 
-                                        reg[R_PC] = ((instr >> 11) & 1) ? 
-                                            (reg[R_PC] + sign_extend(instr & 0x7FF, 11)) : //JSR
+                                        reg[R_PC] = d.flags ? 
+                                            (reg[R_PC] + d.offset) : //JSR
                                             reg[r1]; //JSRR
     }
-    if(0x0400 & opbit) reg[r0] = mem_read(mem_read(offset)); //LDI
-    if(0x0800 & opbit) mem_write(mem_read(offset), reg[r0]); //STI
+    if(0x0400 & opbit) reg[r0] = m.mem_read(m.mem_read(offset)); //LDI
+    if(0x0800 & opbit) m.mem_write(m.mem_read(offset), reg[r0]); //STI
     if(0x4000 & opbit) reg[r0] = offset; //LEA
-    if(0x6666 & opbit) update_flags(r0);
+    if((0x6666 & opbit) && flags) m.update_flags(r0);
     if(0x8000 & opbit) { //TRAP
-        switch (instr & 0xFF)
-        {
-            case TRAP_GETC:
-                {
-                    reg[R_R0] = (uint16_t) input_buffer.pop_or_wait();
-                }
-                break;
-            case TRAP_OUT:
-                {
-                    std::cout << (char)reg[R_R0];
-                }
-                break;
-            case TRAP_PUTS:
-                {
-                    uint16_t start_address = reg[R_R0];
-                    uint16_t* c = &memory[start_address];
-                    while(*c)
-                    {
-                        std::cout << (char)*c;
-                        ++c;
-                    }
-                }
-                break;
-            case TRAP_IN:
-                {
-                    std::cout << "Enter a character: ";
-                    char c = input_buffer.pop_or_wait();
-                    std::cout << c;
-                    reg[R_R0] = (uint16_t) c;
-                }
-                break;
-            case TRAP_PUTSP:
-                {
-                    uint16_t start_address = reg[R_R0];
-                    uint16_t* c = &memory[start_address];
-                    while(*c)
-                    {
-                        char c1 = (*c) & 0xFF,
-                             c2 = (*c) >> 8;
-                        std::cout << c1;
-                        if(c2) std::cout << c2;
-                        ++c;
-                    }
-                }
-                break;
-            case TRAP_HALT:
-                {
-                    std::cout << "HALT";
-                    running = 0;
-                }
-                break;
+        m.sideEffects++;
+        m.stats.traps[d.op2]++;
+        const TrapHandler native = m.trap_handler(d.op2);
+        if(native) {
+            native(m);
+        } else {
+            reg[R_R7] = reg[R_PC];
+            reg[R_PC] = m.mem_read(d.op2);
         }
     }
 }
+/* DecodedInstr handler of a single instruction */
+template <const unsigned op> uint8_t execute_one(LC3Machine& m, const DecodedInstr& d) {
+    execute<op>(m, d);
+    return 1;
+}
+/* Extract the fields used by opcode op, once, so that execute<op> only
+ * has to look them up. The same opbit masks of execute<op> apply. */
+template <const unsigned op> __attribute__((always_inline)) inline DecodedInstr decode(uint16_t instr) {
+    const uint16_t opbit = 1 << op;
+    DecodedInstr d{};
+    d.handler = execute_one<op>;
+    d.length = 1;
+    if(0x6EEF & opbit) d.r0 = (instr >> 9) & 0x7; //also work as COND for BR
+    if(0x32F2 & opbit) d.r1 = (instr >> 6) & 0x7;
+    if(0x0222 & opbit) { //ADD, AND, XOR
+                        d.flags = (instr >> 5) & 1; //imm_flag
+                        d.op2 = d.flags ?
+                            sign_extend(instr & 0x1F, 5): //op2 = imm5
+                            instr & 0x7; //op2 = r2
+    }
+    if(0x2000 & opbit) { //SHF/RES
+                        d.op2 = instr & 0xF; //op2 = imm4
+                        d.flags = (instr >> 4) & 0x3; //A|D flags
+    }
+    if(0x4C0D & opbit) d.offset = sign_extend(instr & 0x1FF, 9); //PCoffset9
+    if(0x00C0 & opbit) d.offset = sign_extend(instr & 0x3F, 6); //Offset6
+    if(0x0010 & opbit) { //JSR(R)
+                        d.flags = (instr >> 11) & 1;
+                        d.offset = sign_extend(instr & 0x7FF, 11); //PCoffset11
+    }
+    if(0x8000 & opbit) d.op2 = instr & 0xFF; //trapvect8
+    return d;
+}
+
+template <const unsigned op> void exec(LC3Machine& m, uint16_t instr) { execute<op>(m, decode<op>(instr)); }
+
+/* Runs the instruction d and the one decoded right after it in the side
+ * table. When op2 sets the flags, op1 does not bother updating them.
+ * A load may read a device register and raise a device event, which the
+ * other engines handle before the next instruction: the pair then stops
+ * after op1, with its flags set. */
+template <const unsigned op1, const unsigned op2> uint8_t execute_fused(LC3Machine& m, const DecodedInstr& d) {
+    constexpr bool load = op1 == OP_LD || op1 == OP_LDR;
+    execute<op1, load || !((0x6666 >> op2) & 1)>(m, d);
+    if constexpr (load) {
+        if(m.device_event()) return 1;
+    }
+    m.reg[R_PC]++;
+    execute<op2>(m, (&d)[1]);
+    return 2;
+}
 #pragma GCC diagnostic pop
 
-void (*op_table[16])(uint16_t) = {
+using DecodedHandler = uint8_t (*)(LC3Machine&, const DecodedInstr&);
+template <size_t i> constexpr DecodedHandler fused_handler() {
+    if constexpr (fusable(i >> 4, i & 0xF)) return execute_fused<(i >> 4), (i & 0xF)>;
+    else return nullptr;
+}
+template <size_t... i> constexpr auto make_fused_table(std::index_sequence<i...>) {
+    return std::array<DecodedHandler, sizeof...(i)>{ fused_handler<i>()... };
+}
+/* Indexed by op1 << 4 | op2 */
+constexpr auto fused_table = make_fused_table(std::make_index_sequence<16 * 16>{});
+
+void (*op_table[16])(LC3Machine&, uint16_t) = {
     exec<0>, exec<1>, exec<2>, exec<3>,
     exec<4>, exec<5>, exec<6>, exec<7>,
-    NULL, exec<9>, exec<10>, exec<11>,
+    exec<8>, exec<9>, exec<10>, exec<11>,
     exec<12>, exec<13>, exec<14>, exec<15>
 };
+
+DecodedInstr (*decode_table[16])(uint16_t) = {
+    decode<0>, decode<1>, decode<2>, decode<3>,
+    decode<4>, decode<5>, decode<6>, decode<7>,
+    decode<8>, decode<9>, decode<10>, decode<11>,
+    decode<12>, decode<13>, decode<14>, decode<15>
+};
+
+const DecodedInstr& LC3Machine::decode_at(uint16_t address) {
+    const bool device = page_flags(address) & PAGE_DEVICE;
+    DecodedInstr& d = device ? mDeviceScratch : mDecoded[address];
+    const uint16_t instr = mem_read(address);
+    d = decode_table[instr >> 12](instr);
+
+    /* Superinstruction: fuse with the next word, which is decoded as well.
+     * invalidate_code drops this entry when the next word changes. */
+    const uint16_t next = address + 1;
+    if(!device && !(page_flags(next) & PAGE_DEVICE)) {
+        const uint16_t next_instr = memory[next];
+        if(auto fused = fused_table[(instr >> 12) << 4 | next_instr >> 12]) {
+            if(!mDecoded[next].handler) mDecoded[next] = decode_table[next_instr >> 12](next_instr);
+            d.handler = fused;
+            d.length = 2;
+        }
+    }
+    return d;
+}
+
+uint64_t run_reference(LC3Machine& m, uint64_t budget) {
+    uint64_t executed = 0;
+    for(; executed < budget && m.running && !m.device_event(); executed++) {
+        uint16_t instr = m.mem_read(m.reg[R_PC]++);
+        op_table[instr >> 12](m, instr);
+    }
+    return executed;
+}
+
+uint64_t run_counted(LC3Machine& m, uint64_t budget) {
+    uint64_t executed = 0;
+    for(; executed < budget && m.running && !m.device_event(); executed++) {
+        uint16_t instr = m.mem_read(m.reg[R_PC]++);
+        m.stats.ops[instr >> 12]++;
+        op_table[instr >> 12](m, instr);
+    }
+    return executed;
+}
+
+uint64_t run_decoded(LC3Machine& m, uint64_t budget) {
+    uint64_t executed = 0;
+    while (executed < budget && m.running && !m.device_event()) {
+        const DecodedInstr& d = m.fetch_decoded(m.reg[R_PC]);
+        /* A fused pair would overrun the budget by one */
+        if(d.length > budget - executed) {
+            executed += run_reference(m, 1);
+            continue;
+        }
+        m.reg[R_PC]++;
+        executed += d.handler(m, d);
+    }
+    return executed;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+/* Direct-threaded engine: every handler ends with its own copy of the
+ * fetch/dispatch sequence (GCC labels-as-values), so each opcode gets its
+ * own indirect jump instead of sharing the single call site of op_table.
+ * Only TRAP can stop the machine, so only TRAP checks running.
+ * Device events are checked in the dispatch sequence. */
+uint64_t run_threaded(LC3Machine& m, uint64_t budget) {
+    static void* const dispatch_table[16] = {
+        &&op_0, &&op_1, &&op_2, &&op_3,
+        &&op_4, &&op_5, &&op_6, &&op_7,
+        &&op_8, &&op_9, &&op_10, &&op_11,
+        &&op_12, &&op_13, &&op_14, &&op_15
+    };
+    uint16_t* const reg = m.reg;
+    uint64_t left = budget;
+    uint16_t instr;
+#define DISPATCH() do { if(!left || m.device_event()) goto out; left--; instr = m.mem_read(reg[R_PC]++); goto *dispatch_table[instr >> 12]; } while(0)
+    if(!m.running) return 0;
+    DISPATCH();
+    op_0:  exec<0>(m, instr);  DISPATCH();
+    op_1:  exec<1>(m, instr);  DISPATCH();
+    op_2:  exec<2>(m, instr);  DISPATCH();
+    op_3:  exec<3>(m, instr);  DISPATCH();
+    op_4:  exec<4>(m, instr);  DISPATCH();
+    op_5:  exec<5>(m, instr);  DISPATCH();
+    op_6:  exec<6>(m, instr);  DISPATCH();
+    op_7:  exec<7>(m, instr);  DISPATCH();
+    op_8:  exec<8>(m, instr);  DISPATCH();
+    op_9:  exec<9>(m, instr);  DISPATCH();
+    op_10: exec<10>(m, instr); DISPATCH();
+    op_11: exec<11>(m, instr); DISPATCH();
+    op_12: exec<12>(m, instr); DISPATCH();
+    op_13: exec<13>(m, instr); DISPATCH();
+    op_14: exec<14>(m, instr); DISPATCH();
+    op_15: exec<15>(m, instr); if(!m.running) goto out; DISPATCH();
+#undef DISPATCH
+out:
+    return budget - left;
+}
+#else
+/* No labels-as-values: fall back to the op_table loop */
+uint64_t run_threaded(LC3Machine& m, uint64_t budget) { return run_reference(m, budget); }
+#endif
@@ -20,6 +20,9 @@
 #endif
 
 #include "memory.hpp"
+#include "lc3-decode.hpp"
+
+class LC3Machine;
 
 enum {
     TRAP_GETC = 0x20,  /* get character from keyboard, not echoed onto the terminal */
@@ -27,7 +30,16 @@ enum {
     TRAP_PUTS = 0x22,  /* output a word string */
     TRAP_IN = 0x23,    /* get character from keyboard, echoed onto the terminal */
     TRAP_PUTSP = 0x24, /* output a byte string */
-    TRAP_HALT = 0x25   /* halt the program */
+    TRAP_HALT = 0x25,  /* halt the program */
+};
+
+/* Host services, see install_host_traps */
+enum {
+    TRAP_MUL = 0x30,    /* R0:R1 = R0 * R1, signed, low word in R0 */
+    TRAP_DIVMOD = 0x31, /* R0, R1 = R0 / R1, R0 % R1, signed; left alone if R1 is 0 */
+    TRAP_MEMCPY = 0x32, /* copy R2 words from R1 to R0, as memmove */
+    TRAP_MEMSET = 0x33, /* set R2 words from R0 to R1 */
+    TRAP_RANDOM = 0x34, /* R0 = 16 random bits */
 };
 
 /* REGISTERS 
@@ -36,6 +48,10 @@ enum {
  * * 8 general purpose registers (R0-R7)
  * * 1 program counter register (PC)
  * * 1 confition flags register (COND)
+ *
+ * COND does not hold N/Z/P directly but the last value written by a
+ * flag-setting instruction: the flags are derived from it by cond_flags()
+ * only when a BR, a PSR read or a debugger needs them.
  */
 enum {
     R_R0 = 0,
@@ -51,12 +67,6 @@ enum {
     R_PSR,
     R_COUNT,
 };
-extern uint16_t reg[R_COUNT];
-
-/* Where the first program instruction is loaded */
-/* 0x3000 is the default */
-extern uint16_t PC_START;
-
 /* Instruction set
  * 
  * There are 16 opcodes in LC-3.
@@ -72,7 +82,7 @@ enum {
     OP_AND,    /* bitwise and */
     OP_LDR,    /* load register */
     OP_STR,    /* store register */
-    OP_RTI,    /* unused */
+    OP_RTI,    /* return from interrupt */
     OP_XOR,    /* bitwise xor */
     OP_LDI,    /* load indirect */
     OP_STI,    /* store indirect */
@@ -97,9 +107,6 @@ enum {
 inline uint16_t sign_extend(uint16_t x, int bit_count) { if (x >> (bit_count - 1) & 1) x |= (0xFFFF << bit_count); return x; }
 inline uint16_t swap16(uint16_t x) { return (x << 8) | (x >> 8); }
 
-void update_flags(uint16_t r);
-void read_image_file(FILE* file);
-int read_image(const char* image_path);
 
 #ifdef _WIN32
 void ErrorExit (char* lpszMessage);
@@ -112,6 +119,34 @@ void restore_input_buffering();
 
 void handle_interrupt(int signal);
 
-extern int running;
+extern void (*op_table[16])(LC3Machine&, uint16_t);
+extern DecodedInstr (*decode_table[16])(uint16_t);
+
+/* ENGINES
+ *
+ * Each one runs m from reg[R_PC] for at most budget instructions, less if
+ * the program halts or a device event is raised (see
+ * LC3Machine::device_event), and returns how many instructions it executed.
+ * op_table/exec<op> is the reference engine the others are tested against.
+ */
+uint64_t run_reference(LC3Machine& m, uint64_t budget);
+uint64_t run_decoded(LC3Machine& m, uint64_t budget);
+uint64_t run_threaded(LC3Machine& m, uint64_t budget);
+/* op_table loop counting opcodes in MachineStats::ops */
+uint64_t run_counted(LC3Machine& m, uint64_t budget);
 
-extern void (*op_table[16])(uint16_t);
+/* SUPERINSTRUCTIONS
+ *
+ * When the decoder finds two adjacent instructions matching these masks it
+ * installs a single handler running both. The rule for the first one: it
+ * neither writes memory nor changes the PC, so the second one is always
+ * executed and cannot be modified under our feet. That leaves the ALU ops,
+ * LEA and the non-indirect loads; a load raising a device event stops the
+ * pair before the second one. The second one is a branch, an ALU op or a
+ * non-indirect load or store.
+ */
+constexpr uint16_t FUSE_FIRST  = 1 << OP_ADD | 1 << OP_AND | 1 << OP_XOR | 1 << OP_SHF |
+                                 1 << OP_LEA | 1 << OP_LD  | 1 << OP_LDR;
+constexpr uint16_t FUSE_SECOND = 1 << OP_BR  | 1 << OP_ADD | 1 << OP_AND | 1 << OP_XOR | 1 << OP_SHF |
+                                 1 << OP_LD  | 1 << OP_LDR | 1 << OP_ST  | 1 << OP_STR;
+constexpr bool fusable(unsigned op1, unsigned op2) { return (FUSE_FIRST >> op1 & 1) && (FUSE_SECOND >> op2 & 1); }
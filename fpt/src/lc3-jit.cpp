@@ -0,0 +1,409 @@
+#include "lc3-jit.hpp"
+#include "lc3-hw.hpp"
+#include "LC3Machine.hpp"
+
+#if FPT_HAS_JIT
+
+#include <memory>
+#include <vector>
+#include <sys/mman.h>
+
+namespace {
+
+/* x86-64 register numbers */
+enum : uint8_t { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7 };
+/* LC-3 Rn lives in host r8+n while a block runs */
+constexpr uint8_t host(unsigned r) { return 8 + r; }
+
+/* Condition codes for Jcc */
+enum : uint8_t { CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_S = 0x8, CC_NS = 0x9, CC_LE = 0xE, CC_G = 0xF };
+
+constexpr size_t CODE_SIZE = 4 << 20;
+constexpr unsigned MAX_BLOCK_INSTR = 64;
+
+/* Called from translated code. Helpers must not touch reg[]: while a block
+ * runs the registers live in r8-r15. */
+uint32_t jit_read(LC3Machine* m, uint32_t address) { return m->mem_read(address); }
+uint32_t jit_write(LC3Machine* m, uint32_t address, uint32_t val) { m->mem_write(address, val); return m->jit->exitRequested || m->device_event(); }
+
+/* TRAP, RTI and fetches from device pages are left to the interpreter */
+bool interpreted(const uint16_t* memory, const uint8_t* pages, uint16_t pc) {
+    const unsigned op = memory[pc] >> 12;
+    return (pages[pc >> PAGE_BITS] & PAGE_DEVICE) || op == OP_TRAP || op == OP_RTI;
+}
+
+/* Minimal x86-64 encoder, only what the translator needs.
+ * All LC-3 values are kept zero-extended in 32-bit registers. */
+class X64Emitter {
+    uint8_t* mCode;
+    size_t mCap;
+    size_t mPos = 0;
+
+    void rex(uint8_t reg, uint8_t index, uint8_t base, bool w = false) {
+        uint8_t r = 0x40 | w << 3 | (reg >> 3) << 2 | (index >> 3) << 1 | (base >> 3);
+        if(r != 0x40) byte(r);
+    }
+    void modrm(uint8_t mod, uint8_t reg, uint8_t rm) { byte(mod << 6 | (reg & 7) << 3 | (rm & 7)); }
+
+public:
+    X64Emitter(uint8_t* code, size_t cap) : mCode(code), mCap(cap) {}
+
+    size_t pos() const { return mPos; }
+    bool overflow() const { return mPos > mCap; }
+
+    void byte(uint8_t b) { if(mPos < mCap) mCode[mPos] = b; mPos++; }
+    void bytes(std::initializer_list<uint8_t> bs) { for(auto b : bs) byte(b); }
+    void dword(uint32_t d) { for(int i = 0; i < 4; i++) byte(d >> (8 * i)); }
+    void qword(uint64_t q) { for(int i = 0; i < 8; i++) byte(q >> (8 * i)); }
+
+    /* op r/m32, r32 (0x89 mov, 0x01 add, 0x21 and, 0x31 xor) */
+    void alu_rr(uint8_t opcode, uint8_t dst, uint8_t src, bool w = false) { rex(src, 0, dst, w); byte(opcode); modrm(3, src, dst); }
+    /* op r/m32, imm32 (/0 add, /4 and, /6 xor, /7 cmp) */
+    void alu_ri(uint8_t ext, uint8_t dst, uint32_t imm) { rex(0, 0, dst); byte(0x81); modrm(3, ext, dst); dword(imm); }
+    /* shift r/m32, imm8 (/4 shl, /5 shr, /7 sar) */
+    void shift_ri(uint8_t ext, uint8_t dst, uint8_t n) { rex(0, 0, dst); byte(0xC1); modrm(3, ext, dst); byte(n); }
+    void mov_rr(uint8_t dst, uint8_t src) { alu_rr(0x89, dst, src); }
+    void mov_ri(uint8_t dst, uint32_t imm) { rex(0, 0, dst); byte(0xB8 + (dst & 7)); dword(imm); }
+    void mov_ri64(uint8_t dst, uint64_t imm) { rex(0, 0, dst, true); byte(0xB8 + (dst & 7)); qword(imm); }
+    void movzx16_rr(uint8_t dst, uint8_t src) { rex(dst, 0, src); bytes({0x0F, 0xB7}); modrm(3, dst, src); }
+    void movsx16_rr(uint8_t dst, uint8_t src) { rex(dst, 0, src); bytes({0x0F, 0xBF}); modrm(3, dst, src); }
+    void test16_rr(uint8_t r) { byte(0x66); rex(r, 0, r); byte(0x85); modrm(3, r, r); }
+    /* movzx dst, word [base + disp32] */
+    void load16(uint8_t dst, uint8_t base, int32_t disp) { rex(dst, 0, base); bytes({0x0F, 0xB7}); modrm(2, dst, base); dword(disp); }
+    /* mov word [base + disp32], src */
+    void store16(uint8_t base, int32_t disp, uint8_t src) { byte(0x66); rex(src, 0, base); byte(0x89); modrm(2, src, base); dword(disp); }
+    /* movzx dst, word [base + index*2] (base must not be rbp/r13) */
+    void load16_index(uint8_t dst, uint8_t base, uint8_t index) {
+        rex(dst, index, base); bytes({0x0F, 0xB7}); modrm(0, dst, 4); byte(1 << 6 | (index & 7) << 3 | (base & 7));
+    }
+    /* test byte [base + index], imm8 (base must not be rbp/r13) */
+    void test8_index(uint8_t base, uint8_t index, uint8_t imm) {
+        rex(0, index, base); byte(0xF6); modrm(0, 0, 4); byte((index & 7) << 3 | (base & 7)); byte(imm);
+    }
+    void push(uint8_t r) { rex(0, 0, r); byte(0x50 + (r & 7)); }
+    void pop(uint8_t r) { rex(0, 0, r); byte(0x58 + (r & 7)); }
+    void call(const void* fn) { bytes({0x48, 0xB8}); qword(reinterpret_cast<uint64_t>(fn)); bytes({0xFF, 0xD0}); }
+    void ret() { byte(0xC3); }
+    /* Jumps return the position of their rel32, to be patched */
+    size_t jcc(uint8_t cc) { bytes({0x0F, (uint8_t)(0x80 | cc)}); dword(0); return mPos - 4; }
+    size_t jmp() { byte(0xE9); dword(0); return mPos - 4; }
+    void patch(size_t rel_pos, size_t target) {
+        const uint32_t rel = target - (rel_pos + 4);
+        for(int i = 0; i < 4; i++) if(rel_pos + i < mCap) mCode[rel_pos + i] = rel >> (8 * i);
+    }
+};
+
+/* Translates one basic block. mFlagSrc is the LC-3 register holding the
+ * last flag-setting result: R_COND (the last result, see cond_flags) is
+ * only written back on block exit. mCount is the number of instructions
+ * executed when an exit is taken. */
+class BlockTranslator {
+    X64Emitter& e;
+    const uint16_t* mMemory;
+    const uint8_t* mPages;
+    int mFlagSrc = -1;
+    unsigned mCount = 0;
+    std::vector<size_t> mExits;
+
+    /* R0-R3 are in caller-saved host registers, the machine is at [rsp] */
+    void call_helper(const void* fn) {
+        for(unsigned r = R_R0; r <= R_R3; r++) e.store16(RBP, 2 * r, host(r));
+        e.bytes({0x48, 0x8B, 0x3C, 0x24});     // mov rdi, [rsp]
+        e.call(fn);
+        for(unsigned r = R_R0; r <= R_R3; r++) e.load16(host(r), RBP, 2 * r);
+    }
+
+    /* reg[R_COND] = last result */
+    void write_back_cond() {
+        if(mFlagSrc < 0) return;
+        e.store16(RBP, 2 * R_COND, host(mFlagSrc));
+        mFlagSrc = -1;
+    }
+    /* Leave the block, next PC and count in edx */
+    void exit_to_edx() {
+        const int flag_src = mFlagSrc;
+        write_back_cond();
+        mFlagSrc = flag_src;
+        mExits.push_back(e.jmp());
+    }
+    void exit_to(uint16_t pc) {
+        e.mov_ri(RDX, mCount << 16 | pc);
+        exit_to_edx();
+    }
+    void exit_to_eax() {
+        e.mov_rr(RDX, RAX);
+        e.alu_ri(1, RDX, mCount << 16);        // or edx, count << 16
+        exit_to_edx();
+    }
+
+    bool device_page(uint16_t address) const { return mPages[address >> PAGE_BITS] & PAGE_DEVICE; }
+    /* eax = mem_read(eax) */
+    void load_eax() {
+        e.mov_rr(RCX, RAX);
+        e.shift_ri(5, RCX, PAGE_BITS);         // shr ecx, PAGE_BITS
+        e.mov_ri64(RDX, reinterpret_cast<uint64_t>(mPages));
+        e.test8_index(RDX, RCX, PAGE_DEVICE);  // test byte [rdx + rcx], PAGE_DEVICE
+        const size_t slow = e.jcc(CC_NE);
+        e.load16_index(RAX, RBX, RAX);
+        const size_t done = e.jmp();
+        e.patch(slow, e.pos());
+        e.mov_rr(RSI, RAX);
+        call_helper((const void*)jit_read);
+        e.patch(done, e.pos());
+    }
+    /* eax = mem_read(address) */
+    void load_const(uint16_t address) {
+        if(!device_page(address)) {
+            e.load16(RAX, RBX, 2 * address);
+        } else {
+            e.mov_ri(RSI, address);
+            call_helper((const void*)jit_read);
+        }
+    }
+    /* mem_write(eax, Rsr), then leave if a translated block was hit */
+    void store_eax(unsigned sr, uint16_t next_pc) {
+        e.mov_rr(RSI, RAX);
+        e.mov_rr(RDX, host(sr));
+        call_helper((const void*)jit_write);
+        e.bytes({0x85, 0xC0});                 // test eax, eax
+        const size_t go_on = e.jcc(CC_E);
+        exit_to(next_pc);
+        e.patch(go_on, e.pos());
+    }
+    /* Rdr = eax & 0xFFFF, setting flags */
+    void set_dr(unsigned dr) {
+        e.movzx16_rr(host(dr), RAX);
+        mFlagSrc = dr;
+    }
+
+public:
+    BlockTranslator(X64Emitter& emitter, const uint16_t* memory, const uint8_t* pages) : e(emitter), mMemory(memory), mPages(pages) {}
+
+    /* Returns the number of translated instructions */
+    unsigned translate(uint16_t start) {
+        const uint8_t saved[] = {RBX, RBP, host(4), host(5), host(6), host(7)};
+        for(auto r : saved) e.push(r);
+        e.bytes({0x48, 0x83, 0xEC, 0x08});     // sub rsp, 8 (keep the stack aligned for calls)
+        e.bytes({0x48, 0x89, 0x14, 0x24});     // mov [rsp], rdx (machine)
+        e.alu_rr(0x89, RBP, RDI, true);        // mov rbp, rdi (regs)
+        e.alu_rr(0x89, RBX, RSI, true);        // mov rbx, rsi (memory)
+        for(unsigned r = R_R0; r <= R_R7; r++) e.load16(host(r), RBP, 2 * r);
+
+        uint16_t pc = start;
+        for(bool done = false; !done; ) {
+            const uint16_t instr = mMemory[pc];
+            const unsigned op = instr >> 12;
+            if(interpreted(mMemory, mPages, pc) || mCount == MAX_BLOCK_INSTR) {
+                exit_to(pc); //left to the interpreter
+                break;
+            }
+            const DecodedInstr d = decode_table[op](instr);
+            const uint16_t next = pc + 1;
+            mCount++;
+            switch(op) {
+            case OP_ADD:
+                e.mov_rr(RAX, host(d.r1));
+                if(d.flags) e.alu_ri(0, RAX, d.op2); else e.alu_rr(0x01, RAX, host(d.op2));
+                set_dr(d.r0);
+                break;
+            case OP_AND:
+            case OP_XOR: {
+                const uint8_t ext = (op == OP_AND) ? 4 : 6, opcode = (op == OP_AND) ? 0x21 : 0x31;
+                e.mov_rr(RAX, host(d.r1));
+                if(d.flags) e.alu_ri(ext, RAX, d.op2); else e.alu_rr(opcode, RAX, host(d.op2));
+                set_dr(d.r0);
+                break;
+            }
+            case OP_SHF:
+                if(d.flags & 0x1) { //RSHF
+                    if(d.flags & 0x2) { //RSHFA
+                        e.movsx16_rr(RAX, host(d.r1));
+                        e.shift_ri(7, RAX, d.op2);
+                    } else {
+                        e.mov_rr(RAX, host(d.r1));
+                        e.shift_ri(5, RAX, d.op2);
+                    }
+                } else { //LSHF
+                    e.mov_rr(RAX, host(d.r1));
+                    e.shift_ri(4, RAX, d.op2);
+                }
+                set_dr(d.r0);
+                break;
+            case OP_LEA:
+                e.mov_ri(RAX, (uint16_t)(next + d.offset));
+                set_dr(d.r0);
+                break;
+            case OP_LD:
+                load_const(next + d.offset);
+                set_dr(d.r0);
+                break;
+            case OP_LDI:
+                load_const(next + d.offset);
+                load_eax();
+                set_dr(d.r0);
+                break;
+            case OP_LDR:
+                e.mov_rr(RAX, host(d.r1));
+                e.alu_ri(0, RAX, d.offset);
+                e.movzx16_rr(RAX, RAX);
+                load_eax();
+                set_dr(d.r0);
+                break;
+            case OP_ST:
+                e.mov_ri(RAX, (uint16_t)(next + d.offset));
+                store_eax(d.r0, next);
+                break;
+            case OP_STI:
+                load_const(next + d.offset);
+                store_eax(d.r0, next);
+                break;
+            case OP_STR:
+                e.mov_rr(RAX, host(d.r1));
+                e.alu_ri(0, RAX, d.offset);
+                e.movzx16_rr(RAX, RAX);
+                store_eax(d.r0, next);
+                break;
+            case OP_BR: {
+                const uint16_t target = next + d.offset;
+                const uint8_t nzp = d.r0;
+                done = true;
+                if(nzp == 0) { exit_to(next); break; }
+                if(nzp == 0x7) { exit_to(target); break; }
+                /* The sign and zero flags of the last result are N and Z */
+                static const uint8_t cc[8] = {0, CC_G, CC_E, CC_NS, CC_S, CC_NE, CC_LE, 0};
+                if(mFlagSrc >= 0) {
+                    e.test16_rr(host(mFlagSrc));
+                } else {
+                    e.load16(RAX, RBP, 2 * R_COND);
+                    e.test16_rr(RAX);
+                }
+                const size_t taken = e.jcc(cc[nzp]);
+                exit_to(next);
+                e.patch(taken, e.pos());
+                exit_to(target);
+                break;
+            }
+            case OP_JMP:
+                e.mov_rr(RAX, host(d.r1));
+                exit_to_eax();
+                done = true;
+                break;
+            case OP_JSR:
+                /* R7 is overwritten without touching the flags */
+                write_back_cond();
+                e.mov_ri(host(R_R7), next);
+                if(d.flags) {
+                    exit_to(next + d.offset);
+                } else {
+                    e.mov_rr(RAX, host(d.r1));
+                    exit_to_eax();
+                }
+                done = true;
+                break;
+            }
+            pc = next;
+        }
+
+        for(auto exit : mExits) e.patch(exit, e.pos());
+        for(unsigned r = R_R0; r <= R_R7; r++) e.store16(RBP, 2 * r, host(r));
+        e.mov_rr(RAX, RDX);
+        e.bytes({0x48, 0x83, 0xC4, 0x08});     // add rsp, 8
+        for(int i = sizeof(saved) - 1; i >= 0; i--) e.pop(saved[i]);
+        e.ret();
+        return mCount;
+    }
+};
+
+uint8_t* map_code_buffer() {
+    void* p = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (p == MAP_FAILED) ? nullptr : static_cast<uint8_t*>(p);
+}
+
+bool jit_init(JitState& j) {
+    if(!j.code) j.code = map_code_buffer();
+    return j.code;
+}
+
+/* Translate the block at start, NULL if it must be interpreted. Nothing
+ * is emitted for a block that would not translate a single instruction. */
+const JitBlock* translate(LC3Machine& m, uint16_t start) {
+    JitState& j = *m.jit;
+    if(interpreted(m.memory, m.page_table(), start)) return nullptr;
+    for(int attempt = 0; attempt < 2; attempt++) {
+        X64Emitter e(j.code + j.codeUsed, CODE_SIZE - j.codeUsed);
+        BlockTranslator bt(e, m.memory, m.page_table());
+        const unsigned count = bt.translate(start);
+        if(e.overflow()) { jit_flush(m); continue; }
+        JitBlock& b = j.blocks[start];
+        b.code = reinterpret_cast<JitBlockCode>(j.code + j.codeUsed);
+        b.end = start + count;
+        for(uint16_t a = start; a != b.end; a++) j.codeMap[a]++;
+        j.codeUsed += e.pos();
+        return &b;
+    }
+    return nullptr;
+}
+
+} // namespace
+
+JitState::~JitState() {
+    if(code) munmap(code, CODE_SIZE);
+}
+
+bool jit_available() {
+    uint8_t* code = map_code_buffer();
+    if(code) munmap(code, CODE_SIZE);
+    return code;
+}
+
+void jit_invalidate(LC3Machine& m, uint16_t address) {
+    JitState& j = *m.jit;
+    const int first = (address >= MAX_BLOCK_INSTR) ? address - MAX_BLOCK_INSTR + 1 : 0;
+    for(int start = first; start <= address; start++) {
+        JitBlock& b = j.blocks[start];
+        if(b.code && address < b.end) {
+            for(uint16_t a = start; a != b.end; a++) j.codeMap[a]--;
+            b.code = nullptr;
+        }
+    }
+    j.exitRequested = 1;
+}
+
+void jit_flush(LC3Machine& m) {
+    JitState& j = *m.jit;
+    for(auto& b : j.blocks) b.code = nullptr;
+    for(auto& c : j.codeMap) c = 0;
+    j.codeUsed = 0;
+}
+
+uint64_t run_jit(LC3Machine& m, uint64_t budget) {
+    if(!m.jit) m.jit = std::make_unique<JitState>();
+    JitState& j = *m.jit;
+    if(!jit_init(j)) return run_threaded(m, budget);
+    uint64_t executed = 0;
+    while (m.running && executed < budget && !m.device_event()) {
+        const uint16_t pc = m.reg[R_PC];
+        const JitBlock* b = &j.blocks[pc];
+        if(!b->code) b = translate(m, pc);
+        /* Blocks run to completion, the budget tail is interpreted */
+        if(!b || (uint16_t)(b->end - pc) > budget - executed) {
+            executed += run_reference(m, 1);
+            continue;
+        }
+        j.exitRequested = 0;
+        const uint32_t next = b->code(m.reg, m.memory, &m);
+        m.reg[R_PC] = next;
+        executed += next >> 16;
+    }
+    return executed;
+}
+
+#else
+
+JitState::~JitState() {}
+bool jit_available() { return false; }
+void jit_invalidate(LC3Machine&, uint16_t) {}
+void jit_flush(LC3Machine&) {}
+uint64_t run_jit(LC3Machine& m, uint64_t budget) { return run_threaded(m, budget); }
+
+#endif
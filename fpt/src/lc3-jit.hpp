@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+class LC3Machine;
+
+/* BASIC-BLOCK JIT
+ *
+ * Straight-line LC-3 code is translated to x86-64, one basic block at a
+ * time. A block starts at any address and ends at the first BR, JMP, JSR,
+ * TRAP or RTI. BR/JMP/JSR are translated, TRAP and RTI (and every fetch
+ * from the device register area) are left to the interpreter.
+ *
+ * While a block runs, R0-R7 are pinned to the host registers r8-r15.
+ * Loads from device pages (e.g. MR_KBSR) and every store go through
+ * mem_read/mem_write, so devices keep working as in the interpreter.
+ *
+ * Translated blocks are cached by start address, per machine. codeMap
+ * counts how many blocks cover each address: a store to a covered address
+ * drops those blocks and makes the running block return to the dispatcher.
+ * So does a store raising a device event. Other device events, e.g. a key
+ * press, are noticed between blocks.
+ */
+
+#if defined(__x86_64__) && !defined(_WIN32)
+    #define FPT_HAS_JIT 1
+#else
+    #define FPT_HAS_JIT 0
+#endif
+
+/* Translated code returns the next PC in bits [15:0] and the number of
+ * instructions it executed in bits [31:16] */
+using JitBlockCode = uint32_t (*)(uint16_t* regs, uint16_t* mem, LC3Machine* m);
+struct JitBlock {
+    JitBlockCode code;
+    uint16_t end; /* one past the last translated instruction */
+};
+
+/* Translation state of one machine */
+struct JitState {
+    JitBlock blocks[UINT16_MAX + 1] = {};
+    uint8_t codeMap[UINT16_MAX + 1] = {};
+    uint8_t* code = nullptr;
+    size_t codeUsed = 0;
+    int exitRequested = 0;
+    ~JitState();
+};
+
+void jit_invalidate(LC3Machine& m, uint16_t address);
+void jit_flush(LC3Machine& m);
+
+/* Engine translating blocks on first execution (see ENGINES in
+ * lc3-hw.hpp). Falls back to run_threaded when the JIT is not available. */
+uint64_t run_jit(LC3Machine& m, uint64_t budget);
+bool jit_available();
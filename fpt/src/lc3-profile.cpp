@@ -0,0 +1,171 @@
+#include <cstdio>
+
+#include "lc3-profile.hpp"
+
+namespace {
+
+std::string address_name(uint16_t address) {
+    char name[8];
+    snprintf(name, sizeof(name), "x%04X", address);
+    return name;
+}
+
+std::vector<SourceProfile::Entry> sorted(const std::map<std::string, uint64_t>& counts) {
+    std::vector<SourceProfile::Entry> entries;
+    for (const auto& [name, count] : counts) entries.push_back({name, count});
+    std::stable_sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.count > b.count; });
+    return entries;
+}
+
+} // namespace
+
+SourceProfile::SourceProfile(const std::vector<uint64_t>& counts, const DebugSymbols* symbols) {
+    std::map<std::string, uint64_t> lines, labels;
+    for (size_t address = 0; address < counts.size(); address++) {
+        if (!counts[address]) continue;
+        const DebugSymbol* dbg_s = symbols ? symbols->find(address) : nullptr;
+        const std::string* label = symbols ? symbols->label_of(address) : nullptr;
+        const std::string line = dbg_s ? dbg_s->file.filename().string() + ":" + std::to_string(dbg_s->line)
+                                       : address_name(address);
+        const std::string routine = label ? *label : "(unknown)";
+        lines[line] += counts[address];
+        labels[routine] += counts[address];
+        mStacks[routine + ";" + line] += counts[address];
+        mTotal += counts[address];
+    }
+    mLines = sorted(lines);
+    mLabels = sorted(labels);
+}
+
+void SourceProfile::report(std::ostream& os, size_t top) const {
+    auto print_top = [&](const std::vector<Entry>& entries) {
+        for (size_t i = 0; i < entries.size() && i < top; i++) {
+            os << "  " << std::left << std::setw(24) << entries[i].name << std::right << std::setw(12) << entries[i].count
+               << std::fixed << std::setprecision(2) << std::setw(8) << 100.0 * entries[i].count / mTotal << "%\n";
+        }
+    };
+    os << "Samples: " << mTotal << "\n";
+    os << "Top labels:\n";
+    print_top(mLabels);
+    os << "Top source lines:\n";
+    print_top(mLines);
+}
+
+void SourceProfile::folded(std::ostream& os) const {
+    for (const auto& [stack, count] : mStacks) os << stack << ' ' << count << '\n';
+}
+
+CallProfile::CallProfile(uint16_t entry) {
+    mNodes.push_back({entry, 0});
+    mNodes[0].calls = 1;
+}
+
+void CallProfile::call(uint16_t routine, uint16_t return_to, uint64_t now) {
+    if (mFrames.size() >= MAX_DEPTH) {
+        mTooDeep++;
+        return;
+    }
+    auto [it, added] = mChildren.try_emplace({mCurrent, routine}, (uint32_t)mNodes.size());
+    if (added) mNodes.push_back({routine, mCurrent});
+    mFrames.push_back({mCurrent, return_to, now});
+    mCurrent = it->second;
+    mNodes[mCurrent].calls++;
+}
+
+void CallProfile::ret(uint16_t next, uint64_t now) {
+    size_t depth = mFrames.size();
+    while (depth && mFrames[depth - 1].ret != next) depth--;
+    if (!depth) return;
+    /* Frames above the one returned to never returned themselves */
+    while (mFrames.size() >= depth) {
+        const Frame& frame = mFrames.back();
+        if (mEvents.size() < MAX_EVENTS) mEvents.push_back({mNodes[mCurrent].routine, frame.start, now});
+        else mDropped++;
+        mCurrent = frame.node;
+        mFrames.pop_back();
+    }
+}
+
+std::string CallProfile::name(uint16_t routine, const DebugSymbols* symbols) const {
+    const std::string* label = symbols ? symbols->label_at(routine) : nullptr;
+    return label ? *label : address_name(routine);
+}
+
+std::string CallProfile::path(uint32_t node, const DebugSymbols* symbols) const {
+    std::string names = name(mNodes[node].routine, symbols);
+    while (node) {
+        node = mNodes[node].parent;
+        names = name(mNodes[node].routine, symbols) + ";" + names;
+    }
+    return names;
+}
+
+std::vector<CallProfile::Routine> CallProfile::routines(const DebugSymbols* symbols) const {
+    std::map<uint16_t, Routine> routines;
+    for (uint32_t n = 0; n < mNodes.size(); n++) {
+        const Node& node = mNodes[n];
+        Routine& routine = routines[node.routine];
+        routine.exclusive += node.self;
+        routine.calls += node.calls;
+        /* Once per routine on the stack, recursive or not */
+        std::vector<uint16_t> seen;
+        for (uint32_t up = n; ; up = mNodes[up].parent) {
+            const uint16_t r = mNodes[up].routine;
+            if (std::find(seen.begin(), seen.end(), r) == seen.end()) {
+                seen.push_back(r);
+                routines[r].inclusive += node.self;
+            }
+            if (!up) break;
+        }
+    }
+    std::vector<Routine> sorted;
+    for (auto& [address, routine] : routines) {
+        routine.name = name(address, symbols);
+        sorted.push_back(routine);
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.inclusive > b.inclusive; });
+    return sorted;
+}
+
+void CallProfile::report(std::ostream& os, const DebugSymbols* symbols, size_t top) const {
+    const auto all = routines(symbols);
+    const uint64_t total = std::max<uint64_t>(all[0].inclusive, 1);
+    os << "Instructions: " << total << "\n";
+    os << "Routines by inclusive count:\n";
+    os << "  " << std::left << std::setw(24) << "routine" << std::right << std::setw(12) << "inclusive" << std::setw(9) << ""
+       << std::setw(12) << "exclusive" << std::setw(9) << "" << std::setw(10) << "calls" << "\n";
+    for (size_t i = 0; i < all.size() && i < top; i++) {
+        const Routine& r = all[i];
+        os << "  " << std::left << std::setw(24) << r.name << std::right << std::fixed << std::setprecision(2)
+           << std::setw(12) << r.inclusive << std::setw(8) << 100.0 * r.inclusive / total << "%"
+           << std::setw(12) << r.exclusive << std::setw(8) << 100.0 * r.exclusive / total << "%"
+           << std::setw(10) << r.calls << "\n";
+    }
+    if (mDropped) os << "Calls left out of the Chrome trace: " << mDropped << "\n";
+    if (mTooDeep) os << "Calls deeper than " << MAX_DEPTH << " frames, counted in their caller: " << mTooDeep << "\n";
+}
+
+void CallProfile::folded(std::ostream& os, const DebugSymbols* symbols) const {
+    for (uint32_t n = 0; n < mNodes.size(); n++) {
+        if (mNodes[n].self) os << path(n, symbols) << ' ' << mNodes[n].self << '\n';
+    }
+}
+
+void CallProfile::chrome_trace(std::ostream& os, const DebugSymbols* symbols, uint64_t now) const {
+    auto event = [&](uint16_t routine, uint64_t start, uint64_t end) {
+        os << "{\"name\":\"" << name(routine, symbols) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << start
+           << ",\"dur\":" << end - start << "}";
+    };
+    os << "{\"traceEvents\":[\n";
+    event(mNodes[0].routine, 0, now);
+    for (const Event& e : mEvents) {
+        os << ",\n";
+        event(e.routine, e.start, e.end);
+    }
+    for (size_t i = 0; i < mFrames.size(); i++) {
+        const uint32_t callee = i + 1 < mFrames.size() ? mFrames[i + 1].node : mCurrent;
+        os << ",\n";
+        event(mNodes[callee].routine, mFrames[i].start, now);
+    }
+    os << "\n],\"otherData\":{\"droppedCalls\":" << mDropped << ",\"deepCalls\":" << mTooDeep << "}}\n";
+}
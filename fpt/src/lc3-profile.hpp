@@ -0,0 +1,210 @@
+#pragma once
+
+#include <array>
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "DebugSymbols.hpp"
+#include "LC3Machine.hpp"
+#include "lc3-hw.hpp"
+
+constexpr const char* OpNameMap[16] = {
+    "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+    "RTI", "XOR", "LDI", "STI", "JMP", "SHF", "LEA", "TRAP",
+};
+
+/* Counts which opcodes run back to back at consecutive addresses, i.e.
+ * which pairs and triples could be fused by the decoder. An instruction
+ * reached through a taken branch starts a new sequence. */
+struct PairProfile {
+    std::array<uint64_t, 16 * 16> pairs{};
+    std::array<uint64_t, 16 * 16 * 16> triples{};
+    uint64_t total = 0;
+    uint16_t last_pc = 0;
+    int prev1 = -1, prev2 = -1;
+
+    void record(uint16_t pc, uint16_t instr) {
+        const int op = instr >> 12;
+        if(pc != (uint16_t)(last_pc + 1)) prev1 = prev2 = -1;
+        if(prev1 >= 0) pairs[prev1 * 16 + op]++;
+        if(prev2 >= 0) triples[(prev2 * 16 + prev1) * 16 + op]++;
+        prev2 = prev1;
+        prev1 = op;
+        last_pc = pc;
+        total++;
+    }
+
+    void report(std::ostream& os, size_t top = 10) const {
+        auto print_top = [&](const auto& counts, int length) {
+            std::vector<unsigned> idx;
+            for(unsigned i = 0; i < counts.size(); i++) if(counts[i]) idx.push_back(i);
+            std::sort(idx.begin(), idx.end(), [&](unsigned a, unsigned b) { return counts[a] > counts[b]; });
+            if(idx.size() > top) idx.resize(top);
+            for(auto i : idx) {
+                std::string name;
+                for(int k = length - 1; k >= 0; k--) {
+                    name += OpNameMap[(i >> (4 * k)) & 0xF];
+                    if(k) name += " ";
+                }
+                os << "  " << std::left << std::setw(16) << name << std::right << std::setw(12) << counts[i]
+                   << std::fixed << std::setprecision(2) << std::setw(8) << 100.0 * counts[i] / total << "%";
+                if(length == 2 && fusable(i >> 4, i & 0xF)) os << "  (fused)";
+                os << "\n";
+            }
+        };
+        os << "Instructions: " << total << "\n";
+        os << "Top adjacent pairs:\n";
+        print_top(pairs, 2);
+        os << "Top adjacent triples:\n";
+        print_top(triples, 3);
+    }
+};
+
+/* Samples the PC, i.e. the instruction about to run, at reset and every
+ * period instructions after, whatever the engine: a timed device, so the
+ * program runs at full speed in between. Period 1 counts every
+ * instruction. */
+class PcSampler : public Device {
+    uint64_t mPeriod;
+    uint64_t mDeadline = UINT64_MAX;
+public:
+    /* Samples per address */
+    std::vector<uint64_t> counts = std::vector<uint64_t>(UINT16_MAX + 1);
+    uint64_t samples = 0;
+
+    explicit PcSampler(uint64_t period) : mPeriod(std::max<uint64_t>(period, 1)) {}
+    uint64_t period() const { return mPeriod; }
+    uint64_t deadline() const override { return mDeadline; }
+    void tick(LC3Machine& m) override {
+        /* Nothing runs after HALT */
+        if (m.running) sample(m);
+        mDeadline = std::max(mDeadline + mPeriod, m.instructions + 1);
+    }
+    void reset(LC3Machine& m) override {
+        sample(m);
+        mDeadline = m.instructions + mPeriod;
+    }
+
+private:
+    void sample(LC3Machine& m) {
+        counts[m.reg[R_PC]]++;
+        samples++;
+    }
+};
+
+/* Samples per address grouped by source line and by label, the closest
+ * one before the address, through the debug symbols of the assembler.
+ * Addresses without symbols, e.g. an OS image, are named xADDR. */
+class SourceProfile {
+public:
+    struct Entry {
+        std::string name;
+        uint64_t count = 0;
+    };
+
+    /* symbols may be nullptr */
+    SourceProfile(const std::vector<uint64_t>& counts, const DebugSymbols* symbols);
+    uint64_t total() const { return mTotal; }
+    /* Most sampled first */
+    const std::vector<Entry>& lines() const { return mLines; }
+    const std::vector<Entry>& labels() const { return mLabels; }
+
+    void report(std::ostream& os, size_t top = 20) const;
+    /* "label;file:line count" lines, for flamegraph.pl, inferno or speedscope */
+    void folded(std::ostream& os) const;
+
+private:
+    uint64_t mTotal = 0;
+    std::vector<Entry> mLines;
+    std::vector<Entry> mLabels;
+    std::map<std::string, uint64_t> mStacks;
+};
+
+/* Shadow call stack, fed with each instruction as it runs: JSR/JSRR, a
+ * TRAP through the vector table and an interrupt push a frame, JMP R7
+ * (RET) and RTI pop back to the frame whose return address they jump to.
+ * A JMP R7 that is not a return leaves the stack alone.
+ *
+ * Every instruction is counted in the node of the call tree it ran in,
+ * which gives per-routine exclusive counts (the routine itself) and
+ * inclusive ones (with its callees, once per routine for recursion).
+ * Routines are named by the label at their entry, or xADDR. The Chrome
+ * trace has a complete event per call, one instruction per microsecond
+ * like the 1 MHz VM clock.
+ *
+ * A routine entered with JSR and left with a branch never pops its frame,
+ * so the stack is capped at MAX_DEPTH: deeper calls are only counted, and
+ * their instructions go to the deepest routine.
+ */
+class CallProfile {
+public:
+    /* Calls kept for the Chrome trace, later ones are only counted */
+    static constexpr size_t MAX_EVENTS = 1 << 20;
+    /* Frames on the shadow stack, deeper calls are only counted */
+    static constexpr size_t MAX_DEPTH = 1024;
+
+    struct Routine {
+        std::string name;
+        uint64_t inclusive = 0;
+        uint64_t exclusive = 0;
+        uint64_t calls = 0;
+    };
+
+    /* entry is the first routine, usually LC3Machine::pcStart */
+    explicit CallProfile(uint16_t entry);
+    /* instr at pc ran, next is the PC after it and now the instruction count */
+    void record(uint16_t pc, uint16_t instr, uint16_t next, uint64_t now) {
+        mNodes[mCurrent].self++;
+        const unsigned op = instr >> 12;
+        if (op == OP_JSR || (op == OP_TRAP && next != (uint16_t)(pc + 1))) call(next, pc + 1, now);
+        else if ((op == OP_JMP && ((instr >> 6) & 0x7) == R_R7) || op == OP_RTI) ret(next, now);
+    }
+    /* An interrupt moved the PC from pc to the service routine isr */
+    void interrupt(uint16_t pc, uint16_t isr, uint64_t now) { call(isr, pc, now); }
+
+    /* Most inclusive first */
+    std::vector<Routine> routines(const DebugSymbols* symbols) const;
+    void report(std::ostream& os, const DebugSymbols* symbols, size_t top = 20) const;
+    /* "main;PRINT_DECIMAL;DIV count" lines of exclusive counts */
+    void folded(std::ostream& os, const DebugSymbols* symbols) const;
+    /* Chrome trace-event JSON, for chrome://tracing or Perfetto. Calls
+     * still open are closed at now. */
+    void chrome_trace(std::ostream& os, const DebugSymbols* symbols, uint64_t now) const;
+
+private:
+    struct Node {
+        uint16_t routine;
+        uint32_t parent;
+        uint64_t self = 0;
+        uint64_t calls = 0;
+    };
+    struct Frame {
+        uint32_t node;
+        uint16_t ret;
+        uint64_t start;
+    };
+    struct Event {
+        uint16_t routine;
+        uint64_t start;
+        uint64_t end;
+    };
+    std::vector<Node> mNodes;
+    /* Child of a node per routine */
+    std::map<std::pair<uint32_t, uint16_t>, uint32_t> mChildren;
+    std::vector<Frame> mFrames;
+    std::vector<Event> mEvents;
+    uint32_t mCurrent = 0;
+    uint64_t mDropped = 0;
+    uint64_t mTooDeep = 0;
+
+    void call(uint16_t routine, uint16_t return_to, uint64_t now);
+    void ret(uint16_t next, uint64_t now);
+    std::string name(uint16_t routine, const DebugSymbols* symbols) const;
+    /* Routine names from the root to node, ';' separated */
+    std::string path(uint32_t node, const DebugSymbols* symbols) const;
+};
@@ -0,0 +1,73 @@
+#include <algorithm>
+#include <iomanip>
+
+#include "LC3Machine.hpp"
+#include "lc3-debug.hpp"
+#include "lc3-profile.hpp"
+#include "lc3-stats.hpp"
+
+void MachineStats::clear() {
+    const bool count_ops = countOps;
+    *this = MachineStats{};
+    countOps = count_ops;
+}
+
+void dump_stats(std::ostream& os, const LC3Machine& m) {
+    using Seconds = std::chrono::duration<double>;
+    const MachineStats& s = m.stats;
+    const double elapsed = Seconds(MachineStats::Clock::now() - s.start).count();
+    const double blocked = Seconds(s.keyboardBlocked).count(), slept = Seconds(s.idleSlept).count();
+    const double busy = std::max(elapsed - blocked - slept, 1e-9);
+    const uint64_t ran = m.instructions - std::min(m.instructions, s.idleSkipped);
+    const auto flags = os.flags();
+    os << std::fixed << std::setprecision(3);
+    os << "Instructions: " << m.instructions << " (" << s.idleSkipped << " idle, skipped)\n";
+    os << "Host time: " << elapsed << " s, " << blocked << " s blocked on the keyboard, " << slept << " s idle\n";
+    os << "Emulated MIPS: " << std::setprecision(2) << ran / busy / 1e6 << "\n";
+    os << "Keyboard waits: " << s.keyboardWaits << "\n";
+    os << "MMIO: " << s.mmioReads << " reads, " << s.mmioWrites << " writes\n";
+    if (s.countOps) {
+        uint64_t total = 0;
+        for (auto n : s.ops) total += n;
+        os << "Opcodes:\n";
+        for (int op = 0; op < 16; op++) {
+            if (!s.ops[op]) continue;
+            os << "  " << std::left << std::setw(6) << OpNameMap[op] << std::right << std::setw(14) << s.ops[op]
+               << std::setw(8) << 100.0 * s.ops[op] / total << "%\n";
+        }
+    }
+    os << "Traps:\n";
+    for (int vector = 0; vector < 256; vector++) {
+        if (!s.traps[vector]) continue;
+        char name[DISASM_MAX];
+        disassemble(0xF000 | vector, name);
+        os << "  " << std::left << std::setw(10) << name << std::right << std::setw(14) << s.traps[vector] << "\n";
+    }
+    os.flags(flags);
+}
+
+void StatsDump::request(LC3Machine& m) {
+    mRequested.store(true, std::memory_order_relaxed);
+    m.raise_device_event();
+    /* A machine blocked on the keyboard services devices and waits again */
+    m.input.wake();
+}
+
+void StatsDump::dump(LC3Machine& m) {
+    dump_stats(mOut, m);
+    mOut << std::endl;
+}
+
+Device::Interrupt StatsDump::service(LC3Machine& m) {
+    if (mRequested.exchange(false, std::memory_order_relaxed)) dump(m);
+    return {};
+}
+
+void StatsDump::tick(LC3Machine& m) {
+    dump(m);
+    mDeadline = std::max(mDeadline + mPeriod, m.instructions + 1);
+}
+
+void StatsDump::reset(LC3Machine& m) {
+    mDeadline = mPeriod ? m.instructions + mPeriod : UINT64_MAX;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+#include "lc3-devices.hpp"
+
+class LC3Machine;
+
+/* STATS
+ *
+ * Counters of one machine, plain integers: a machine runs on one thread,
+ * so nothing on the hot path is atomic. Traps, MMIO accesses and keyboard
+ * waits are always counted, they are off the hot path. The opcode mix
+ * needs countOps, which runs the machine with a counting op_table loop
+ * instead of its engine, at about reference engine speed.
+ * LC3Machine::reset clears them.
+ */
+struct MachineStats {
+    using Clock = std::chrono::steady_clock;
+
+    bool countOps = false;
+    /* Executed instructions per opcode, with countOps */
+    std::array<uint64_t, 16> ops{};
+    /* TRAPs per vector */
+    std::array<uint64_t, 256> traps{};
+    /* Loads and stores to device registers */
+    uint64_t mmioReads = 0;
+    uint64_t mmioWrites = 0;
+    /* GETC/IN stopping on an empty keyboard, and the host time spent
+     * blocked until a key came */
+    uint64_t keyboardWaits = 0;
+    Clock::duration keyboardBlocked{};
+    /* Idle loops skipped and the host time slept for them, see IDLE LOOPS */
+    uint64_t idleSkipped = 0;
+    Clock::duration idleSlept{};
+    Clock::time_point start = Clock::now();
+
+    void clear();
+};
+
+/* Counters, host time and emulated MIPS: the instructions that really
+ * ran over the host time not spent blocked or asleep */
+void dump_stats(std::ostream& os, const LC3Machine& m);
+
+/* Dumps the stats every period instructions (0: never) and on request,
+ * on the machine thread. */
+class StatsDump : public Device {
+    std::ostream& mOut;
+    uint64_t mPeriod;
+    uint64_t mDeadline = UINT64_MAX;
+    std::atomic<bool> mRequested{false};
+public:
+    StatsDump(std::ostream& out, uint64_t period) : mOut(out), mPeriod(period) {}
+    /* Async-signal-safe, e.g. from a SIGUSR1 handler. The dump is written
+     * when the machine runs next, one blocked on the keyboard is woken up
+     * for it. */
+    void request(LC3Machine& m);
+    void dump(LC3Machine& m);
+    Interrupt service(LC3Machine& m) override;
+    uint64_t deadline() const override { return mDeadline; }
+    void tick(LC3Machine& m) override;
+    void reset(LC3Machine& m) override;
+};
@@ -0,0 +1,93 @@
+#include "lc3-traps.hpp"
+#include "LC3Machine.hpp"
+
+namespace {
+
+void trap_getc(LC3Machine& m) {
+    char c = m.input.pop();
+    if(!c) { m.stop_for_input(); return; }
+    m.waitingInput = false;
+    m.reg[R_R0] = (uint16_t) c;
+}
+
+void trap_out(LC3Machine& m) {
+    m.console.put(m, (char)m.reg[R_R0]);
+}
+
+void trap_puts(LC3Machine& m) {
+    for(uint16_t a = m.reg[R_R0]; m.memory[a]; a++) m.console.put(m, (char)m.memory[a]);
+}
+
+void trap_in(LC3Machine& m) {
+    /* Prompt once, not again when resuming */
+    if(!m.waitingInput) m.console.put(m, "Enter a character: ");
+    char c = m.input.pop();
+    if(!c) { m.stop_for_input(); return; }
+    m.waitingInput = false;
+    m.console.put(m, c);
+    m.reg[R_R0] = (uint16_t) c;
+}
+
+void trap_putsp(LC3Machine& m) {
+    for(uint16_t a = m.reg[R_R0]; m.memory[a]; a++) {
+        const char c1 = m.memory[a] & 0xFF, c2 = m.memory[a] >> 8;
+        m.console.put(m, c1);
+        if(c2) m.console.put(m, c2);
+    }
+}
+
+void trap_halt(LC3Machine& m) {
+    m.console.put(m, "HALT");
+    m.console.flush();
+    m.running = false;
+}
+
+void trap_mul(LC3Machine& m) {
+    const int32_t p = (int16_t)m.reg[R_R0] * (int16_t)m.reg[R_R1];
+    m.reg[R_R0] = (uint16_t)p;
+    m.reg[R_R1] = (uint16_t)(p >> 16);
+}
+
+void trap_divmod(LC3Machine& m) {
+    const int32_t a = (int16_t)m.reg[R_R0], b = (int16_t)m.reg[R_R1];
+    if(!b) return;
+    m.reg[R_R0] = (uint16_t)(a / b);
+    m.reg[R_R1] = (uint16_t)(a % b);
+}
+
+void trap_memcpy(LC3Machine& m) {
+    block_transfer(m, m.reg[R_R0], m.reg[R_R1], m.reg[R_R2], false);
+}
+
+void trap_memset(LC3Machine& m) {
+    block_transfer(m, m.reg[R_R0], m.reg[R_R1], m.reg[R_R2], true);
+}
+
+/* xorshift32, reseeded by LC3Machine::reset for reproducible runs */
+void trap_random(LC3Machine& m) {
+    uint32_t x = m.randomState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    m.randomState = x;
+    m.reg[R_R0] = (uint16_t)(x >> 16);
+}
+
+} // namespace
+
+void install_standard_traps(LC3Machine& m) {
+    m.set_trap(TRAP_GETC, trap_getc);
+    m.set_trap(TRAP_OUT, trap_out);
+    m.set_trap(TRAP_PUTS, trap_puts);
+    m.set_trap(TRAP_IN, trap_in);
+    m.set_trap(TRAP_PUTSP, trap_putsp);
+    m.set_trap(TRAP_HALT, trap_halt);
+}
+
+void install_host_traps(LC3Machine& m) {
+    m.set_trap(TRAP_MUL, trap_mul);
+    m.set_trap(TRAP_DIVMOD, trap_divmod);
+    m.set_trap(TRAP_MEMCPY, trap_memcpy);
+    m.set_trap(TRAP_MEMSET, trap_memset);
+    m.set_trap(TRAP_RANDOM, trap_random);
+}
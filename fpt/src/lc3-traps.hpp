@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+
+class LC3Machine;
+
+/* TRAPS
+ *
+ * TRAP x goes through the trap vector table: R7 gets the return address
+ * and PC memory[x], so that an OS image provides the service routines.
+ * A native handler set with LC3Machine::set_trap runs instead of the
+ * routine, with PC already past the TRAP.
+ *
+ * A machine starts with native GETC/OUT/PUTS/IN/PUTSP/HALT, so programs
+ * run without an OS; set_trap(x, nullptr) gives x back to the table.
+ */
+using TrapHandler = void (*)(LC3Machine& m);
+
+void install_standard_traps(LC3Machine& m);
+/* TRAP_MUL, TRAP_DIVMOD, TRAP_MEMCPY, TRAP_MEMSET and TRAP_RANDOM */
+void install_host_traps(LC3Machine& m);
@@ -1,7 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <bitset>
 #include <cstdint>
-#include "memory.hpp"
+#include <vector>
+#include "LC3Machine.hpp"
+#include "lc3-expand.hpp"
 
 /*
  * Each frame is made by 8x8 tiles, for a total of WxH tiles, where
@@ -132,8 +137,19 @@
  *          |      addresses       |
  *   0xFFFF +----------------------+
  * 
- * With a 320x200 screen, we are left with 120 extra words (240 extra bytes).
- * TODO: include extra info for sprites, palettes etc.
+ * With a 320x200 screen, we are left with 120 extra words (240 extra bytes),
+ * used by the sprites and the palette:
+ *
+ *   0xFD88 +----------------------+
+ *          |  16 sprites, 4 words |
+ *          |  each: X, Y, PATTERN |
+ *          |  and ATTR            |
+ *   0xFDC7 +----------------------+
+ *   0xFDC8 |  PALETTE_INDEX       |
+ *   0xFDC9 |  PALETTE_DATA        |
+ *   0xFDCA +----------------------+
+ *          |       (unused)       |
+ *   0xFDFF +----------------------+
  */
 
 #define BG(x) ((uint8_t)(x >> 8))
@@ -151,44 +167,210 @@
 #define TILE_SIDE 8
 #define TWIDTH WIDTH/TILE_SIDE
 #define THEIGTH HEIGTH/TILE_SIDE
+#define SPRITE_SIDE 16
+
+/* A changed area of the screen, in pixels */
+struct ScreenRect {
+    int x, y, w, h;
+    bool operator==(const ScreenRect&) const = default;
+};
+
+/* DIRTY TILES
+ *
+ * Once attached, the screen observes the video memory: a store marks the
+ * tile of a colour word, or the two tiles of a pixel word, as dirty.
+ * mem_to_screen only redraws those and returns the changed rectangles, so
+ * that a frontend or a recorder can push just them.
+ *
+ * Tiles are drawn by pairs, the 16 pixels of a word at once (see
+ * lc3-expand.hpp): a dirty tile also redraws its unchanged neighbour, and
+ * the sprites over it, which leaves its pixels as they were.
+ */
 
-struct LC3Screen {
+/* SPRITES AND PALETTE
+ *
+ * A sprite is 16x16 pixels drawn over the tiles, moved by rewriting its
+ * X and Y (signed, the top left pixel, it may be partly off screen).
+ * PATTERN points to 16 words in memory, one per line with bit 15 leftmost:
+ * set bits take the colour in ATTR[7:0], clear ones are transparent.
+ * ATTR[15] enables the sprite. Sprite 0 is drawn on top.
+ * The pattern itself is not observed: write ATTR again after changing it.
+ *
+ * The screen holds colour bytes, the palette turns them into RGB. It has
+ * 256 entries, RRRGGGBB at reset. Writing an RGB565 colour to PALETTE_DATA
+ * sets the entry at PALETTE_INDEX, which moves to the next one.
+ */
+struct LC3Screen : public Device {
     /* The next array represents the monitor screen */
     std::array<uint8_t, WIDTH*HEIGTH> screen;
+    /* Pixel to colour conversion, the fastest one by default */
+    ExpandPair expander = best_expander();
+    /* 0xRRGGBB per colour byte */
+    using Palette = std::array<uint32_t, 256>;
+    Palette palette = rgb332();
 
     enum {
-        BASE_VIDEO_MEMORY = 0xEA00
+        BASE_VIDEO_MEMORY = 0xEA00,
+        /* Colour words, then TILE_SIDE lines of pixel words */
+        ROW_WORDS = (TWIDTH) + TILE_SIDE * WIDTH / 16,
+        END_VIDEO_MEMORY = BASE_VIDEO_MEMORY + (THEIGTH) * ROW_WORDS,
+        SPRITE_TABLE = END_VIDEO_MEMORY,
+        SPRITE_COUNT = 16,
+        SPRITE_WORDS = 4,
+        SPRITE_X = 0, SPRITE_Y = 1, SPRITE_PATTERN = 2, SPRITE_ATTR = 3,
+        SPRITE_ENABLE = 1 << 15,
+        PALETTE_INDEX = SPRITE_TABLE + SPRITE_COUNT * SPRITE_WORDS,
+        PALETTE_DATA = PALETTE_INDEX + 1,
     };
 
-    void mem_to_screen() {
-        uint16_t address = BASE_VIDEO_MEMORY;
-        uint16_t color_buffer[TWIDTH];
-        for (int y = 0; y < HEIGTH; y++) {
-            if((y % 8) == 0) {
-                for(int x = 0; x < TWIDTH; x++) { //tile coordinates
-                    color_buffer[x] = mem_read(address++);
-                }
+    /* The colour bytes as RRRGGGBB */
+    static Palette rgb332() {
+        Palette p;
+        for (uint32_t c = 0; c < 256; c++) p[c] = ((c >> 5) * 255 / 7) << 16 | (((c >> 2) & 0x7) * 255 / 7) << 8 | (c & 0x3) * 255 / 3;
+        return p;
+    }
+
+    /* Track stores to the video memory of m, which must outlive the screen's use */
+    void attach(LC3Machine& m) {
+        m.observe(*this, BASE_VIDEO_MEMORY, PALETTE_DATA);
+        for (int i = 0; i < SPRITE_COUNT; i++) mSpriteTiles[i] = sprite_tiles(m, i);
+        mAttached = true;
+        invalidate();
+    }
+    /* Redraw everything on the next mem_to_screen */
+    void invalidate() { mDirty.set(); }
+
+    void written(LC3Machine& m, uint16_t address) override {
+        if (address >= SPRITE_TABLE) return written_hw(m, address);
+        const int offset = address - BASE_VIDEO_MEMORY;
+        const int ty = offset / ROW_WORDS, word = offset % ROW_WORDS;
+        if (word < (TWIDTH)) {
+            mDirty.set(ty * (TWIDTH) + word);
+        } else {
+            const int tx = (word - (TWIDTH)) % (WIDTH / 16) * 2;
+            mDirty.set(ty * (TWIDTH) + tx);
+            mDirty.set(ty * (TWIDTH) + tx + 1);
+        }
+    }
+
+    /* The palette goes back to RRRGGGBB */
+    void reset(LC3Machine&) override {
+        if (palette == rgb332()) return;
+        palette = rgb332();
+        invalidate();
+    }
+
+    /* Redraw the dirty tiles and the sprites over them, all of them if the
+     * screen is not attached. Returns the redrawn area: runs of tiles on a tile row, merged with the
+     * rows below when they cover the same columns. */
+    const std::vector<ScreenRect>& mem_to_screen(LC3Machine& m) {
+        if (!mAttached) invalidate();
+        mChanged.clear();
+        size_t open = 0; //rectangles that may still grow downwards
+        mRedrawn.reset();
+        for (int ty = 0; ty < (THEIGTH); ty++) {
+            for (int tx = 0; tx < (TWIDTH); tx += 2) {
+                const int tile = ty * (TWIDTH) + tx;
+                if (!mDirty[tile] && !mDirty[tile + 1]) continue;
+                draw_pair(m, tx, ty);
+                mRedrawn.set(tile);
+                mRedrawn.set(tile + 1);
             }
-            for(int x = 0; x < WIDTH; x+=16) {
-                uint16_t pixel16 = mem_read(address++);
-                int p = 15;
-                for(; p >= 8; p--) {
-                    const uint16_t color = color_buffer[x/8];
-                    if((pixel16 >> p) & 0x1) {
-                        screen[y*WIDTH + x + (15-p)] = FG(color);
-                    } else {
-                        screen[y*WIDTH + x + (15-p)] = BG(color);
-                    }
-                }
-                for(; p >=0; p--) {
-                    const uint16_t color = color_buffer[x/8+1];
-                    if((pixel16 >> p) & 0x1) {
-                        screen[y*WIDTH + x + (15-p)] = FG(color);
-                    } else {
-                        screen[y*WIDTH + x + (15-p)] = BG(color);
+        }
+        for (int i = SPRITE_COUNT - 1; i >= 0; i--) draw_sprite(m, i);
+        for (int ty = 0; ty < (THEIGTH); ty++) {
+            const size_t row_start = mChanged.size();
+            for (int tx = 0; tx < (TWIDTH); ) {
+                if (!mDirty[ty * (TWIDTH) + tx]) { tx++; continue; }
+                const int first = tx;
+                while (tx < (TWIDTH) && mDirty[ty * (TWIDTH) + tx]) tx++;
+                ScreenRect r{first * TILE_SIDE, ty * TILE_SIDE, (tx - first) * TILE_SIDE, TILE_SIDE};
+                bool merged = false;
+                for (size_t i = open; i < row_start && !merged; i++) {
+                    ScreenRect& above = mChanged[i];
+                    if (above.x == r.x && above.w == r.w && above.y + above.h == r.y) {
+                        above.h += TILE_SIDE;
+                        merged = true;
                     }
                 }
+                if (!merged) mChanged.push_back(r);
+            }
+            /* Rectangles that did not reach this row are closed */
+            while (open < row_start && mChanged[open].y + mChanged[open].h < (ty + 1) * TILE_SIDE) open++;
+        }
+        mDirty.reset();
+        return mChanged;
+    }
+    /* What the last mem_to_screen redrew */
+    const std::vector<ScreenRect>& changed() const { return mChanged; }
+
+private:
+    std::bitset<(TWIDTH) * (THEIGTH)> mDirty = std::bitset<(TWIDTH) * (THEIGTH)>().set();
+    std::vector<ScreenRect> mChanged;
+    /* Tiles drawn by the current mem_to_screen: the dirty ones and their
+     * neighbours, which the sprites must be drawn over again */
+    std::bitset<(TWIDTH) * (THEIGTH)> mRedrawn;
+    bool mAttached = false;
+    /* Where each sprite was last drawn, in tiles: x0, y0, x1, y1 (excluded) */
+    std::array<std::array<int, 4>, SPRITE_COUNT> mSpriteTiles{};
+
+    /* Tiles covered by sprite i as it is in memory, empty if disabled */
+    std::array<int, 4> sprite_tiles(const LC3Machine& m, int i) const {
+        const uint16_t* sprite = &m.memory[SPRITE_TABLE + i * SPRITE_WORDS];
+        if (!(sprite[SPRITE_ATTR] & SPRITE_ENABLE)) return {};
+        const int x = (int16_t)sprite[SPRITE_X], y = (int16_t)sprite[SPRITE_Y];
+        const int x0 = std::max(x, 0), y0 = std::max(y, 0);
+        const int x1 = std::min(x + SPRITE_SIDE, WIDTH), y1 = std::min(y + SPRITE_SIDE, HEIGTH);
+        if (x0 >= x1 || y0 >= y1) return {};
+        return { x0 / TILE_SIDE, y0 / TILE_SIDE, (x1 - 1) / TILE_SIDE + 1, (y1 - 1) / TILE_SIDE + 1 };
+    }
+    void mark_dirty(const std::array<int, 4>& tiles) {
+        for (int ty = tiles[1]; ty < tiles[3]; ty++) {
+            for (int tx = tiles[0]; tx < tiles[2]; tx++) mDirty.set(ty * (TWIDTH) + tx);
+        }
+    }
+
+    /* Stores to the sprite table and the palette registers */
+    void written_hw(LC3Machine& m, uint16_t address) {
+        if (address < PALETTE_INDEX) {
+            /* Where the sprite was and where it is now */
+            const int i = (address - SPRITE_TABLE) / SPRITE_WORDS;
+            mark_dirty(mSpriteTiles[i]);
+            mSpriteTiles[i] = sprite_tiles(m, i);
+            mark_dirty(mSpriteTiles[i]);
+        } else if (address == PALETTE_DATA) {
+            const uint16_t rgb = m.memory[PALETTE_DATA];
+            const uint32_t r = (rgb >> 11) * 255 / 31, g = ((rgb >> 5) & 0x3F) * 255 / 63, b = (rgb & 0x1F) * 255 / 31;
+            palette[m.memory[PALETTE_INDEX] & 0xFF] = r << 16 | g << 8 | b;
+            m.memory[PALETTE_INDEX] = (m.memory[PALETTE_INDEX] + 1) & 0xFF;
+            /* Any pixel may have that colour */
+            invalidate();
+        }
+    }
+
+    /* Sprite i over the tiles that have just been redrawn */
+    void draw_sprite(const LC3Machine& m, int i) {
+        if (sprite_tiles(m, i)[2] == 0) return;
+        const uint16_t* sprite = &m.memory[SPRITE_TABLE + i * SPRITE_WORDS];
+        const int x = (int16_t)sprite[SPRITE_X], y = (int16_t)sprite[SPRITE_Y];
+        const uint8_t color = sprite[SPRITE_ATTR] & 0xFF;
+        for (int ln = 0; ln < SPRITE_SIDE; ln++) {
+            const int py = y + ln;
+            if (py < 0 || py >= HEIGTH) continue;
+            const uint16_t bits = m.memory[(uint16_t)(sprite[SPRITE_PATTERN] + ln)];
+            for (int p = 0; p < SPRITE_SIDE; p++) {
+                const int px = x + p;
+                if (px < 0 || px >= WIDTH || !((bits >> (15 - p)) & 0x1)) continue;
+                if (mRedrawn[py / TILE_SIDE * (TWIDTH) + px / TILE_SIDE]) screen[py * WIDTH + px] = color;
             }
         }
     }
+
+    /* Tiles tx and tx + 1, tx even */
+    void draw_pair(const LC3Machine& m, int tx, int ty) {
+        const uint16_t row = BASE_VIDEO_MEMORY + ty * ROW_WORDS;
+        uint16_t pixels[TILE_SIDE];
+        for (int ln = 0; ln < TILE_SIDE; ln++) pixels[ln] = m.memory[row + (TWIDTH) + ln * (WIDTH / 16) + tx / 2];
+        expander(pixels, m.memory[row + tx], m.memory[row + tx + 1], &screen[ty * TILE_SIDE * WIDTH + tx * TILE_SIDE], WIDTH);
+    }
 };
\ No newline at end of file
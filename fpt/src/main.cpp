@@ -1,62 +1,318 @@
 #include <iostream>
 #ifndef _WIN32
 #include <signal.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#define isatty _isatty
+#define STDIN_FILENO 0
 #endif
 
-#include <thread>
-#include "lc3-hw.hpp"
-#include "memory.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include "FrameWriter.hpp"
+#include "KeyboardDevice.hpp"
+#include "LC3Machine.hpp"
+#include "TraceFile.hpp"
 #include "lc3-debug.hpp"
+#include "lc3-profile.hpp"
+#include "lc3-stats.hpp"
+
+/* SIGUSR1 asks for a stats dump */
+static LC3Machine* stats_machine = nullptr;
+static StatsDump* stats_dump = nullptr;
+#ifndef _WIN32
+static void handle_stats_request(int) {
+    if (stats_dump) stats_dump->request(*stats_machine);
+}
+#endif
 
 int main(int argc, const char* argv[])
 {
     bool debug_print = false;
+    bool profile_pairs = false;
+    const char* input_path = nullptr;
+    const char* video_path = nullptr;
+    const char* trace_path = nullptr;
+    const char* symbols_path = nullptr;
+    const char* folded_path = nullptr;
+    const char* calls_folded_path = nullptr;
+    const char* calls_json_path = nullptr;
+    uint64_t sample_period = 0;
+    const char* stats_path = nullptr;
+    double stats_interval = 0;
+    FrameWriter::Format video_format = FrameWriter::Format::Y4m;
+    int fps = 30;
+    PairProfile pair_profile;
+    auto machine = std::make_unique<LC3Machine>();
+    LC3Machine& m = *machine;
+    install_host_traps(m);
+#ifdef FPT_THREADED_DISPATCH
+    m.engine = LC3Machine::Engine::Threaded;
+#endif
 
     if (argc < 2)
     {
         /* show usage string */
-        std::cout << "lc3 [image-file1] ..." << std::endl;
+        std::cout << "lc3 [-g] [-p|-t|-r|-j] [-P] [-S period folded-file] [-C folded-file trace-json] [-d symbols.dbg] [-s stats-file] [-I seconds] [-M] [-G trace-file] [-T] [-i input-file] [-V raw|ppm|y4m video-file] [-F fps] [image-file1] ..." << std::endl;
         exit(2);
     }
 
     for (int j = 1; j < argc; ++j)
     {
-        if (j == 1 && (std::string("-g").compare(argv[j]) == 0)) {
+        if (std::string("-g").compare(argv[j]) == 0) {
             debug_print = true;
             continue;
         }
-        if (!read_image(argv[j]))
+        if (std::string("-p").compare(argv[j]) == 0) {
+            m.engine = LC3Machine::Engine::Decoded;
+            continue;
+        }
+        if (std::string("-t").compare(argv[j]) == 0) {
+            m.engine = LC3Machine::Engine::Threaded;
+            continue;
+        }
+        if (std::string("-r").compare(argv[j]) == 0) {
+            m.engine = LC3Machine::Engine::Reference;
+            continue;
+        }
+        if (std::string("-j").compare(argv[j]) == 0) {
+            m.engine = LC3Machine::Engine::Jit;
+            continue;
+        }
+        if (std::string("-P").compare(argv[j]) == 0) {
+            profile_pairs = true;
+            continue;
+        }
+        if (std::string("-S").compare(argv[j]) == 0 && j + 2 < argc) {
+            sample_period = std::max(1, atoi(argv[++j]));
+            folded_path = argv[++j];
+            continue;
+        }
+        if (std::string("-C").compare(argv[j]) == 0 && j + 2 < argc) {
+            calls_folded_path = argv[++j];
+            calls_json_path = argv[++j];
+            continue;
+        }
+        if (std::string("-s").compare(argv[j]) == 0 && j + 1 < argc) {
+            stats_path = argv[++j];
+            continue;
+        }
+        if (std::string("-I").compare(argv[j]) == 0 && j + 1 < argc) {
+            stats_interval = std::max(0.0, atof(argv[++j]));
+            continue;
+        }
+        if (std::string("-M").compare(argv[j]) == 0) {
+            m.stats.countOps = true;
+            continue;
+        }
+        if (std::string("-d").compare(argv[j]) == 0 && j + 1 < argc) {
+            symbols_path = argv[++j];
+            continue;
+        }
+        if (std::string("-G").compare(argv[j]) == 0 && j + 1 < argc) {
+            trace_path = argv[++j];
+            continue;
+        }
+        if (std::string("-T").compare(argv[j]) == 0) {
+            /* The OS image loaded first handles the standard traps */
+            for (uint8_t vector = TRAP_GETC; vector <= TRAP_HALT; vector++) m.set_trap(vector, nullptr);
+            continue;
+        }
+        if (std::string("-i").compare(argv[j]) == 0 && j + 1 < argc) {
+            input_path = argv[++j];
+            continue;
+        }
+        if (std::string("-V").compare(argv[j]) == 0 && j + 2 < argc) {
+            const std::string format = argv[++j];
+            if (format == "raw") video_format = FrameWriter::Format::Raw;
+            else if (format == "ppm") video_format = FrameWriter::Format::Ppm;
+            else if (format == "y4m") video_format = FrameWriter::Format::Y4m;
+            else {
+                std::cerr << "unknown video format: " << format << std::endl;
+                exit(2);
+            }
+            video_path = argv[++j];
+            continue;
+        }
+        if (std::string("-F").compare(argv[j]) == 0 && j + 1 < argc) {
+            fps = std::max(1, atoi(argv[++j]));
+            continue;
+        }
+        if (!m.read_image(argv[j]))
         {
             std::cerr << "failed to load image: " << argv[j] << std::endl;
             exit(1);
         }
     }
 
-    signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
+    /* The keyboard reads the terminal, or a file/pipe with -i */
+    std::unique_ptr<KeyboardDevice> keyboard;
+    try {
+        keyboard = input_path ? std::make_unique<KeyboardDevice>(m.input, input_path)
+                              : std::make_unique<KeyboardDevice>(m.input, STDIN_FILENO);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        exit(1);
+    }
+    const bool terminal = !input_path && isatty(STDIN_FILENO);
+    if (terminal) {
+        signal(SIGINT, handle_interrupt);
+        disable_input_buffering();
+    }
+
+    /* Programs spinning on KBSR/TMR sleep, at 1 MHz a TMI unit is 1 ms then */
+    m.idleClockHz = 1000000;
+
+    /* Headless video: a frame every 1/fps emulated seconds */
+    LC3Screen screen;
+    std::unique_ptr<FrameWriter> video;
+    std::unique_ptr<FrameCapture> capture;
+    if (video_path) {
+        try {
+            video = std::make_unique<FrameWriter>(video_format, video_path, fps);
+        } catch (const std::runtime_error& e) {
+            std::cerr << e.what() << std::endl;
+            exit(1);
+        }
+        /* stdout carries the frames, the console goes to stderr */
+        if (std::string("-") == video_path) m.console.to_stream(std::cerr);
+#ifndef _WIN32
+        /* A closed pipe makes the writer fail instead of killing us */
+        signal(SIGPIPE, SIG_IGN);
+#endif
+        screen.attach(m);
+        capture = std::make_unique<FrameCapture>(screen, *video, m.idleClockHz / fps);
+        m.add_device(*capture);
+    }
+
+    /* Binary trace, decoded offline by fpt-trace */
+    std::unique_ptr<TraceWriter> trace;
+    if (trace_path) {
+        try {
+            trace = std::make_unique<TraceWriter>(trace_path);
+        } catch (const std::runtime_error& e) {
+            std::cerr << e.what() << std::endl;
+            exit(1);
+        }
+    }
+
+    /* Profilers, reported at exit through the debug symbols */
+    std::unique_ptr<DebugSymbols> symbols;
+    try {
+        if (symbols_path) symbols = std::make_unique<DebugSymbols>(symbols_path);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        exit(1);
+    }
+    std::unique_ptr<PcSampler> sampler;
+    if (sample_period) {
+        sampler = std::make_unique<PcSampler>(sample_period);
+        m.add_device(*sampler);
+    }
+    std::unique_ptr<CallProfile> calls;
+    if (calls_folded_path) calls = std::make_unique<CallProfile>(m.pcStart);
+
+    /* Stats: on exit, on SIGUSR1 and every -I emulated seconds */
+    std::unique_ptr<std::ofstream> stats_file;
+    std::unique_ptr<StatsDump> stats;
+    if (stats_path) {
+        std::ostream* out = &std::cerr;
+        if (std::string("-") != stats_path) {
+            stats_file = std::make_unique<std::ofstream>(stats_path);
+            if (!*stats_file) {
+                std::cerr << "failed to open stats output: " << stats_path << std::endl;
+                exit(1);
+            }
+            out = stats_file.get();
+        }
+        stats = std::make_unique<StatsDump>(*out, (uint64_t)(stats_interval * m.idleClockHz));
+        m.add_device(*stats);
+        stats_machine = &m;
+        stats_dump = stats.get();
+#ifndef _WIN32
+        signal(SIGUSR1, handle_stats_request);
+#endif
+    }
 
     /* set the PC to starting position */
-    reg[R_PC] = PC_START;
+    m.reset();
 
-    std::thread kb_poll([=](){
-        while(true) if(check_key())
-            input_buffer.push(std::cin.get());
-    });
-    while (running)
-    {
-        /* INTERRUPT */
-        //TODO
-        
-        /* FETCH */
-        uint16_t instr = mem_read(reg[R_PC]++);
-        uint16_t op = instr >> 12;
+    keyboard->start();
+    /* The engines do not trace or profile, -g, -G, -P and -C run one
+     * instruction at a time, waiting for input like run() does */
+    if (debug_print || trace || profile_pairs || calls) {
+        m.engine = LC3Machine::Engine::Reference;
+        LC3Machine::StopReason reason = LC3Machine::StopReason::Budget;
+        while (reason != LC3Machine::StopReason::Halted)
+        {
+            /* INTERRUPT: taken first, so that the traced instruction is the one that runs */
+            const uint16_t interrupted = m.reg[R_PC];
+            m.poll_devices();
+            if (calls && m.reg[R_PC] != interrupted) calls->interrupt(interrupted, m.reg[R_PC], m.instructions);
 
-        if(debug_print) {
-            std::cout << mcodeToString(instr) << std::endl;
+            if (reason == LC3Machine::StopReason::WaitingInput && !m.wait_input()) break;
+            const uint16_t instr = m.memory[m.reg[R_PC]];
+            if(debug_print) {
+                /* The trace goes in between the program output, through
+                 * the same buffer */
+                char line[DISASM_MAX + 1];
+                size_t length = disassemble(instr, line);
+                line[length++] = '\n';
+                m.console.put(m, line, length);
+            }
+            if(profile_pairs) {
+                pair_profile.record(m.reg[R_PC], instr);
+            }
+            const uint16_t pc = m.reg[R_PC];
+            uint16_t before[8];
+            std::copy(m.reg, m.reg + 8, before);
+            reason = m.run_for(1);
+            /* GETC/IN without a key run again later */
+            if (reason == LC3Machine::StopReason::WaitingInput) continue;
+            if(trace) trace->record(pc, instr, before, m.reg);
+            if(calls) calls->record(pc, instr, m.reg[R_PC], m.instructions);
         }
-        op_table[op](instr);
+    } else {
+        m.run();
+    }
+    if(profile_pairs) {
+        std::cerr << std::endl;
+        pair_profile.report(std::cerr);
+    }
+    if (sampler) {
+        const SourceProfile profile(sampler->counts, symbols.get());
+        std::cerr << std::endl;
+        profile.report(std::cerr);
+        std::ofstream folded(folded_path);
+        profile.folded(folded);
+        if (!folded) std::cerr << "failed to write profile: " << folded_path << std::endl;
+    }
+    if (stats) {
+        stats_dump = nullptr;
+        if (!stats_file) std::cerr << std::endl;
+        stats->dump(m);
     }
-    kb_poll.join();
-    
-    restore_input_buffering();
+    if (calls) {
+        std::cerr << std::endl;
+        calls->report(std::cerr, symbols.get());
+        std::ofstream folded(calls_folded_path), json(calls_json_path);
+        calls->folded(folded, symbols.get());
+        calls->chrome_trace(json, symbols.get(), m.instructions);
+        if (!folded || !json) std::cerr << "failed to write call profile" << std::endl;
+    }
+    m.console.flush();
+    if (trace) {
+        trace->flush();
+        if (trace->failed()) std::cerr << "trace output failed" << std::endl;
+    }
+    keyboard->stop();
+    if (video) {
+        video->stop();
+        if (video->failed()) std::cerr << "video output failed after " << video->frames() << " frames" << std::endl;
+    }
+
+    if (terminal) restore_input_buffering();
 }
\ No newline at end of file
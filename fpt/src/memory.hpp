@@ -1,7 +1,6 @@
 #pragma once
 
 #include <cstdint>
-#include "InputBuffer.hpp"
 
 enum
 {
@@ -9,11 +8,57 @@ enum
     MR_KBDR = 0xFE02,  /* keyboard data */
     MR_DSR  = 0xFE04,  /* display status */
     MR_DDR  = 0xFE06,  /* display data */
+    MR_TMR  = 0xFE08,  /* timer status */
+    MR_TMI  = 0xFE0A,  /* timer interval, in TIMER_UNIT instructions */
+    MR_DMAS = 0xFE0C,  /* DMA status and command */
+    MR_DMASRC = 0xFE0E, /* DMA source, or the value of a fill */
+    MR_DMADST = 0xFE10, /* DMA destination */
+    MR_DMALEN = 0xFE12, /* DMA length, in words */
     MR_MCR  = 0xFFFE,  /* machine control register */
 };
 
-/* 65536 locations */
-extern uint16_t memory[UINT16_MAX];
+/* Status register bits of the keyboard, the timer and the DMA, the
+ * commands written to MR_DMAS along with DS_IE, and the MCR clock bit */
+enum
+{
+    DS_READY = 1 << 15, /* a key is in KBDR, the timer interval elapsed, the transfer is done */
+    DS_IE    = 1 << 14, /* interrupt enable, the only writable bit */
+    DMA_COPY = 1 << 0,  /* DMALEN words from DMASRC to DMADST, as memmove */
+    DMA_FILL = 1 << 1,  /* DMALEN words at DMADST set to DMASRC */
+    MCR_CLOCK = 1 << 15, /* MR_MCR: the machine runs, cleared to halt it */
+};
+
+/* INTERRUPTS
+ *
+ * A device raises its interrupt while both DS_READY and DS_IE are set. It
+ * is taken when its priority is above PSR[10:8]: PSR and PC are pushed on
+ * the supervisor stack and PC is loaded from the Interrupt Vector Table
+ * entry 0x0100 + vector. RTI pops them back.
+ */
+const static uint16_t interruptVectorTable = 0x0100;
+enum
+{
+    INT_KEYBOARD = 0x80, PL_KEYBOARD = 4,
+    INT_TIMER    = 0x81, PL_TIMER    = 5,
+    INT_DMA      = 0x82, PL_DMA      = 3,
+};
+/* The timer counts executed instructions, not host time, so that runs are
+ * reproducible */
+const static uint64_t TIMER_UNIT = 1000;
+
+/* PAGES
+ *
+ * Memory is split in 256 pages of 256 words, each with PAGE_* flags. Loads
+ * and stores to pages without flags are plain array accesses.
+ */
+enum { PAGE_BITS = 8, PAGE_MASK = (1 << PAGE_BITS) - 1 };
+enum : uint8_t
+{
+    PAGE_DEVICE   = 1 << 0, /* loads and stores go to the mapped devices */
+    PAGE_OBSERVED = 1 << 1, /* stores are reported to the observing devices */
+};
+
+/* 65536 locations, owned by LC3Machine */
 const static uint16_t userSpaceLower = 0x3000;
 const static uint16_t userSpaceUpper = 0xFDFF;
 /* Memory Map:
@@ -49,10 +94,4 @@ const static uint16_t userSpaceUpper = 0xFDFF;
  *          |      addresses       |
  *   0xFFFF +----------------------+
  * 
- */
-
-extern InputBuffer input_buffer;
-inline        void mem_write(uint16_t address, uint16_t val) { memory[address] = val; }
-inline        void mem_write88(uint16_t address, uint16_t val_h, uint16_t val_l) { memory[address] = val_h << 8 | (val_l & 0xFF); }
-               int check_key();
-          uint16_t mem_read(uint16_t address);
\ No newline at end of file
+ */
\ No newline at end of file
@@ -1,11 +1,27 @@
 #include <array>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
 #include "gtest/gtest.h"
-#include "lc3-hw.hpp"
+#include "FrameWriter.hpp"
+#include "KeyboardDevice.hpp"
+#include "LC3Machine.hpp"
+#include "TraceFile.hpp"
+#include "lc3-debug.hpp"
+#include "lc3-profile.hpp"
+#include "lc3-stats.hpp"
 #include "lc3-video.hpp"
 
 // The fixture for testing class Foo.
 class TestOperand : public ::testing::Test {
 public:
+    LC3Machine m;
+    uint16_t (&reg)[R_COUNT] = m.reg;
+    uint16_t (&memory)[UINT16_MAX + 1] = m.memory;
     uint16_t instr, op, r0, r1, r2, imm5, old_pc, offset;
     enum { PC_START = 0x3000 };
 
@@ -20,10 +36,10 @@ TEST_F(TestOperand, OP_ADDRegister) {
     reg[r1] = 5;
     reg[r2] = 8;
     instr = op << 12 | r0 << 9 | r1 << 6 | r2;
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_NE(reg[r1] + r2 ,reg[r0]);
     EXPECT_EQ(reg[r1] + reg[r2], reg[r0]);
-    EXPECT_EQ(FL_POS, reg[R_COND]);
+    EXPECT_EQ(FL_POS, m.cond_flags());
 }
 
 TEST_F(TestOperand, OP_ADDimm5) {
@@ -33,10 +49,10 @@ TEST_F(TestOperand, OP_ADDimm5) {
     reg[r1] = 4;
     reg[imm5 & 0x7] = 7;
     instr = op << 12 | r0 << 9 | r1 << 6 | 1 << 5 | (imm5 & 0x1F);
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_NE(reg[r1] + reg[imm5 & 0x7], reg[r0]);
     EXPECT_EQ((uint16_t) (reg[r1] + imm5), reg[r0]);
-    EXPECT_EQ(FL_NEG, reg[R_COND]);
+    EXPECT_EQ(FL_NEG, m.cond_flags());
 }
 
 TEST_F(TestOperand, OP_ADDimm5FL_ZRO) {
@@ -46,10 +62,10 @@ TEST_F(TestOperand, OP_ADDimm5FL_ZRO) {
     reg[r1] = 6;
     reg[imm5 & 0x7] = 7;
     instr = op << 12 | r0 << 9 | r1 << 6 | 1 << 5 | (imm5 & 0x1F);
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_NE(reg[r1] + reg[imm5 & 0x7], reg[r0]);
     EXPECT_EQ((uint16_t) (reg[r1] + imm5), reg[r0]);
-    EXPECT_EQ(FL_ZRO, reg[R_COND]);
+    EXPECT_EQ(FL_ZRO, m.cond_flags());
 }
 
 TEST_F(TestOperand, OP_ANDRegister) {
@@ -58,10 +74,10 @@ TEST_F(TestOperand, OP_ANDRegister) {
     reg[r1] = 0b1101011101111010;
     reg[r2] = 0b1011000101101011;
     instr = op << 12 | r0 << 9 | r1 << 6 | r2;
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_NE((reg[r1] & r2     ), reg[r0]);
     EXPECT_EQ((reg[r1] & reg[r2]), reg[r0]);
-    EXPECT_EQ(FL_NEG, reg[R_COND]);
+    EXPECT_EQ(FL_NEG, m.cond_flags());
 }
 
 TEST_F(TestOperand, OP_ANDimm5) {
@@ -71,10 +87,10 @@ TEST_F(TestOperand, OP_ANDimm5) {
     reg[r1] = 0b0101011101111010;
     reg[imm5 & 0x7] = 0b1011000101101011;
     instr = op << 12 | r0 << 9 | r1 << 6 | 1 << 5 | (imm5 & 0x1F);
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_NE((reg[r1] & reg[imm5 & 0x7]), reg[r0]);
     EXPECT_EQ((reg[r1] & imm5   ), reg[r0]);
-    EXPECT_EQ(FL_POS, reg[R_COND]);
+    EXPECT_EQ(FL_POS, m.cond_flags());
 }
 
 TEST_F(TestOperand, OP_NOT) {
@@ -82,9 +98,9 @@ TEST_F(TestOperand, OP_NOT) {
     reg[r0] = 0;
     reg[r1] = 0b1101011101111010;
     instr = op << 12 | r0 << 9 | r1 << 6 | 0x3F;
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_EQ((uint16_t)~reg[r1], (uint16_t)reg[r0]);
-    EXPECT_EQ(FL_POS, reg[R_COND]);
+    EXPECT_EQ(FL_POS, m.cond_flags());
 }
 
 TEST_F(TestOperand, OP_XORRegister) {
@@ -93,10 +109,10 @@ TEST_F(TestOperand, OP_XORRegister) {
     reg[r1] = 0b1101011101111010;
     reg[r2] = 0b1011000101101011;
     instr = op << 12 | r0 << 9 | r1 << 6 | r2;
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_NE((reg[r1] ^ r2     ), reg[r0]);
     EXPECT_EQ((reg[r1] ^ reg[r2]), reg[r0]);
-    EXPECT_EQ(FL_POS, reg[R_COND]);
+    EXPECT_EQ(FL_POS, m.cond_flags());
 }
 
 TEST_F(TestOperand, OP_XORimm5) {
@@ -106,10 +122,10 @@ TEST_F(TestOperand, OP_XORimm5) {
     reg[r1]         = 0b0101011101111010;
     reg[imm5 & 0x7] = 0b1011000101101011;
     instr = op << 12 | r0 << 9 | r1 << 6 | 1 << 5 | (imm5 & 0x1F);
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_NE((reg[r1] ^ reg[imm5 & 0x7]), reg[r0]);
     EXPECT_EQ((reg[r1] ^ imm5   ), reg[r0]);
-    EXPECT_EQ(FL_NEG, reg[R_COND]);
+    EXPECT_EQ(FL_NEG, m.cond_flags());
 }
 
 TEST_F(TestOperand, OP_BR) {
@@ -118,9 +134,9 @@ offset = -4;
 for(r0 = 0b000; r0 < 0b1000; r0++) {
     for(uint16_t flag = 0b001; flag < 0b1000; flag <<= 1) {
         old_pc = reg[R_PC];
-        reg[R_COND] = flag;
+        m.set_cond_flags(flag);
         instr = op << 12 | r0 << 9 | (offset & 0x1FF);
-        op_table[op](instr);
+        op_table[op](m, instr);
         if(flag & r0)
             EXPECT_EQ((uint16_t)(old_pc + offset), (uint16_t)reg[R_PC]);
         else
@@ -135,7 +151,7 @@ TEST_F(TestOperand, OP_JMP) {
     reg[r1] = -16;
     old_pc = reg[R_PC];
     instr = op << 12 | r1 << 6;
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_EQ((uint16_t)reg[r1], (uint16_t)reg[R_PC]);
 }
 
@@ -144,7 +160,7 @@ TEST_F(TestOperand, OP_JSR) {
     old_pc = reg[R_PC];
     offset = -16;
     instr = op << 12 | 1 << 11 | (offset & 0x7FF);
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_EQ(old_pc, reg[R_R7]);
     EXPECT_EQ((uint16_t)(old_pc + offset), (uint16_t)reg[R_PC]);
 }
@@ -154,7 +170,7 @@ TEST_F(TestOperand, OP_JSRR) {
     reg[r1] = 0x3000;
     old_pc = reg[R_PC];
     instr = op << 12 | r1 << 6;
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_EQ(old_pc, reg[R_R7]);
     EXPECT_EQ((uint16_t)reg[r1], (uint16_t)reg[R_PC]);
 }
@@ -164,7 +180,7 @@ TEST_F(TestOperand, OP_LD) {
     offset = -16;
     memory[(uint16_t)(reg[R_PC] + offset)] = 0xABCD;
     instr = op << 12 | r0 << 9 | (offset & 0x1FF);
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_EQ(0xABCD, reg[r0]);
 }
 
@@ -174,7 +190,7 @@ TEST_F(TestOperand, OP_LDI) {
     memory[(uint16_t)(reg[R_PC] + offset)] = 0x4000;
     memory[0x4000] = 0xDCBA;
     instr = op << 12 | r0 << 9 | (offset & 0x1FF);
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_EQ(0xDCBA, reg[r0]);
 }
 
@@ -184,7 +200,7 @@ TEST_F(TestOperand, OP_LDR) {
     offset = -16;
     memory[0x5000] = 0xB00B;
     instr = op << 12 | r0 << 9 | r1 << 6 | (offset & 0x3F);
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_EQ(0xB00B, reg[r0]);
 }
 
@@ -192,7 +208,7 @@ TEST_F(TestOperand, OP_LEA) {
     op = OP_LEA;
     offset = -16;
     instr = op << 12 | r0 << 9 | (offset & 0x1FF);
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_EQ((uint16_t)(reg[R_PC] + offset), reg[r0]);
 }
 
@@ -201,7 +217,7 @@ TEST_F(TestOperand, OP_ST) {
     offset = -16;
     reg[r0] = 0xBABE;
     instr = op << 12 | r0 << 9 | (offset & 0x1FF);
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_EQ(0xBABE, memory[(uint16_t)(reg[R_PC] + offset)]);
 }
 
@@ -211,7 +227,7 @@ TEST_F(TestOperand, OP_STI) {
     reg[r0] = 0xCAFE;
     memory[(uint16_t)(reg[R_PC] + offset)] = 0x4000;
     instr = op << 12 | r0 << 9 | (offset & 0x1FF);
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_EQ(0xCAFE, memory[0x4000]);
 }
 
@@ -221,7 +237,7 @@ TEST_F(TestOperand, OP_STR) {
     reg[r1] = 0x6010;
     reg[r0] = 0x1EE7;
     instr = op << 12 | r0 << 9 | r1 << 6 | (offset & 0x3F);
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_EQ(0x1EE7, memory[0x6000]);
 }
 
@@ -231,7 +247,7 @@ TEST_F(TestOperand, OP_LSHF) {
     reg[r1] = 0xEC10;
     reg[r0] = 0x1EE7;
     instr = op << 12 | r0 << 9 | r1 << 6 | (offset & 0x3F);
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_EQ(0xC100, reg[r0]);
 }
 
@@ -241,7 +257,7 @@ TEST_F(TestOperand, OP_RSHFL) {
     reg[r1] = 0xEC10;
     reg[r0] = 0x1EE7;
     instr = op << 12 | r0 << 9 | r1 << 6 | (offset & 0x3F);
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_EQ(0x0EC1, reg[r0]);
 }
 
@@ -251,12 +267,1241 @@ TEST_F(TestOperand, OP_RSHFA) {
     reg[r1] = 0xEC10;
     reg[r0] = 0x1EE7;
     instr = op << 12 | r0 << 9 | r1 << 6 | (offset & 0x3F);
-    op_table[op](instr);
+    op_table[op](m, instr);
     EXPECT_EQ(0xFEC1, reg[r0]);
 }
 
+TEST_F(TestOperand, DecodedMatchesExec) {
+    op = OP_ADD;
+    imm5 = -6;
+    reg[r1] = 4;
+    instr = op << 12 | r0 << 9 | r1 << 6 | 1 << 5 | (imm5 & 0x1F);
+    op_table[op](m, instr);
+    uint16_t expected = reg[r0], expected_cond = reg[R_COND];
+    reg[r0] = 0;
+    reg[R_COND] = 0;
+    const DecodedInstr d = decode_table[op](instr);
+    d.handler(m, d);
+    EXPECT_EQ(expected, reg[r0]);
+    EXPECT_EQ(expected_cond, reg[R_COND]);
+}
+
+TEST_F(TestOperand, DecodedInvalidatedByStore) {
+    const uint16_t address = 0x4100;
+    m.mem_write(address, OP_ADD << 12 | r0 << 9 | r1 << 6 | 1 << 5 | 1); //ADD R0 R1 #1
+    const DecodedInstr& d = m.fetch_decoded(address);
+    EXPECT_EQ(&m.fetch_decoded(address), &d);
+    EXPECT_EQ(1, d.op2);
+    m.mem_write(address, OP_ADD << 12 | r0 << 9 | r1 << 6 | 1 << 5 | 2); //ADD R0 R1 #2
+    EXPECT_FALSE(m.is_decoded(address));
+    EXPECT_EQ(2, m.fetch_decoded(address).op2);
+}
+
+TEST_F(TestOperand, DecodedFusedPair) {
+    const uint16_t address = 0x4200;
+    m.mem_write(address, OP_ADD << 12 | r0 << 9 | r1 << 6 | 1 << 5 | 1); //ADD R0 R1 #1
+    m.mem_write(address + 1, OP_BR << 12 | FL_ZRO << 9 | 0x005);          //BRz #5
+    const DecodedInstr& d = m.fetch_decoded(address);
+    EXPECT_NE(decode_table[OP_ADD](memory[address]).handler, d.handler);
+    EXPECT_EQ(2, d.length);
+    EXPECT_TRUE(m.is_decoded(address + 1));
+
+    reg[r1] = 0xFFFF;
+    reg[R_PC] = address + 1;
+    d.handler(m, d);
+    EXPECT_EQ(0, reg[r0]);
+    EXPECT_EQ(FL_ZRO, m.cond_flags());
+    EXPECT_EQ(address + 2 + 5, reg[R_PC]);
+
+    m.mem_write(address + 1, OP_ADD << 12 | r2 << 9 | r2 << 6 | 1 << 5 | 1); //ADD R2 R2 #1
+    EXPECT_FALSE(m.is_decoded(address));
+}
+
+/* A load raising a device event stops the pair, as in the other engines */
+TEST_F(TestOperand, DecodedFusedPairDeviceEvent) {
+    const uint16_t address = 0x4300;
+    m.mem_write(address, OP_LDR << 12 | r0 << 9 | r1 << 6);                 //LDR R0 R1 #0
+    m.mem_write(address + 1, OP_ADD << 12 | r2 << 9 | r2 << 6 | 1 << 5 | 1); //ADD R2 R2 #1
+    const DecodedInstr& d = m.fetch_decoded(address);
+    EXPECT_EQ(2, d.length);
+
+    reg[r1] = address;
+    reg[r2] = 0;
+    reg[R_PC] = address + 1;
+    m.poll_devices();
+    EXPECT_EQ(2, d.handler(m, d));
+    EXPECT_EQ(1, reg[r2]);
+
+    /* Reading KBDR with the interrupt enabled raises an event */
+    m.mem_write(MR_KBSR, DS_IE);
+    m.poll_devices();
+    reg[r1] = MR_KBDR;
+    reg[R_PC] = address + 1;
+    EXPECT_EQ(1, d.handler(m, d));
+    EXPECT_TRUE(m.device_event());
+    EXPECT_EQ(1, reg[r2]);
+    EXPECT_EQ(address + 1, reg[R_PC]);
+    EXPECT_EQ(FL_ZRO, m.cond_flags());
+}
+
+/* Runs the same program through every engine and compares the final
+ * state with the op_table reference engine. */
+class TestEngine : public ::testing::Test {
+public:
+    LC3Machine m;
+    uint16_t (&reg)[R_COUNT] = m.reg;
+    uint16_t (&memory)[UINT16_MAX + 1] = m.memory;
+    enum { PC_START = 0x3000 };
+    std::vector<uint16_t> program = {
+        0x5020, //AND R0 R0 #0
+        0x221B, //LD R1 A
+        0x241B, //LD R2 B
+        0x480F, //JSR MUL
+        0x301A, //ST R0 RES
+        0xA61A, //LDI R3 PTR
+        0xE81A, //LEA R4 DATA
+        0x6B01, //LDR R5 R4 #1
+        0x9B43, //XOR R5 R5 R3
+        0x9D7F, //NOT R6 R5
+        0x7D02, //STR R6 R4 #2
+        0xBC14, //STI R6 PTR
+        0x5260, //AND R1 R1 #0
+        0x127D, //ADD R1 R1 #-3
+        0xDE71, //RSHFA R7 R1 #1
+        0xE402, //LEA R2 DONE
+        0xC080, //JMP R2
+        0xF025, //HALT
+        0xF025, //DONE HALT
+        0x5020, //MUL AND R0 R0 #0
+        0x14A0, //ADD R2 R2 #0
+        0x0406, //LOOP BRz MDONE
+        0x56A1, //AND R3 R2 #1
+        0x0401, //BRz SKIP
+        0x1001, //ADD R0 R0 R1
+        0xD241, //SKIP LSHF R1 R1 #1
+        0xD491, //RSHFL R2 R2 #1
+        0x0FF9, //BR LOOP
+        0xC1C0, //MDONE RET
+        0x0078, //A .FILL #120
+        0x0012, //B .FILL #18
+        0x0000, //RES .FILL #0
+        0x3021, //PTR .FILL DATA
+        0x0007, //DATA .FILL #7
+        0x1234, //.FILL #x1234
+        0x0000, //.FILL #0
+    };
+    std::array<uint16_t, R_COUNT> expected_reg;
+    std::vector<uint16_t> expected_mem;
+    uint64_t expected_count;
+
+    void load() {
+        for(size_t i = 0; i < program.size(); i++) m.mem_write(PC_START + i, program[i]);
+        m.pcStart = PC_START;
+        m.reset();
+    }
+    void check() {
+        for(int r = 0; r < R_COUNT; r++) EXPECT_EQ(expected_reg[r], reg[r]) << "R" << r;
+        EXPECT_EQ(expected_count, m.instructions);
+        for(size_t i = 0; i < program.size(); i++) EXPECT_EQ(expected_mem[i], memory[PC_START + i]) << "address " << i;
+    }
+
+    /* Run program with the reference engine, then reload it */
+    void prepare() {
+        load();
+        m.engine = LC3Machine::Engine::Reference;
+        m.run();
+        std::copy(std::begin(reg), std::end(reg), expected_reg.begin());
+        expected_mem.assign(&memory[PC_START], &memory[PC_START + program.size()]);
+        expected_count = m.instructions;
+        load();
+    }
+
+protected:
+    void SetUp() override {
+        prepare();
+        EXPECT_EQ(120 * 18, expected_mem[0x1F]);
+    }
+};
+
+TEST_F(TestEngine, Decoded) {
+    m.engine = LC3Machine::Engine::Decoded;
+    m.run();
+    check();
+}
+
+TEST_F(TestEngine, Threaded) {
+    m.engine = LC3Machine::Engine::Threaded;
+    m.run();
+    check();
+}
+
+TEST_F(TestEngine, Jit) {
+    m.engine = LC3Machine::Engine::Jit;
+    m.run();
+    check();
+}
+
+/* Every engine must stop exactly on the budget and resume from there */
+TEST_F(TestEngine, Budget) {
+    ASSERT_LT(10u, expected_count);
+    for(auto engine : {LC3Machine::Engine::Reference, LC3Machine::Engine::Decoded,
+                       LC3Machine::Engine::Threaded, LC3Machine::Engine::Jit}) {
+        load();
+        m.engine = engine;
+        uint64_t before = m.instructions;
+        while(m.run_for(7) == LC3Machine::StopReason::Budget) {
+            EXPECT_EQ(before + 7, m.instructions);
+            before = m.instructions;
+        }
+        EXPECT_EQ(expected_count, m.instructions) << "engine " << (int)engine;
+        check();
+    }
+}
+
+TEST_F(TestEngine, Step) {
+    m.step();
+    EXPECT_EQ(PC_START + 1, reg[R_PC]);
+    EXPECT_EQ(1u, m.instructions);
+    while(m.running) m.step();
+    check();
+}
+
+TEST_F(TestEngine, RunUntil) {
+    using StopReason = LC3Machine::StopReason;
+    EXPECT_EQ(StopReason::Budget, m.run_until(10));
+    EXPECT_EQ(10u, m.instructions);
+    EXPECT_EQ(StopReason::Budget, m.run_until(5));
+    EXPECT_EQ(10u, m.instructions);
+    EXPECT_EQ(StopReason::Halted, m.run_until(expected_count + 100));
+    check();
+    EXPECT_EQ(StopReason::Halted, m.run_for(100));
+    EXPECT_EQ(expected_count, m.instructions);
+}
+
+TEST_F(TestEngine, RunUntilDeadline) {
+    m.mem_write(PC_START, 0x0FFF); //BR #-1
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(2);
+    EXPECT_EQ(LC3Machine::StopReason::Budget, m.run_until(deadline));
+    EXPECT_LE(deadline, std::chrono::steady_clock::now());
+    EXPECT_LT(0u, m.instructions);
+}
+
+TEST_F(TestEngine, Breakpoint) {
+    using StopReason = LC3Machine::StopReason;
+    m.engine = LC3Machine::Engine::Jit;
+    m.set_breakpoint(PC_START + 4); //ST R0 RES, after JSR MUL
+    EXPECT_EQ(StopReason::Breakpoint, m.run_for(UINT64_MAX));
+    EXPECT_EQ(PC_START + 4, reg[R_PC]);
+    EXPECT_EQ(120 * 18, reg[R_R0]);
+    EXPECT_EQ(0, memory[PC_START + 0x1F]);
+    EXPECT_EQ(StopReason::Halted, m.run_for(UINT64_MAX));
+    check();
+}
+
+TEST_F(TestEngine, WaitingInput) {
+    using StopReason = LC3Machine::StopReason;
+    std::ostringstream output;
+    m.console.to_stream(output);
+    m.mem_write(PC_START, 0xF023);     //IN
+    m.mem_write(PC_START + 1, 0xF025); //HALT
+    for(auto engine : {LC3Machine::Engine::Reference, LC3Machine::Engine::Decoded,
+                       LC3Machine::Engine::Threaded, LC3Machine::Engine::Jit}) {
+        output.str("");
+        m.reset();
+        m.engine = engine;
+        EXPECT_EQ(StopReason::WaitingInput, m.run_for(100));
+        EXPECT_EQ(StopReason::WaitingInput, m.run_for(100));
+        EXPECT_EQ(PC_START, reg[R_PC]);
+        EXPECT_EQ(0u, m.instructions);
+        m.input.push('x');
+        EXPECT_EQ(StopReason::Halted, m.run_for(100));
+        EXPECT_EQ('x', reg[R_R0]);
+        EXPECT_EQ(2u, m.instructions);
+        EXPECT_EQ("Enter a character: xHALT", output.str());
+    }
+}
+
+/* Two machines share nothing */
+TEST_F(TestEngine, Independent) {
+    LC3Machine other;
+    other.mem_write(PC_START, 0xF025); //HALT
+    other.reset();
+    other.run();
+    EXPECT_EQ(1u, other.instructions);
+    EXPECT_EQ(program[0], memory[PC_START]);
+    m.engine = LC3Machine::Engine::Jit;
+    m.run();
+    check();
+    EXPECT_EQ(0xF025, other.memory[PC_START]);
+}
+
+TEST_F(TestEngine, JitSelfModifyingCode) {
+    program = {
+        0x2407, //LD R2 PATCH
+        0x5020, //AND R0 R0 #0
+        0x1261, //LOOP ADD R1 R1 #1
+        0x1021, //TARGET ADD R0 R0 #1
+        0x35FE, //ST R2 TARGET
+        0x167E, //ADD R3 R1 #-2
+        0x09FB, //BRn LOOP
+        0xF025, //HALT
+        0x1025, //PATCH ADD R0 R0 #5
+    };
+    prepare();
+    EXPECT_EQ(6, expected_reg[R_R0]);
+    m.engine = LC3Machine::Engine::Jit;
+    m.run();
+    check();
+}
+
+/* A peripheral plugged into the registry */
+class CounterDevice : public Device {
+public:
+    int reads = 0, writes = 0, observed = 0;
+    uint16_t last = 0;
+    uint16_t read(LC3Machine&, uint16_t address) override { reads++; return address; }
+    void write(LC3Machine&, uint16_t, uint16_t val) override { writes++; last = val; }
+    void written(LC3Machine&, uint16_t address) override { observed++; last = address; }
+};
+
+TEST(TestDevice, Registry) {
+    LC3Machine m;
+    CounterDevice device;
+    const std::vector<uint16_t> program = {
+        0xA005, //LDI R0 DEV_PTR
+        0xB004, //STI R0 DEV_PTR
+        0xA204, //LDI R1 RAM_PTR
+        0x3204, //ST R1 OBS
+        0xF025, //HALT
+        0x0000,
+        0xFD10, //DEV_PTR .FILL xFD10
+        0xFD00, //RAM_PTR .FILL xFD00, same page
+        0x0000, //OBS .FILL #0
+    };
+    for(size_t i = 0; i < program.size(); i++) m.mem_write(0x3000 + i, program[i]);
+    m.memory[0xFD00] = 0x1234;
+    m.map_device(device, 0xFD10, 0xFD1F);
+    m.observe(device, 0x3008, 0x3008);
+    EXPECT_EQ(PAGE_DEVICE, m.page_flags(0xFD00));
+    EXPECT_EQ(PAGE_OBSERVED, m.page_flags(0x3000));
+    EXPECT_EQ(0, m.page_flags(0x4000));
+    EXPECT_EQ(PAGE_DEVICE, m.page_flags(MR_MCR));
+
+    std::ostringstream output;
+    m.console.to_stream(output);
+    for(auto engine : {LC3Machine::Engine::Reference, LC3Machine::Engine::Decoded,
+                       LC3Machine::Engine::Threaded, LC3Machine::Engine::Jit}) {
+        device = CounterDevice();
+        m.memory[0x3008] = 0;
+        m.reset();
+        m.engine = engine;
+        m.run();
+        EXPECT_EQ(0xFD10, m.reg[R_R0]);
+        EXPECT_EQ(0x1234, m.reg[R_R1]);
+        EXPECT_EQ(0x1234, m.memory[0x3008]);
+        EXPECT_EQ(1, device.reads);
+        EXPECT_EQ(1, device.writes);
+        EXPECT_EQ(1, device.observed);
+        EXPECT_EQ(0x3008, device.last);
+        EXPECT_EQ(0, m.memory[0xFD10]);
+    }
+}
+
+TEST(TestDevice, Dma) {
+    LC3Machine m;
+    /* Fill plain RAM, DMAS is ready until it is read */
+    m.mem_write(MR_DMASRC, 0xABCD);
+    m.mem_write(MR_DMADST, 0x4000);
+    m.mem_write(MR_DMALEN, 300);
+    m.mem_write(MR_DMAS, DMA_FILL);
+    EXPECT_EQ(0xABCD, m.memory[0x4000]);
+    EXPECT_EQ(0xABCD, m.memory[0x4000 + 299]);
+    EXPECT_EQ(0, m.memory[0x4000 + 300]);
+    EXPECT_EQ(DS_READY, m.mem_read(MR_DMAS));
+    EXPECT_EQ(0, m.mem_read(MR_DMAS));
+
+    /* Overlapping copies behave like memmove, in plain and observed RAM */
+    LC3Screen lc3s;
+    lc3s.attach(m);
+    lc3s.mem_to_screen(m);
+    for (uint16_t base : {(uint16_t)0x5000, (uint16_t)LC3Screen::BASE_VIDEO_MEMORY}) {
+        for (uint16_t i = 0; i < 10; i++) m.mem_write(base + i, i + 1);
+        m.mem_write(MR_DMASRC, base);
+        m.mem_write(MR_DMADST, base + 2);
+        m.mem_write(MR_DMALEN, 8);
+        m.mem_write(MR_DMAS, DMA_COPY);
+        const std::vector<uint16_t> up = { 1, 2, 1, 2, 3, 4, 5, 6, 7, 8 };
+        EXPECT_TRUE(std::equal(up.begin(), up.end(), &m.memory[base]));
+        m.mem_write(MR_DMASRC, base + 2);
+        m.mem_write(MR_DMADST, base);
+        m.mem_write(MR_DMAS, DMA_COPY);
+        const std::vector<uint16_t> down = { 1, 2, 3, 4, 5, 6, 7, 8, 7, 8 };
+        EXPECT_TRUE(std::equal(down.begin(), down.end(), &m.memory[base]));
+    }
+    /* The screen saw the stores: colour words of tiles 0..9 */
+    const std::vector<ScreenRect> changed = { {0, 0, 80, 8} };
+    EXPECT_EQ(changed, lc3s.mem_to_screen(m));
+
+    /* Code overwritten by a transfer runs as its new self */
+    const std::vector<uint16_t> program = {
+        0x1021, //ADD R0 R0 #1
+        0xF025, //HALT
+        0x1022, //ADD R0 R0 #2, copied over the first instruction
+    };
+    for(size_t i = 0; i < program.size(); i++) m.mem_write(0x3000 + i, program[i]);
+    std::ostringstream output;
+    m.console.to_stream(output);
+    m.engine = LC3Machine::Engine::Decoded;
+    m.reset();
+    m.run();
+    EXPECT_EQ(1, m.reg[R_R0]);
+    m.mem_write(MR_DMASRC, 0x3002);
+    m.mem_write(MR_DMADST, 0x3000);
+    m.mem_write(MR_DMALEN, 1);
+    m.mem_write(MR_DMAS, DMA_COPY);
+    m.reset();
+    m.run();
+    EXPECT_EQ(2, m.reg[R_R0]);
+
+    /* Completion interrupt */
+    m.mem_write(0x3000, 0x0FFF); //BR -1
+    m.mem_write(0x3001, 0x1261); //ISR ADD R1 R1 #1
+    m.mem_write(0x3002, 0x0FFF); //BR -1
+    m.mem_write(interruptVectorTable + INT_DMA, 0x3001);
+    m.reset();
+    m.reg[R_R6] = 0x4000;
+    m.mem_write(MR_DMALEN, 1);
+    m.mem_write(MR_DMAS, DS_IE | DMA_FILL);
+    m.run_for(10);
+    EXPECT_EQ(1, m.reg[R_R1]);
+    EXPECT_EQ(PL_DMA << 8, m.read_psr() & 0xFFF8);
+}
+
+TEST(TestDevice, Console) {
+    LC3Machine m;
+    std::ostringstream output;
+    m.console.to_stream(output);
+    /* OUT 'A' then spin, without HALT */
+    const std::vector<uint16_t> program = {
+        0x2002, //LD R0 CHAR
+        0xF021, //OUT
+        0x0FFF, //BR -1
+        0x0041, //CHAR .FILL 'A'
+    };
+    for(size_t i = 0; i < program.size(); i++) m.mem_write(0x3000 + i, program[i]);
+    for(auto engine : {LC3Machine::Engine::Reference, LC3Machine::Engine::Jit}) {
+        m.reset();
+        m.engine = engine;
+        output.str("");
+        m.run_for(1000);
+        /* Buffered until the flush deadline */
+        EXPECT_EQ("", output.str());
+        m.run_for(Console::FLUSH_INSTRUCTIONS);
+        EXPECT_EQ("A", output.str());
+    }
+
+    m.console.to_memory();
+
+    /* DDR prints its low byte, DSR is always ready */
+    EXPECT_EQ(DS_READY, m.mem_read(MR_DSR));
+    m.mem_write(MR_DDR, 'h');
+    m.mem_write(MR_DDR, 'i');
+    EXPECT_EQ("hi", m.console.take());
+
+    /* A full buffer goes out at once, to a file descriptor here */
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    m.console.to_fd(fds[1]);
+    const std::string block(Console::BUFFER_SIZE / 4, 'x');
+    for (int i = 0; i < 4; i++) m.console.put(m, block.c_str());
+    m.console.put(m, 'y');
+    std::vector<char> buffer(Console::BUFFER_SIZE);
+    size_t got = 0;
+    while (got < buffer.size()) got += read(fds[0], buffer.data() + got, buffer.size() - got);
+    EXPECT_EQ('x', buffer.back());
+    m.console.flush();
+    EXPECT_EQ(1, read(fds[0], buffer.data(), buffer.size()));
+    EXPECT_EQ('y', buffer[0]);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST(TestTrap, VectorTable) {
+    LC3Machine m;
+    std::ostringstream output;
+    m.console.to_stream(output);
+    const std::vector<uint16_t> program = {
+        0xF040, //TRAP x40
+        0x1261, //ADD R1 R1 #1
+        0xF021, //OUT
+        0xF025, //HALT
+    };
+    for(size_t i = 0; i < program.size(); i++) m.mem_write(0x3000 + i, program[i]);
+    /* x40: ADD R0 R0 #5, RET. OUT: ADD R2 R2 #1, RET */
+    m.mem_write(0x40, 0x4000);
+    m.mem_write(0x4000, 0x1025);
+    m.mem_write(0x4001, 0xC1C0);
+    m.mem_write(TRAP_OUT, 0x4010);
+    m.mem_write(0x4010, 0x14A1);
+    m.mem_write(0x4011, 0xC1C0);
+    for (auto engine : {LC3Machine::Engine::Reference, LC3Machine::Engine::Decoded,
+                        LC3Machine::Engine::Threaded, LC3Machine::Engine::Jit}) {
+        m.engine = engine;
+        m.reset();
+        m.run();
+        EXPECT_EQ(5, m.reg[R_R0]);
+        EXPECT_EQ(1, m.reg[R_R1]);
+        EXPECT_EQ(0, m.reg[R_R2]);
+        EXPECT_EQ(0x3001, m.reg[R_R7]);
+    }
+    /* OUT and HALT are native */
+    EXPECT_EQ("\x05HALT\x05HALT\x05HALT\x05HALT", output.str());
+
+    /* A native handler overrides the table, nullptr gives the vector back */
+    m.set_trap(0x40, [](LC3Machine& m) { m.reg[R_R0] = 42; });
+    m.set_trap(TRAP_OUT, nullptr);
+    m.reset();
+    m.run();
+    EXPECT_EQ(42, m.reg[R_R0]);
+    EXPECT_EQ(1, m.reg[R_R2]);
+    EXPECT_EQ(0x3003, m.reg[R_R7]);
+    m.set_trap(0x40, nullptr);
+    m.reset();
+    m.run();
+    EXPECT_EQ(5, m.reg[R_R0]);
+}
+
+/* An OS image halts the machine by clearing MCR[15] */
+TEST(TestTrap, HaltThroughMcr) {
+    LC3Machine m;
+    m.console.to_memory();
+    m.set_trap(TRAP_HALT, nullptr);
+    m.mem_write(0x3000, 0x1261); //ADD R1 R1 #1
+    m.mem_write(0x3001, 0xF025); //HALT
+    /* HALT: AND R0 R0 #0, STI R0 MCR_PTR, BR to itself, MCR_PTR */
+    m.mem_write(TRAP_HALT, 0x4020);
+    m.mem_write(0x4020, 0x5020);
+    m.mem_write(0x4021, 0xB001);
+    m.mem_write(0x4022, 0x0FFF);
+    m.mem_write(0x4023, MR_MCR);
+    for (auto engine : {LC3Machine::Engine::Reference, LC3Machine::Engine::Decoded,
+                        LC3Machine::Engine::Threaded, LC3Machine::Engine::Jit}) {
+        m.engine = engine;
+        m.reset();
+        EXPECT_EQ(MCR_CLOCK, m.mem_read(MR_MCR));
+        EXPECT_EQ(LC3Machine::StopReason::Halted, m.run_for(100000));
+        EXPECT_FALSE(m.running);
+        EXPECT_EQ(4u, m.instructions);
+        EXPECT_EQ(1, m.reg[R_R1]);
+        EXPECT_EQ(0, m.mem_read(MR_MCR));
+        EXPECT_EQ(LC3Machine::StopReason::Halted, m.run_for(100));
+    }
+    EXPECT_EQ("", m.console.take());
+}
+
+TEST(TestTrap, HostServices) {
+    LC3Machine m;
+    install_host_traps(m);
+    auto trap = [&m](uint8_t vector, uint16_t r0, uint16_t r1, uint16_t r2) {
+        m.mem_write(0x3000, 0xF000 | vector);
+        m.reset();
+        m.reg[R_R0] = r0;
+        m.reg[R_R1] = r1;
+        m.reg[R_R2] = r2;
+        m.step();
+    };
+    trap(TRAP_MUL, 300, (uint16_t)-7, 0);
+    EXPECT_EQ((uint16_t)-2100, m.reg[R_R0]);
+    EXPECT_EQ(0xFFFF, m.reg[R_R1]);
+    trap(TRAP_MUL, 0x4000, 0x10, 0);
+    EXPECT_EQ(0, m.reg[R_R0]);
+    EXPECT_EQ(4, m.reg[R_R1]);
+    trap(TRAP_DIVMOD, (uint16_t)-23, 5, 0);
+    EXPECT_EQ((uint16_t)-4, m.reg[R_R0]);
+    EXPECT_EQ((uint16_t)-3, m.reg[R_R1]);
+    trap(TRAP_DIVMOD, 23, 0, 0);
+    EXPECT_EQ(23, m.reg[R_R0]);
+    EXPECT_EQ(0, m.reg[R_R1]);
+
+    trap(TRAP_MEMSET, 0x5000, 0xBEEF, 4);
+    EXPECT_EQ(0xBEEF, m.memory[0x5003]);
+    EXPECT_EQ(0, m.memory[0x5004]);
+    trap(TRAP_MEMCPY, 0x5002, 0x5000, 4);
+    EXPECT_EQ(0xBEEF, m.memory[0x5005]);
+    EXPECT_EQ(0, m.memory[0x5006]);
+
+    /* Random numbers vary, and repeat after a reset */
+    std::vector<uint16_t> first;
+    for (int run = 0; run < 2; run++) {
+        std::vector<uint16_t> values;
+        for (uint16_t i = 0; i < 8; i++) m.mem_write(0x3000 + i, 0xF000 | TRAP_RANDOM);
+        m.reset();
+        for (int i = 0; i < 8; i++) {
+            m.step();
+            values.push_back(m.reg[R_R0]);
+        }
+        if (run == 0) first = values;
+        else EXPECT_EQ(first, values);
+    }
+    EXPECT_NE(first[0], first[1]);
+}
+
+TEST(TestDebug, Disassemble) {
+    const std::vector<std::pair<uint16_t, std::string>> cases = {
+        {0x0E01, "BRnzp #001"},
+        {0x05FF, "BRz #1FF"},
+        {0x12A3, "ADD R1 R2 #3"},
+        {0x1283, "ADD R1 R2 R3"},
+        {0x12BD, "ADD R1 R2 #-3"},
+        {0x5A46, "AND R5 R1 R6"},
+        {0x927F, "XOR R1 R1 #-1"},
+        {0xD285, "LSHF R1 R2 #5"},
+        {0xD29F, "RSHFL R1 R2 #15"},
+        {0xD2B1, "RSHFA R1 R2 #1"},
+        {0x2C09, "LD R6 #009"},
+        {0xA206, "LDI R1 #006"},
+        {0xE3FE, "LEA R1 #1FE"},
+        {0x3A10, "ST R5 #010"},
+        {0xB00A, "STI R0 #00A"},
+        {0x6C7F, "LDR R6 R1 #3F"},
+        {0x7B81, "STR R5 R6 #01"},
+        {0x4FFD, "JSR #7FD"},
+        {0x4080, "JSR R2"},
+        {0xC1C0, "JMP R7"},
+        {0x8000, "RTI"},
+        {0xF025, "HALT"},
+        {0xF022, "PUTS"},
+        {0xF034, "TRAP x34"},
+    };
+    for (const auto& [instr, text] : cases) {
+        char out[DISASM_MAX];
+        EXPECT_EQ(text.size(), disassemble(instr, out));
+        EXPECT_EQ(text, out);
+    }
+    /* Every instruction fits */
+    for (uint32_t instr = 0; instr <= UINT16_MAX; instr++) {
+        char out[DISASM_MAX];
+        EXPECT_LT(disassemble(instr, out), DISASM_MAX);
+    }
+}
+
+/* The bytes of a file */
+static std::string slurp(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), {});
+}
+
+/* The .dbg format the assembler writes and -d, -S, -C and fpt-trace read */
+TEST(TestDebug, SymbolsRoundTrip) {
+    const std::string path = testing::TempDir() + "fpt_symbols.dbg";
+    {
+        DebugSymbols symbols;
+        /* Two .ORIG blocks, a file name with a space */
+        for (uint16_t a = 0; a < 3; a++) symbols.emplace_back(0x3000 + a, "src/main.asm", 4u + a);
+        for (uint16_t a = 0; a < 2; a++) symbols.emplace_back(0x4000 + a, "lib/my io.asm", 20u + a);
+        symbols.add_label("MAIN", 0x3000);
+        symbols.add_label("PUTC", 0x4000);
+        symbols.add_label("PUTC_ALIAS", 0x4000);
+        symbols.add_label("LOOP", 0x3001);
+        std::ofstream file(path);
+        symbols.serialize(file);
+    }
+    const DebugSymbols symbols(path);
+    std::remove(path.c_str());
+    ASSERT_EQ(5u, symbols.size());
+    ASSERT_NE(nullptr, symbols.find(0x3002));
+    EXPECT_EQ("src/main.asm", symbols.find(0x3002)->file);
+    EXPECT_EQ(6u, symbols.find(0x3002)->line);
+    ASSERT_NE(nullptr, symbols.find(0x4001));
+    EXPECT_EQ("lib/my io.asm", symbols.find(0x4001)->file);
+    EXPECT_EQ(21u, symbols.find(0x4001)->line);
+    EXPECT_EQ(nullptr, symbols.find(0x3003));
+    EXPECT_EQ(nullptr, symbols.find(0x2FFF));
+
+    ASSERT_NE(nullptr, symbols.label_at(0x4000));
+    EXPECT_EQ("PUTC", *symbols.label_at(0x4000));
+    EXPECT_EQ(nullptr, symbols.label_at(0x3002));
+    ASSERT_NE(nullptr, symbols.label_of(0x3002));
+    EXPECT_EQ("LOOP", *symbols.label_of(0x3002));
+    ASSERT_NE(nullptr, symbols.label_of(0x5000));
+    EXPECT_EQ("PUTC", *symbols.label_of(0x5000));
+    EXPECT_EQ(nullptr, symbols.label_of(0x2FFF));
+}
+
+TEST(TestDebug, TraceFile) {
+    const std::string path = testing::TempDir() + "fpt_trace";
+    const std::vector<TraceRecord> records = {
+        {0x3000, 0x1021, 0x01, {1}},          //ADD R0 R0 #1
+        {0x3001, 0x0FFE, 0x00, {}},           //BR -2
+        {0x3000, 0x1021, 0x01, {2}},          //again, same word
+        {0x3001, 0x0FFE, 0x00, {}},
+        {0x3000, 0x1022, 0x01, {4}},          //rewritten
+        {0x0400, 0xC1C0, 0x82, {0, 5, 0, 0, 0, 0, 0, 0xBEEF}},
+        {0xFFFF, 0x0000, 0x00, {}},
+        {0x0000, 0x0000, 0x00, {}},           //wraps around
+    };
+    {
+        TraceWriter writer(path);
+        std::array<uint16_t, 8> regs{};
+        for (const auto& record : records) {
+            const auto before = regs;
+            for (int r = 0; r < 8; r++) if (record.changed >> r & 1) regs[r] = record.regs[r];
+            writer.record(record.pc, record.instr, before.data(), regs.data());
+        }
+        EXPECT_EQ(records.size(), writer.records());
+    }
+    /* The second pass of the loop has no instruction words */
+    EXPECT_EQ(8u + 9 + 3 + 5 + 1 + 7 + 11 + 5 + 3, slurp(path).size());
+
+    TraceReader reader(path);
+    TraceRecord record;
+    for (const auto& expected : records) {
+        ASSERT_TRUE(reader.next(record));
+        EXPECT_EQ(expected.pc, record.pc);
+        EXPECT_EQ(expected.instr, record.instr);
+        EXPECT_EQ(expected.changed, record.changed);
+        for (int r = 0; r < 8; r++) {
+            if (expected.changed >> r & 1) { EXPECT_EQ(expected.regs[r], record.regs[r]); }
+        }
+    }
+    EXPECT_FALSE(reader.next(record));
+
+    /* Cut in the middle of the last register value */
+    const std::string data = slurp(path);
+    std::ofstream(path, std::ios::binary) << data.substr(0, 8 + 9 + 3 + 5 + 1 + 7 + 10);
+    TraceReader truncated(path);
+    for (int i = 0; i < 5; i++) EXPECT_TRUE(truncated.next(record));
+    EXPECT_THROW(truncated.next(record), std::runtime_error);
+    std::ofstream(path, std::ios::binary) << "FPTTRC0\n";
+    EXPECT_THROW(TraceReader{path}, std::runtime_error);
+    std::remove(path.c_str());
+}
+
+TEST(TestProfile, Sampler) {
+    for (auto engine : {LC3Machine::Engine::Reference, LC3Machine::Engine::Jit}) {
+        LC3Machine m;
+        m.engine = engine;
+        const std::vector<uint16_t> program = {
+            0x1021, //LOOP ADD R0 R0 #1
+            0x1261, //ADD R1 R1 #1
+            0x0FFD, //BR LOOP
+        };
+        for(size_t i = 0; i < program.size(); i++) m.mem_write(0x3000 + i, program[i]);
+        PcSampler every(1), sparse(30);
+        m.add_device(every);
+        m.add_device(sparse);
+        m.reset();
+        m.run_for(3000);
+        /* The next instruction is sampled too */
+        EXPECT_EQ(3001u, every.samples);
+        EXPECT_EQ(1001u, every.counts[0x3000]);
+        EXPECT_EQ(1000u, every.counts[0x3001]);
+        EXPECT_EQ(1000u, every.counts[0x3002]);
+        /* Every 30th instruction is the same one of the loop */
+        EXPECT_EQ(101u, sparse.samples);
+        EXPECT_EQ(101u, sparse.counts[0x3000]);
+
+        /* Exact counts up to HALT */
+        m.mem_write(0x3001, 0xF025); //HALT
+        PcSampler halted(1);
+        m.add_device(halted);
+        m.console.to_memory();
+        m.reset();
+        m.run();
+        EXPECT_EQ(2u, halted.samples);
+        EXPECT_EQ(1u, halted.counts[0x3001]);
+    }
+}
+
+TEST(TestProfile, SourceLines) {
+    const std::string path = testing::TempDir() + "fpt_profile.dbg";
+    {
+        DebugSymbols symbols;
+        for (uint16_t a = 0; a < 4; a++) symbols.emplace_back(0x3000 + a, "src/game.asm", 10u + a);
+        symbols.emplace_back(0x3004, "src/game.asm", 12u);
+        symbols.add_label("MAIN", 0x3000);
+        symbols.add_label("DRAW", 0x3002);
+        std::ofstream file(path);
+        symbols.serialize(file);
+    }
+    const DebugSymbols symbols(path);
+    std::remove(path.c_str());
+    ASSERT_NE(nullptr, symbols.label_of(0x3003));
+    EXPECT_EQ("DRAW", *symbols.label_of(0x3003));
+    EXPECT_EQ(nullptr, symbols.label_of(0x2FFF));
+
+    std::vector<uint64_t> counts(UINT16_MAX + 1);
+    counts[0x3000] = 5;
+    counts[0x3002] = 20;
+    counts[0x3004] = 10; //same line as x3002, .STRINGZ say
+    counts[0x0400] = 1;
+    const SourceProfile profile(counts, &symbols);
+    EXPECT_EQ(36u, profile.total());
+    ASSERT_EQ(3u, profile.lines().size());
+    EXPECT_EQ("game.asm:12", profile.lines()[0].name);
+    EXPECT_EQ(30u, profile.lines()[0].count);
+    EXPECT_EQ("x0400", profile.lines()[2].name);
+    ASSERT_EQ(3u, profile.labels().size());
+    EXPECT_EQ("DRAW", profile.labels()[0].name);
+    EXPECT_EQ(30u, profile.labels()[0].count);
+    EXPECT_EQ("MAIN", profile.labels()[1].name);
+    EXPECT_EQ("(unknown)", profile.labels()[2].name);
+
+    std::ostringstream folded;
+    profile.folded(folded);
+    EXPECT_EQ("(unknown);x0400 1\nDRAW;game.asm:12 30\nMAIN;game.asm:10 5\n", folded.str());
+}
+
+TEST(TestProfile, CallStack) {
+    LC3Machine m;
+    m.console.to_memory();
+    const std::vector<uint16_t> program = {
+        0x4802, //MAIN JSR A
+        0xF025, //HALT
+        0x0000, //SAVE .FILL 0
+        0x3FFE, //A ST R7 SAVE
+        0x4802, //JSR B
+        0x2FFC, //LD R7 SAVE
+        0xC1C0, //RET
+        0x1021, //B ADD R0 R0 #1
+        0x1021, //ADD R0 R0 #1
+        0xC1C0, //RET
+    };
+    for(size_t i = 0; i < program.size(); i++) m.mem_write(0x3000 + i, program[i]);
+    DebugSymbols symbols;
+    symbols.add_label("MAIN", 0x3000);
+    symbols.add_label("A", 0x3003);
+    symbols.add_label("B", 0x3007);
+
+    CallProfile calls(m.pcStart);
+    m.reset();
+    while (m.running) {
+        const uint16_t pc = m.reg[R_PC], instr = m.memory[pc];
+        m.step();
+        calls.record(pc, instr, m.reg[R_PC], m.instructions);
+    }
+    const auto routines = calls.routines(&symbols);
+    ASSERT_EQ(3u, routines.size());
+    EXPECT_EQ("MAIN", routines[0].name);
+    EXPECT_EQ(9u, routines[0].inclusive);
+    EXPECT_EQ(2u, routines[0].exclusive);
+    EXPECT_EQ("A", routines[1].name);
+    EXPECT_EQ(7u, routines[1].inclusive);
+    EXPECT_EQ(4u, routines[1].exclusive);
+    EXPECT_EQ("B", routines[2].name);
+    EXPECT_EQ(3u, routines[2].inclusive);
+    EXPECT_EQ(1u, routines[2].calls);
+
+    std::ostringstream folded, json;
+    calls.folded(folded, &symbols);
+    EXPECT_EQ("MAIN 2\nMAIN;A 4\nMAIN;A;B 3\n", folded.str());
+    calls.chrome_trace(json, nullptr, m.instructions);
+    EXPECT_EQ("{\"traceEvents\":[\n"
+              "{\"name\":\"x3000\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":0,\"dur\":9},\n"
+              "{\"name\":\"x3007\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":3,\"dur\":3},\n"
+              "{\"name\":\"x3003\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":1,\"dur\":7}\n"
+              "],\"otherData\":{\"droppedCalls\":0,\"deepCalls\":0}}\n", json.str());
+}
+
+/* A routine entered with JSR and left with a branch never returns */
+TEST(TestProfile, CallNeverReturning) {
+    LC3Machine m;
+    m.console.to_memory();
+    const std::vector<uint16_t> program = {
+        0x4801, //MAIN JSR LOOP
+        0xF025, //HALT
+        0x1021, //LOOP ADD R0 R0 #1
+        0x0FFC, //BR MAIN
+    };
+    for(size_t i = 0; i < program.size(); i++) m.mem_write(0x3000 + i, program[i]);
+
+    CallProfile calls(m.pcStart);
+    m.reset();
+    const size_t loops = 2 * CallProfile::MAX_DEPTH;
+    for (size_t i = 0; i < 3 * loops; i++) {
+        const uint16_t pc = m.reg[R_PC], instr = m.memory[pc];
+        m.step();
+        calls.record(pc, instr, m.reg[R_PC], m.instructions);
+    }
+    std::ostringstream folded, json, report;
+    calls.folded(folded, nullptr);
+    /* One node per frame, the last one gets what ran deeper */
+    std::string line, last;
+    size_t lines = 0;
+    for (std::istringstream in(folded.str()); std::getline(in, line); lines++) last = line;
+    EXPECT_EQ(CallProfile::MAX_DEPTH + 1, lines);
+    EXPECT_EQ(" " + std::to_string(3 * loops - 3 * CallProfile::MAX_DEPTH + 2), last.substr(last.rfind(' ')));
+    calls.chrome_trace(json, nullptr, m.instructions);
+    EXPECT_NE(std::string::npos, json.str().find("\"deepCalls\":" + std::to_string(loops - CallProfile::MAX_DEPTH)));
+    calls.report(report, nullptr);
+    EXPECT_NE(std::string::npos, report.str().find("counted in their caller: " + std::to_string(loops - CallProfile::MAX_DEPTH)));
+}
+
+TEST(TestProfile, Stats) {
+    LC3Machine m;
+    m.console.to_memory();
+    m.stats.countOps = true;
+    const std::vector<uint16_t> program = {
+        0x1021, //ADD R0 R0 #1
+        0xA202, //LDI R1 KBSR_PTR
+        0xF020, //GETC
+        0xF025, //HALT
+        MR_KBSR, //KBSR_PTR
+    };
+    for(size_t i = 0; i < program.size(); i++) m.mem_write(0x3000 + i, program[i]);
+    std::ostringstream out;
+    StatsDump dump(out, 0);
+    m.add_device(dump);
+    m.reset();
+    /* GETC waiting for a key is not counted until it runs */
+    EXPECT_EQ(LC3Machine::StopReason::WaitingInput, m.run_for(100));
+    EXPECT_EQ(1u, m.stats.keyboardWaits);
+    EXPECT_EQ(0u, m.stats.traps[TRAP_GETC]);
+    EXPECT_EQ(0u, m.stats.ops[OP_TRAP]);
+    EXPECT_EQ(1u, m.stats.ops[OP_ADD]);
+    EXPECT_EQ(1u, m.stats.ops[OP_LDI]);
+    EXPECT_EQ(1u, m.stats.mmioReads);
+    m.input.push('a');
+    EXPECT_TRUE(m.wait_input());
+    EXPECT_EQ(LC3Machine::StopReason::Halted, m.run_for(100));
+    EXPECT_EQ(4u, m.instructions);
+    EXPECT_EQ(1u, m.stats.traps[TRAP_GETC]);
+    EXPECT_EQ(1u, m.stats.traps[TRAP_HALT]);
+    EXPECT_EQ(2u, m.stats.ops[OP_TRAP]);
+
+    /* A request is answered at the next device poll */
+    EXPECT_EQ("", out.str());
+    dump.request(m);
+    m.poll_devices();
+    EXPECT_NE(std::string::npos, out.str().find("Instructions: 4 "));
+    EXPECT_NE(std::string::npos, out.str().find("  LDI "));
+    EXPECT_NE(std::string::npos, out.str().find("  GETC "));
+
+    m.reset();
+    EXPECT_EQ(0u, m.stats.ops[OP_ADD]);
+    EXPECT_TRUE(m.stats.countOps);
+}
+
+/* A machine blocked on GETC answers a request before the next key */
+TEST(TestProfile, StatsWhileWaiting) {
+    struct SyncFlag : std::stringbuf {
+        std::atomic<bool> synced{false};
+        int sync() override { synced = true; return std::stringbuf::sync(); }
+    } buf;
+    std::ostream out(&buf);
+    LC3Machine m;
+    m.console.to_memory();
+    m.mem_write(0x3000, 0xF020); //GETC
+    m.mem_write(0x3001, 0xF025); //HALT
+    StatsDump dump(out, 0);
+    m.add_device(dump);
+    m.reset();
+    bool dumped = false;
+    std::thread typist([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        dump.request(m);
+        const auto end = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (!buf.synced && std::chrono::steady_clock::now() < end) std::this_thread::yield();
+        dumped = buf.synced;
+        m.input.push('a');
+    });
+    EXPECT_EQ(LC3Machine::StopReason::Halted, m.run());
+    typist.join();
+    EXPECT_TRUE(dumped);
+    EXPECT_NE(std::string::npos, buf.str().find("Instructions: 0 "));
+    EXPECT_EQ('a', m.reg[R_R0]);
+}
+
+class TestInterrupt : public ::testing::Test {
+public:
+    LC3Machine m;
+    uint16_t (&reg)[R_COUNT] = m.reg;
+    enum { PC_START = 0x3000 };
+    /* Counts timer ticks in R1 */
+    const std::vector<uint16_t> timer_program = {
+        0x2C09, //LD R6 STACK
+        0x2009, //LD R0 PERIOD
+        0xB00A, //STI R0 TMI_PTR
+        0x2008, //LD R0 IE
+        0xB009, //STI R0 TMR_PTR
+        0x0FFF, //LOOP BR LOOP
+        0x1261, //ISR ADD R1 R1 #1
+        0x1BA0, //ADD R5 R6 #0
+        0xA005, //LDI R0 TMR_PTR
+        0x8000, //RTI
+        0x4000, //STACK .FILL x4000
+        0x0001, //PERIOD .FILL #1
+        0x4000, //IE .FILL x4000
+        MR_TMI, //TMI_PTR
+        MR_TMR, //TMR_PTR
+    };
+    /* Last key in R1, number of keys in R2 */
+    const std::vector<uint16_t> keyboard_program = {
+        0x2C07, //LD R6 STACK
+        0x2007, //LD R0 IE
+        0xB007, //STI R0 KBSR_PTR
+        0x0FFF, //LOOP BR LOOP
+        0xA206, //ISR LDI R1 KBDR_PTR
+        0x14A1, //ADD R2 R2 #1
+        0x1BA0, //ADD R5 R6 #0
+        0x8000, //RTI
+        0x4000, //STACK .FILL x4000
+        0x4000, //IE .FILL x4000
+        MR_KBSR, //KBSR_PTR
+        MR_KBDR, //KBDR_PTR
+    };
+
+    void load(const std::vector<uint16_t>& program, uint8_t vector, uint16_t isr) {
+        for(size_t i = 0; i < program.size(); i++) m.mem_write(PC_START + i, program[i]);
+        m.mem_write(interruptVectorTable + vector, isr);
+        m.pcStart = PC_START;
+        m.reset();
+    }
+};
+
+TEST_F(TestInterrupt, Timer) {
+    load(timer_program, INT_TIMER, 0x3006);
+    m.run_for(10500);
+    EXPECT_EQ(10, reg[R_R1]);
+    EXPECT_EQ(0x4000 - 2, reg[R_R5]);
+    EXPECT_EQ(0x4000, reg[R_R6]);
+    std::array<uint16_t, R_COUNT> expected_reg;
+    std::copy(std::begin(reg), std::end(reg), expected_reg.begin());
+
+    /* The timer counts instructions: every engine sees the same ticks */
+    for(auto engine : {LC3Machine::Engine::Decoded, LC3Machine::Engine::Threaded, LC3Machine::Engine::Jit}) {
+        m.reset();
+        m.engine = engine;
+        m.run_for(10500);
+        for(int r = 0; r < R_COUNT; r++) EXPECT_EQ(expected_reg[r], reg[r]) << "R" << r;
+        EXPECT_EQ(10500u, m.instructions);
+    }
+
+    /* Polled: TMR is ready once per interval, reading it acknowledges */
+    m.mem_write(PC_START + 1, 0x0FFF); //BR to itself
+    m.reset();
+    m.mem_write(MR_TMI, 2);
+    m.run_for(1999);
+    EXPECT_EQ(0, m.mem_read(MR_TMR) & DS_READY);
+    m.run_for(1);
+    EXPECT_EQ(DS_READY, m.mem_read(MR_TMR) & DS_READY);
+    EXPECT_EQ(0, m.mem_read(MR_TMR) & DS_READY);
+}
+
+TEST_F(TestInterrupt, Keyboard) {
+    for(auto engine : {LC3Machine::Engine::Reference, LC3Machine::Engine::Decoded,
+                       LC3Machine::Engine::Threaded, LC3Machine::Engine::Jit}) {
+        load(keyboard_program, INT_KEYBOARD, 0x3004);
+        m.engine = engine;
+        m.input.push('a');
+        m.input.push('b');
+        EXPECT_EQ(LC3Machine::StopReason::Budget, m.run_for(100));
+        EXPECT_EQ('b', reg[R_R1]);
+        EXPECT_EQ(2, reg[R_R2]);
+        EXPECT_EQ(0, m.read_psr() & 0xFFF8); //back to priority 0
+        EXPECT_TRUE(m.input.empty());
+        /* Typed while running */
+        m.input.push('c');
+        m.run_for(100);
+        EXPECT_EQ('c', reg[R_R1]);
+        EXPECT_EQ(3, reg[R_R2]);
+    }
+}
+
+TEST_F(TestInterrupt, PriorityAndUserStack) {
+    load(keyboard_program, INT_KEYBOARD, 0x3004);
+    reg[R_PSR] = PL_KEYBOARD << 8;
+    m.input.push('a');
+    m.run_for(100);
+    EXPECT_EQ(0, reg[R_R2]);
+    EXPECT_EQ(DS_READY | DS_IE, m.memory[MR_KBSR]);
+
+    /* A user program at priority 0 runs the handler on the supervisor stack */
+    reg[R_PSR] = 0x8000;
+    reg[R_R6] = 0x5000;
+    m.savedSsp = 0x3000;
+    m.raise_device_event();
+    m.run_for(100);
+    EXPECT_EQ(1, reg[R_R2]);
+    EXPECT_EQ('a', reg[R_R1]);
+    EXPECT_EQ(0x3000 - 2, reg[R_R5]);
+    EXPECT_EQ(0x5000, reg[R_R6]);
+    EXPECT_EQ(0x3000, m.savedSsp);
+    EXPECT_EQ(0x8000, m.read_psr() & 0xFFF8);
+}
+
+class TestIdle : public TestInterrupt {
+public:
+    const std::vector<uint16_t> kbsr_program = {
+        0xA003, //LOOP LDI R0 KBSR_PTR
+        0x07FE, //BRzp LOOP
+        0xA002, //LDI R0 KBDR_PTR
+        0xF025, //HALT
+        MR_KBSR, //KBSR_PTR
+        MR_KBDR, //KBDR_PTR
+    };
+    /* Counts timer ticks in R1 by polling TMR */
+    const std::vector<uint16_t> tmr_program = {
+        0x2006, //LD R0 PERIOD
+        0xB006, //STI R0 TMI_PTR
+        0xA006, //LOOP LDI R0 TMR_PTR
+        0x07FE, //BRzp LOOP
+        0x1261, //ADD R1 R1 #1
+        0x0FFC, //BR LOOP
+        0x0000,
+        0x0001, //PERIOD .FILL #1
+        MR_TMI, //TMI_PTR
+        MR_TMR, //TMR_PTR
+    };
+};
+
+/* Nothing can wake the loop up: it stops as GETC would, without
+ * crediting the rest of the budget */
+TEST_F(TestIdle, ClosedKeyboard) {
+    load(kbsr_program, INT_KEYBOARD, 0);
+    m.input.close();
+    for(auto engine : {LC3Machine::Engine::Reference, LC3Machine::Engine::Decoded,
+                       LC3Machine::Engine::Threaded, LC3Machine::Engine::Jit}) {
+        m.reset();
+        m.engine = engine;
+        EXPECT_EQ(LC3Machine::StopReason::WaitingInput, m.run_for(UINT64_MAX));
+        EXPECT_LT(m.instructions, 100u);
+        EXPECT_EQ(0u, m.stats.idleSkipped);
+        EXPECT_EQ(LC3Machine::StopReason::WaitingInput, m.run());
+        EXPECT_LT(m.instructions, 200u);
+    }
+}
+
+/* Skipped iterations leave the machine as if they had run */
+TEST_F(TestIdle, TimerMatchesStep) {
+    load(tmr_program, INT_TIMER, 0);
+    m.input.close();
+    for(int i = 0; i < 200000; i++) m.step();
+    EXPECT_EQ(199, reg[R_R1]);
+    std::array<uint16_t, R_COUNT> expected_reg;
+    std::copy(std::begin(reg), std::end(reg), expected_reg.begin());
+    for(auto engine : {LC3Machine::Engine::Reference, LC3Machine::Engine::Decoded,
+                       LC3Machine::Engine::Threaded, LC3Machine::Engine::Jit}) {
+        m.reset();
+        m.engine = engine;
+        m.run_for(200000);
+        for(int r = 0; r < R_COUNT; r++) EXPECT_EQ(expected_reg[r], reg[r]) << "R" << r;
+        EXPECT_EQ(200000u, m.instructions);
+    }
+}
+
+TEST_F(TestIdle, SleepUntilKey) {
+    std::ostringstream output;
+    m.console.to_stream(output);
+    load(kbsr_program, INT_KEYBOARD, 0);
+    m.idleClockHz = 1000000;
+    m.engine = LC3Machine::Engine::Threaded;
+    std::thread typist([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        m.input.push('k');
+    });
+    const auto start = std::chrono::steady_clock::now();
+    const std::clock_t cpu_start = std::clock();
+    EXPECT_EQ(LC3Machine::StopReason::Halted, m.run());
+    const double cpu = double(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+    const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    typist.join();
+    EXPECT_EQ('k', reg[R_R0]);
+    EXPECT_LT(cpu, wall / 2);
+    /* Credited at about 1 MHz */
+    EXPECT_GT(m.instructions, 50000u);
+    EXPECT_LT(m.instructions, 10000000u);
+}
+
+class TestInput : public ::testing::Test {};
+
+TEST_F(TestInput, RingOrderAndCapacity) {
+    SpscRing<int, 8> ring;
+    int v;
+    EXPECT_FALSE(ring.pop(v));
+    for(int round = 0; round < 3; round++) { //wrap around
+        for(int i = 0; i < 8; i++) EXPECT_TRUE(ring.push(round * 8 + i));
+        EXPECT_FALSE(ring.push(-1));
+        EXPECT_EQ(8u, ring.size());
+        for(int i = 0; i < 8; i++) {
+            ASSERT_TRUE(ring.pop(v));
+            EXPECT_EQ(round * 8 + i, v);
+        }
+        EXPECT_TRUE(ring.empty());
+    }
+}
+
+TEST_F(TestInput, RingTwoThreads) {
+    auto ring = std::make_unique<SpscRing<uint32_t, 64>>();
+    const uint32_t count = 100000;
+    std::thread producer([&]() {
+        for(uint32_t i = 0; i < count; i++) while(!ring->push(i)) std::this_thread::yield();
+    });
+    uint32_t expected = 0, v;
+    while(expected < count) {
+        if(!ring->pop(v)) { std::this_thread::yield(); continue; }
+        ASSERT_EQ(expected, v);
+        expected++;
+    }
+    producer.join();
+    EXPECT_TRUE(ring->empty());
+}
+
+TEST_F(TestInput, WaitAndClose) {
+    InputBuffer input;
+    std::thread typist([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        input.push('a');
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        input.close();
+    });
+    EXPECT_EQ('a', input.pop_or_wait());
+    EXPECT_FALSE(input.wait());
+    EXPECT_EQ('\0', input.pop_or_wait());
+    typist.join();
+    EXPECT_TRUE(input.closed());
+}
+
+TEST_F(TestInput, KeyboardFromPipe) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    InputBuffer input;
+    KeyboardDevice keyboard(input, fds[0]);
+    keyboard.start();
+    /* More than the ring holds: the keyboard waits for the reader */
+    std::string typed;
+    for (int i = 0; i < 10000; i++) typed += (char)('a' + i % 26);
+    std::thread writer([&]() {
+        EXPECT_EQ((ssize_t)typed.size(), write(fds[1], typed.data(), typed.size()));
+        close(fds[1]);
+    });
+    std::string read;
+    for (char c; (c = input.pop_or_wait()); ) read += c;
+    writer.join();
+    EXPECT_EQ(typed, read);
+    EXPECT_TRUE(input.closed());
+    keyboard.stop();
+    close(fds[0]);
+}
+
+TEST_F(TestInput, KeyboardStopWhileIdle) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    InputBuffer input;
+    KeyboardDevice keyboard(input, fds[0]);
+    keyboard.start();
+    const auto start = std::chrono::steady_clock::now();
+    keyboard.stop();
+    keyboard.stop();
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+    EXPECT_FALSE(input.closed());
+    close(fds[0]);
+    close(fds[1]);
+}
+
 class TestVideo : public ::testing::Test {
 public:
+    LC3Machine m;
     LC3Screen lc3s;
     const uint16_t base_address = LC3Screen::BASE_VIDEO_MEMORY;
 };
@@ -275,18 +1520,18 @@ TEST_F(TestVideo, Little) {
     for (int x = 0; x < HEIGTH; x++) {
         if (x % 8 == 0) {
             for (int y = 0; y < WIDTH; y+=8) {
-                mem_write(address++, colors[color_index]);
+                m.mem_write(address++, colors[color_index]);
                 ++color_index %= COLOR_NUM;
             }
         }
         for (int y = 0; y < WIDTH; y+=16) {
-            mem_write88(address++, counter, counter+1);
+            m.mem_write88(address++, counter, counter+1);
             counter+=2;
         }
     }
     ASSERT_EQ(0xFD88, address);
 
-    lc3s.mem_to_screen();
+    lc3s.mem_to_screen(m);
 
     color_index = 0;
     counter = 0;
@@ -306,6 +1551,255 @@ TEST_F(TestVideo, Little) {
     }
 }
 
+/* Fill the video memory with a pattern depending on seed */
+static void fill_video(LC3Machine& m, uint16_t seed) {
+    for(uint16_t a = LC3Screen::BASE_VIDEO_MEMORY; a < LC3Screen::END_VIDEO_MEMORY; a++) {
+        m.mem_write(a, (uint16_t)(a * 0x9E37 + seed));
+    }
+}
+
+TEST_F(TestVideo, DirtyTiles) {
+    lc3s.attach(m);
+    fill_video(m, 1);
+    const std::vector<ScreenRect> full = { {0, 0, WIDTH, HEIGTH} };
+    EXPECT_EQ(full, lc3s.mem_to_screen(m));
+    EXPECT_TRUE(lc3s.mem_to_screen(m).empty());
+
+    /* Colour word of tile (3, 2), pixel word of tiles (14, 4) and (15, 4) */
+    const uint16_t row_words = LC3Screen::ROW_WORDS;
+    m.mem_write(base_address + 2 * row_words + 3, 0x1234);
+    m.mem_write(base_address + 4 * row_words + TWIDTH + 5 * (WIDTH / 16) + 7, 0xF00F);
+    const std::vector<ScreenRect> changed = { {24, 16, 8, 8}, {112, 32, 16, 8} };
+    EXPECT_EQ(changed, lc3s.mem_to_screen(m));
+    EXPECT_EQ(changed, lc3s.changed());
+
+    /* The same column on two tile rows is one rectangle */
+    m.mem_write(base_address + 5, 0);
+    m.mem_write(base_address + row_words + 5, 0);
+    const std::vector<ScreenRect> column = { {40, 0, 8, 16} };
+    EXPECT_EQ(column, lc3s.mem_to_screen(m));
+
+    /* Incremental frames match a full redraw */
+    LC3Screen full_redraw;
+    full_redraw.mem_to_screen(m);
+    EXPECT_EQ(full_redraw.screen, lc3s.screen);
+}
+
+TEST_F(TestVideo, DirtyTilesFromProgram) {
+    lc3s.attach(m);
+    fill_video(m, 2);
+    lc3s.mem_to_screen(m);
+    /* STR R1 R1 #0 with R1 = the colour word of tile (39, 24) */
+    const uint16_t target = base_address + 24 * LC3Screen::ROW_WORDS + 39;
+    for(auto engine : {LC3Machine::Engine::Reference, LC3Machine::Engine::Jit}) {
+        m.mem_write(0x3000, 0x7240); //STR R1 R1 #0
+        m.mem_write(0x3001, 0xF025); //HALT
+        m.reset();
+        m.reg[R_R1] = target;
+        m.engine = engine;
+        std::ostringstream output;
+        m.console.to_stream(output);
+        m.run();
+        EXPECT_EQ(target, m.memory[target]);
+        const std::vector<ScreenRect> changed = { {312, 192, 8, 8} };
+        EXPECT_EQ(changed, lc3s.mem_to_screen(m));
+    }
+}
+
+TEST_F(TestVideo, Expanders) {
+    std::vector<ExpandPair> expanders = { best_expander() };
+#if FPT_HAS_SIMD_EXPAND
+    expanders.push_back(expand_pair_sse2);
+    if (cpu_has_avx2()) expanders.push_back(expand_pair_avx2);
+#endif
+    uint32_t seed = 1;
+    auto next = [&seed]() { seed = seed * 1103515245 + 12345; return (uint16_t)(seed >> 8); };
+    for (int i = 0; i < 1000; i++) {
+        uint16_t pixels[8];
+        for (auto& p : pixels) p = next();
+        const uint16_t color_a = next(), color_b = next();
+        std::array<uint8_t, 8 * 24> expected{}, out{};
+        expand_pair_scalar(pixels, color_a, color_b, expected.data(), 24);
+        for (int ln = 0; ln < 8; ln++) {
+            for (int p = 0; p < 16; p++) {
+                const uint16_t color = p < 8 ? color_a : color_b;
+                ASSERT_EQ(((pixels[ln] >> (15 - p)) & 1) ? FG(color) : BG(color), expected[ln * 24 + p]);
+            }
+        }
+        for (auto expand : expanders) {
+            out.fill(0);
+            expand(pixels, color_a, color_b, out.data(), 24);
+            ASSERT_EQ(expected, out);
+        }
+    }
+}
+
+TEST_F(TestVideo, Sprites) {
+    lc3s.attach(m);
+    fill_video(m, 5);
+    lc3s.mem_to_screen(m);
+    const auto background = lc3s.screen;
+    /* A 16x16 frame of colour 0x42 at (100, 50), its pattern at 0x4000 */
+    for (int ln = 0; ln < SPRITE_SIDE; ln++) m.mem_write(0x4000 + ln, (ln == 0 || ln == 15) ? 0xFFFF : 0x8001);
+    const uint16_t sprite = LC3Screen::SPRITE_TABLE;
+    m.mem_write(sprite + LC3Screen::SPRITE_X, 100);
+    m.mem_write(sprite + LC3Screen::SPRITE_Y, 50);
+    m.mem_write(sprite + LC3Screen::SPRITE_PATTERN, 0x4000);
+    EXPECT_TRUE(lc3s.mem_to_screen(m).empty()); //not enabled yet
+    m.mem_write(sprite + LC3Screen::SPRITE_ATTR, LC3Screen::SPRITE_ENABLE | 0x42);
+    /* Tiles 12..14 x 6..8 */
+    const std::vector<ScreenRect> drawn = { {96, 48, 24, 24} };
+    EXPECT_EQ(drawn, lc3s.mem_to_screen(m));
+    EXPECT_EQ(0x42, lc3s.screen[50 * WIDTH + 100]);
+    EXPECT_EQ(0x42, lc3s.screen[65 * WIDTH + 115]);
+    /* Clear bits are transparent */
+    EXPECT_EQ(background[55 * WIDTH + 105], lc3s.screen[55 * WIDTH + 105]);
+
+    /* Sprite 0 is over sprite 1 */
+    const uint16_t sprite1 = sprite + LC3Screen::SPRITE_WORDS;
+    m.mem_write(sprite1 + LC3Screen::SPRITE_X, 100);
+    m.mem_write(sprite1 + LC3Screen::SPRITE_Y, 50);
+    m.mem_write(sprite1 + LC3Screen::SPRITE_PATTERN, 0x4000);
+    m.mem_write(sprite1 + LC3Screen::SPRITE_ATTR, LC3Screen::SPRITE_ENABLE | 0x24);
+    lc3s.mem_to_screen(m);
+    EXPECT_EQ(0x42, lc3s.screen[50 * WIDTH + 100]);
+    m.mem_write(sprite1 + LC3Screen::SPRITE_ATTR, 0);
+
+    /* Moving it partly off screen redraws the background where it was */
+    m.mem_write(sprite + LC3Screen::SPRITE_X, (uint16_t)-8);
+    m.mem_write(sprite + LC3Screen::SPRITE_Y, 0);
+    lc3s.mem_to_screen(m);
+    EXPECT_EQ(background[50 * WIDTH + 100], lc3s.screen[50 * WIDTH + 100]);
+    EXPECT_EQ(0x42, lc3s.screen[0]);
+    EXPECT_EQ(0x42, lc3s.screen[15 * WIDTH + 7]);
+    LC3Screen full_redraw;
+    full_redraw.mem_to_screen(m);
+    EXPECT_EQ(full_redraw.screen, lc3s.screen);
+}
+
+/* A dirty tile redraws its pair: a sprite on the clean half stays */
+TEST_F(TestVideo, SpriteOnCleanHalf) {
+    lc3s.attach(m);
+    fill_video(m, 6);
+    for (int ln = 0; ln < SPRITE_SIDE; ln++) m.mem_write(0x4000 + ln, 0xFFFF);
+    const uint16_t sprite = LC3Screen::SPRITE_TABLE;
+    m.mem_write(sprite + LC3Screen::SPRITE_X, 8);
+    m.mem_write(sprite + LC3Screen::SPRITE_Y, 0);
+    m.mem_write(sprite + LC3Screen::SPRITE_PATTERN, 0x4000);
+    m.mem_write(sprite + LC3Screen::SPRITE_ATTR, LC3Screen::SPRITE_ENABLE | 0x42);
+    lc3s.mem_to_screen(m);
+    EXPECT_EQ(0x42, lc3s.screen[8]);
+    /* Colour word of tile 0, tile 1 under the sprite is unchanged */
+    m.mem_write(base_address, 0x0000);
+    const std::vector<ScreenRect> changed = { {0, 0, 8, 8} };
+    EXPECT_EQ(changed, lc3s.mem_to_screen(m));
+    EXPECT_EQ(0x42, lc3s.screen[8]);
+    EXPECT_EQ(0x42, lc3s.screen[7 * WIDTH + 15]);
+    LC3Screen full_redraw;
+    full_redraw.mem_to_screen(m);
+    EXPECT_EQ(full_redraw.screen, lc3s.screen);
+}
+
+TEST_F(TestVideo, Palette) {
+    lc3s.attach(m);
+    lc3s.mem_to_screen(m);
+    EXPECT_EQ(0xFF0000u, lc3s.palette[0xE0]);
+    /* Two RGB565 entries from 0x10: white, then pure blue */
+    m.mem_write(LC3Screen::PALETTE_INDEX, 0x10);
+    m.mem_write(LC3Screen::PALETTE_DATA, 0xFFFF);
+    m.mem_write(LC3Screen::PALETTE_DATA, 0x001F);
+    EXPECT_EQ(0xFFFFFFu, lc3s.palette[0x10]);
+    EXPECT_EQ(0x0000FFu, lc3s.palette[0x11]);
+    EXPECT_EQ(0x12, m.memory[LC3Screen::PALETTE_INDEX]);
+    /* Every pixel may have changed */
+    const std::vector<ScreenRect> full = { {0, 0, WIDTH, HEIGTH} };
+    EXPECT_EQ(full, lc3s.mem_to_screen(m));
+    m.reset();
+    EXPECT_EQ(LC3Screen::rgb332(), lc3s.palette);
+}
+
+TEST_F(TestVideo, FrameCapture) {
+    for (auto format : {FrameWriter::Format::Raw, FrameWriter::Format::Y4m}) {
+        auto machine = std::make_unique<LC3Machine>();
+        auto screen = std::make_unique<LC3Screen>();
+        const std::string path = testing::TempDir() + "fpt_frames";
+        FrameWriter writer(format, path, 25);
+        FrameCapture capture(*screen, writer, 1000);
+        machine->mem_write(0x3000, 0x0FFF); //BR -1
+        fill_video(*machine, 3);
+        screen->attach(*machine);
+        machine->add_device(capture);
+        machine->reset();
+        /* Frames at 1000 and 2000 instructions, the second one is a repeat */
+        machine->run_for(2500);
+        machine->mem_write(base_address, 0x1234);
+        machine->run_for(2500);
+        writer.stop();
+        EXPECT_FALSE(writer.failed());
+        EXPECT_EQ(5u, writer.frames());
+
+        const std::string data = slurp(path);
+        std::remove(path.c_str());
+        const size_t pixels = WIDTH * HEIGTH;
+        if (format == FrameWriter::Format::Raw) {
+            const size_t frame = 3 * pixels;
+            ASSERT_EQ(5 * frame, data.size());
+            EXPECT_EQ(data.substr(0, frame), data.substr(frame, frame));
+            EXPECT_NE(data.substr(frame, frame), data.substr(2 * frame, frame));
+            EXPECT_EQ(data.substr(2 * frame, frame), data.substr(4 * frame, frame));
+            /* Pixel 0 of the last frame */
+            const uint32_t rgb = LC3Screen::rgb332()[screen->screen[0]];
+            EXPECT_EQ((uint8_t)(rgb >> 16), (uint8_t)data[4 * frame]);
+            EXPECT_EQ((uint8_t)(rgb >> 8), (uint8_t)data[4 * frame + 1]);
+            EXPECT_EQ((uint8_t)rgb, (uint8_t)data[4 * frame + 2]);
+        } else {
+            const std::string header = "YUV4MPEG2 W320 H200 F25:1 Ip A1:1 C444\n";
+            ASSERT_EQ(header.size() + 5 * (6 + 3 * pixels), data.size());
+            EXPECT_EQ(header, data.substr(0, header.size()));
+            EXPECT_EQ("FRAME\n", data.substr(header.size(), 6));
+        }
+    }
+}
+
+TEST_F(TestVideo, PpmSnapshots) {
+    fill_video(m, 4);
+    lc3s.attach(m);
+    const std::string pattern = testing::TempDir() + "fpt_snap%d.ppm";
+    FrameWriter writer(FrameWriter::Format::Ppm, pattern, 30);
+    FrameCapture capture(lc3s, writer, 1000);
+    capture.capture(m);
+    capture.capture(m);
+    writer.stop();
+    for (int i = 0; i < 2; i++) {
+        const std::string path = testing::TempDir() + "fpt_snap" + std::to_string(i) + ".ppm";
+        const std::string data = slurp(path);
+        const std::string header = "P6\n320 200\n255\n";
+        ASSERT_EQ(header.size() + 3 * WIDTH * HEIGTH, data.size());
+        EXPECT_EQ(header, data.substr(0, header.size()));
+        std::remove(path.c_str());
+    }
+}
+
+/* The path is not a printf format: only one %d, and %% */
+TEST_F(TestVideo, PpmPattern) {
+    for (const char* bad : {"fpt_snap%s.ppm", "fpt_snap%d%d.ppm", "fpt_snap%n%d.ppm", "fpt_snap%",
+                            "fpt_snap%%.ppm", "fpt_snap%99d.ppm", "fpt_snap%ld.ppm"}) {
+        EXPECT_THROW(FrameWriter(FrameWriter::Format::Ppm, testing::TempDir() + bad, 30), std::runtime_error) << bad;
+    }
+    fill_video(m, 4);
+    lc3s.attach(m);
+    {
+        FrameWriter writer(FrameWriter::Format::Ppm, testing::TempDir() + "fpt_%%snap%03d.ppm", 30);
+        FrameCapture capture(lc3s, writer, 1000);
+        capture.capture(m);
+        writer.stop();
+        EXPECT_EQ(1u, writer.frames());
+    }
+    const std::string path = testing::TempDir() + "fpt_%snap000.ppm";
+    EXPECT_EQ(15 + 3 * WIDTH * HEIGTH, slurp(path).size());
+    std::remove(path.c_str());
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -1,9 +1,13 @@
 #pragma once
 #include <cstdint>
+#include <map>
 #include <string>
 #include <vector>
 #include <filesystem>
+#include <fstream>
+#include <iterator>
 #include <algorithm>
+#include <stdexcept>
 
 struct DebugSymbol {
     uint16_t address;
@@ -11,17 +15,24 @@ struct DebugSymbol {
     unsigned line = 0;
 
     friend std::istream& operator>> (std::istream& is,       DebugSymbol& dbg_s) { return is >> dbg_s.address >> dbg_s.file >> dbg_s.line; }
-    friend std::ostream& operator<< (std::ostream& os, const DebugSymbol& dbg_s) { return os << dbg_s.address << dbg_s.file << dbg_s.line; }
+    friend std::ostream& operator<< (std::ostream& os, const DebugSymbol& dbg_s) { return os << dbg_s.address << ' ' << dbg_s.file << ' ' << dbg_s.line << '\n'; }
 };
 
+/* The .dbg file: a DebugSymbol per assembled word, in address order, then
+ * a "label <name> <address>" line per label */
 class DebugSymbols {
     std::vector<DebugSymbol> mSymbols;
+    std::map<uint16_t, std::string> mLabels;
 
     void deserialize(const std::string& in_filename) {
         std::ifstream in_file(in_filename);
-        while(in_file.tellg() != std::iostream::pos_type(-1)) {
-            in_file >> mSymbols.emplace_back();
-        }
+        if (!in_file) throw std::runtime_error("failed to open debug symbols: " + in_filename);
+        DebugSymbol dbg_s;
+        while(in_file >> dbg_s) mSymbols.push_back(dbg_s);
+        in_file.clear();
+        std::string tag, label;
+        uint16_t address;
+        while(in_file >> tag >> label >> address && tag == "label") add_label(label, address);
     }
 
 public:
@@ -30,21 +41,48 @@ public:
     template<typename ...T> auto push_back(T... types) { return mSymbols.push_back(types...); }
     template<typename ...T> auto emplace_back(T... types) { return mSymbols.emplace_back(types...); }
 
-    void serialize(std::ofstream& out_file) { for(const auto& dbg_s : mSymbols) out_file << dbg_s; }
+    void serialize(std::ofstream& out_file) {
+        for(const auto& dbg_s : mSymbols) out_file << dbg_s;
+        for(const auto& [address, label] : mLabels) out_file << "label " << label << ' ' << address << '\n';
+    }
+
+    /* The first label of an address is kept */
+    void add_label(const std::string& label, uint16_t address) { mLabels.emplace(address, label); }
+    /* The label of address, nullptr if it has none */
+    const std::string* label_at(uint16_t address) const {
+        auto it = mLabels.find(address);
+        return it == mLabels.end() ? nullptr : &it->second;
+    }
+    /* The closest label at or before address, i.e. the routine it belongs
+     * to, nullptr if there is none */
+    const std::string* label_of(uint16_t address) const {
+        auto it = mLabels.upper_bound(address);
+        if (it == mLabels.begin()) return nullptr;
+        return &std::prev(it)->second;
+    }
+
+    /* The symbol of address, nullptr if no instruction was assembled there */
+    const DebugSymbol* find(uint16_t address) const {
+        if (mSymbols.empty()) return nullptr;
+        auto offset = (size_t)(address - mSymbols[0].address);
+        if (offset < mSymbols.size() && mSymbols[offset].address == address) return &mSymbols[offset];
+        //Programs with more than one .ORIG have gaps
+        auto lb = std::lower_bound(mSymbols.begin(), mSymbols.end(), DebugSymbol{address},
+            [](const DebugSymbol& s1, const DebugSymbol& s2) {
+                return s1.address < s2.address;
+        });
+        if (lb == mSymbols.end() || lb->address != address) return nullptr;
+        return &*lb;
+    }
 
     const DebugSymbol& operator[](uint16_t address) const {
-        auto offset = address - mSymbols[0].address;
-        if (mSymbols[offset].address == address) {
-            return mSymbols[offset];
-        } else {
-            //TODO this should not happen, right?
-            auto lb = std::lower_bound(mSymbols.begin(), mSymbols.end(), DebugSymbol{address},
-                [](const DebugSymbol& s1, const DebugSymbol& s2) {
-                    return s1.address < s2.address;
-            });
-            //TODO meaningful error
-            if (lb == mSymbols.end() || lb->address != address) throw std::logic_error("Address not found");
-            return *lb;
-        }
+        const DebugSymbol* dbg_s = find(address);
+        //TODO meaningful error
+        if (!dbg_s) throw std::logic_error("Address not found");
+        return *dbg_s;
     }
+
+    size_t size() const { return mSymbols.size(); }
+    auto begin() const { return mSymbols.begin(); }
+    auto end() const { return mSymbols.end(); }
 };
\ No newline at end of file
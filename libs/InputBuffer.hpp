@@ -1,38 +1,91 @@
 #pragma once
 
-#include <mutex>
-#include <condition_variable>
-#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
 
+#include "SpscRing.hpp"
+
+/* Keyboard buffer: one thread types, the VM thread reads.
+ *
+ * Pushing and popping are lock-free, so polling an empty buffer (e.g. a
+ * program spinning on KBSR) costs a couple of loads. Only the blocking
+ * calls sleep, on an event counter bumped by every push, by close() and
+ * by wake(). A full buffer drops what is pushed.
+ */
 class InputBuffer {
-    std::queue<char> mBuffer;
-    std::mutex mMtx;
-    std::condition_variable mCond;
+    SpscRing<char, 4096> mRing;
+    std::atomic<uint32_t> mEvents{0};
+    std::atomic<bool> mClosed{false};
+    std::atomic<bool> mWoken{false};
+    std::atomic<bool>* mPushFlag = nullptr;
+
+    void signal() {
+        mEvents.fetch_add(1, std::memory_order_release);
+        mEvents.notify_all();
+        if(mPushFlag) mPushFlag->store(true, std::memory_order_release);
+    }
 public:
-    void push(char c) {
-        std::unique_lock<std::mutex> lck(mMtx);
-        if(mBuffer.empty()) mCond.notify_one();
-        mBuffer.push(c);
+    /* Also raise *flag on every push and on close(), for a reader that
+     * checks a flag instead of polling the buffer. Set it before typing. */
+    void set_push_flag(std::atomic<bool>* flag) { mPushFlag = flag; }
+    /* false if the buffer is full */
+    bool push(char c) {
+        if(!mRing.push(c)) return false;
+        signal();
+        return true;
     };
     void push(char c_str[]) {
-        std::unique_lock<std::mutex> lck(mMtx);
-        if(mBuffer.empty()) mCond.notify_all();
-        for(int i = 0; c_str[i] != '\0'; i++) {
-            mBuffer.push(c_str[i]);
-        }
+        for(int i = 0; c_str[i] != '\0' && mRing.push(c_str[i]); i++);
+        signal();
     };
+    /* No more input will come: waiting pops get '\0' once empty */
+    void close() {
+        mClosed.store(true, std::memory_order_release);
+        signal();
+    }
+    bool closed() const { return mClosed.load(std::memory_order_acquire); }
+    bool empty() const { return mRing.empty(); }
+    /* Make the reader's current or next wait return without input, e.g.
+     * to handle a request from a signal handler. Async-signal-safe. */
+    void wake() {
+        mWoken.store(true, std::memory_order_release);
+        mEvents.fetch_add(1, std::memory_order_release);
+        mEvents.notify_all();
+    }
+    /* Block until there is something to pop or wake() is called, false if
+     * closed and empty */
+    bool wait() {
+        while(true) {
+            const uint32_t events = mEvents.load(std::memory_order_acquire);
+            if(!mRing.empty()) return true;
+            if(closed()) return !mRing.empty();
+            if(mWoken.exchange(false, std::memory_order_acquire)) return true;
+            mEvents.wait(events, std::memory_order_acquire);
+        }
+    }
+    /* Like wait(), giving up after timeout or on wake(), which both return
+     * false with nothing to pop. std::atomic has no timed wait,
+     * this one sleeps in steps of at most 1ms. */
+    template <typename Rep, typename Period>
+    bool wait_for(std::chrono::duration<Rep, Period> timeout) {
+        using Clock = std::chrono::steady_clock;
+        const auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(timeout);
+        while(mRing.empty() && !closed()) {
+            if(mWoken.exchange(false, std::memory_order_acquire)) return false;
+            const auto now = Clock::now();
+            if(now >= deadline) return false;
+            std::this_thread::sleep_for(std::min<Clock::duration>(deadline - now, std::chrono::milliseconds(1)));
+        }
+        return !mRing.empty();
+    }
     char pop_or_wait() {
-        std::unique_lock<std::mutex> lck(mMtx);
-        while(mBuffer.empty()) mCond.wait(lck);
-        char c = mBuffer.front();
-        mBuffer.pop();
-        return c;
+        return wait() ? pop() : '\0';
     }
     char pop() {
-        std::unique_lock<std::mutex> lck(mMtx);
-        if(mBuffer.empty()) return '\0';
-        char c = mBuffer.front();
-        mBuffer.pop();
-        return c;
+        char c;
+        return mRing.pop(c) ? c : '\0';
     }
 };
\ No newline at end of file
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+/* Fixed-capacity lock-free ring for one producer thread and one consumer
+ * thread. push() and pop() never block, they fail when full or empty.
+ *
+ * Each side owns one index and keeps a cached copy of the other one, so an
+ * empty poll only reads a cache line that the producer rarely writes.
+ */
+template <typename T, size_t Capacity>
+class SpscRing {
+    static_assert(Capacity && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    alignas(64) std::atomic<size_t> mHead{0}; /* next slot to write, producer side */
+    size_t mTailCache = 0;
+    alignas(64) std::atomic<size_t> mTail{0}; /* next slot to read, consumer side */
+    size_t mHeadCache = 0;
+    alignas(64) T mBuffer[Capacity];
+
+public:
+    /* Producer only */
+    bool push(const T& value) {
+        const size_t head = mHead.load(std::memory_order_relaxed);
+        if (head - mTailCache == Capacity) {
+            mTailCache = mTail.load(std::memory_order_acquire);
+            if (head - mTailCache == Capacity) return false;
+        }
+        mBuffer[head & (Capacity - 1)] = value;
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Consumer only */
+    bool pop(T& value) {
+        const size_t tail = mTail.load(std::memory_order_relaxed);
+        if (tail == mHeadCache) {
+            mHeadCache = mHead.load(std::memory_order_acquire);
+            if (tail == mHeadCache) return false;
+        }
+        value = mBuffer[tail & (Capacity - 1)];
+        mTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Exact from the consumer, a snapshot from anywhere else */
+    bool empty() const { return mHead.load(std::memory_order_acquire) == mTail.load(std::memory_order_acquire); }
+    size_t size() const {
+        const size_t tail = mTail.load(std::memory_order_acquire);
+        return mHead.load(std::memory_order_acquire) - tail;
+    }
+    static constexpr size_t capacity() { return Capacity; }
+};